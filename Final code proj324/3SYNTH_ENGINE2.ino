@@ -1,31 +1,170 @@
 #include "PERIPHERALS.h"
+#include "PROFILER.h"
 #include "SAMPLES_WAVEFORM_GEN.h"
+#include "ENVELOPE.h"
+#include "MODULATION.h"
+#include "FILTER.h"
 #include "USARTISR_MIDI.h"
+#include "POWER.h"
+#include "SAMPLE_STREAM.h"
 
+#if SAMPLE_STREAMING
+#define GATE_OUT_PIN PIND7                                  // PINB4 is MISO, which the sample flash needs (Arduino pin 7 instead)
+#define GATE_OUT_PORT PORTD
+#define GATE_OUT_DDR DDRD
+#else
 #define GATE_OUT_PIN PINB4                                  // For envelope generator and LED PINB4 used to control gate output
+#define GATE_OUT_PORT PORTB
+#define GATE_OUT_DDR DDRB
+#endif
 #define SELECT_WAVE_PIN PINB1                               // PINB1 used as input from button to toggle through waveforms
-#define INCREMENT_TABLE_SIZE 50                             // Increment table used to increment through table at a given frequency without needing floating point numbers (the larger the size, the more accurate the frequency)
+
+#ifndef VOICE_COUNT
+#if HIGH_SAMPLE_RATE
+#define VOICE_COUNT (SAMPLE_STREAMING ? 1 : 2)              // at 32kHz there is only half the time per sample, see the cycle budget below. Streaming from flash needs the second voice's time for the reads
+#else
+#define VOICE_COUNT 4                                       // number of voices mixed by the sample interrupt. Fewer voices leaves room for a higher Fs, more voices needs a lower one
+#endif
+#endif
+#define NOTE_STACK_SIZE 10                                  // number of held keys remembered so a key still held can take back a voice when another is released
+#define NO_NOTE 255                                         // returned when there is no note to give
+
+#define STEAL_OLDEST 0                                      // when every voice is busy a new note takes the voice that started longest ago
+#define STEAL_QUIETEST 1                                    // when every voice is busy a new note takes the voice with the lowest amplitude (oldest of those on a tie)
+#ifndef VOICE_STEAL_MODE
+#define VOICE_STEAL_MODE STEAL_QUIETEST
+#endif
+
+#if VOICE_COUNT < 1 || VOICE_COUNT > 16
+#error "VOICE_COUNT must be 1 to 16 so the mix of 255 * 15 per voice fits in 16 bits"
+#elif VOICE_COUNT == 1
+#define MIX_SHIFT 0                                         // a single voice already fits the DAC (255 * 15 = 3825)
+#elif VOICE_COUNT <= 4
+#define MIX_SHIFT 1                                         // halve the mix, chords louder than two full voices saturate at DAC_MAX
+#else
+#define MIX_SHIFT 2
+#endif
+
+#ifndef RENDER_BLOCK_SIZE
+#define RENDER_BLOCK_SIZE 32                                // samples loop() renders at a time. Two blocks are buffered, so MIDI to audio latency is up to 2 * RENDER_BLOCK_SIZE / Fs (4ms at 16kHz, 2ms at 32kHz)
+#endif
+
+// Estimated AVR cycles per sample, hand counted from the instruction sequence. The sample interrupt saves a few
+// registers, pops one word from the block buffer and sends it at fosc/2, only waiting on what is left of the first
+// byte after the bookkeeping (the second byte finishes after the interrupt has returned). Rendering in loop()
+// costs a fixed part per sample (loop, clamp, store) plus, per voice, the 32 bit phase load/add/store, four flash table
+// reads (two neighbouring samples from each of the two waveforms being morphed), three signed 8x8 multiplies for the
+// interpolation and the morph, the 8x8 multiply by the gain and the shift. Every CONTROL_SAMPLES samples the LFO steps once
+// (MODULATION.h) and each voice steps its envelope and glide, works out a new gain (two 8x8 multiplies) and turns its pitch
+// into a phase increment (two flash lookups and a 32x16 multiply), and the filter (FILTER.h) runs once on the mix. All of it has
+// to fit in one sample period; synth_host bench reports the same from the host build. With SAMPLE_STREAMING every voice
+// checks which source it plays (a voice playing from its ring is cheaper than the wave tables: two SRAM reads, one
+// multiply and the position add) and works out its sample step each control tick (another 32x16 multiply), every sample
+// interrupt looks through the rings for the one to refill and one that reads a chunk from the flash takes SAMPLE_CHUNK_CYCLES
+// longer. Each voice streaming at SAMPLE_STEP_MAX plays that many bytes a sample, and the flash reads that bring them in
+// come out of what the sample period has left over
+#define SAMPLE_SCAN_CYCLES (12 + VOICE_COUNT * 14)
+#define ISR_CYCLES (90 + SAMPLE_STREAMING * SAMPLE_SCAN_CYCLES)
+#define RENDER_SAMPLE_CYCLES 20
+#define RENDER_VOICE_CYCLES (104 + SAMPLE_STREAMING * 4)
+#define CONTROL_TICK_CYCLES 40
+#define CONTROL_VOICE_CYCLES (140 + SAMPLE_STREAMING * 40)
+#define CONTROL_CYCLES (CONTROL_TICK_CYCLES + VOICE_COUNT * CONTROL_VOICE_CYCLES)
+#define SAMPLE_CYCLES (ISR_CYCLES + RENDER_SAMPLE_CYCLES + VOICE_COUNT * RENDER_VOICE_CYCLES + CONTROL_CYCLES / CONTROL_SAMPLES + FILTER_ENABLED * FILTER_CYCLES)
+#define LOOP_PASS_CYCLES 40                                 // a loop() pass that finds nothing to do and sleeps again, wake up included
+#define WAKE_MIDI_CYCLES 300                                // waking from idle (POWER.h): the note on's USART interrupt, processMidiEvent and startVoice...
+#define POWER_WAKE_CYCLES (WAKE_MIDI_CYCLES + SAMPLE_STREAMING * (SAMPLE_RING_SIZE / SAMPLE_CHUNK) * SAMPLE_CHUNK_CYCLES + \
+                           RENDER_BLOCK_SIZE * (SAMPLE_CYCLES - ISR_CYCLES) + F_CPU / Fs)   // ...filling a sample's ring, rendering the first block, then a sample period until the first interrupt
+#define SAMPLE_FETCH_CYCLES ((VOICE_COUNT * SAMPLE_STEP_MAX * SAMPLE_CHUNK_CYCLES / SAMPLE_CHUNK) >> 16)   // flash reads per sample period with every voice streaming at SAMPLE_STEP_MAX
+static_assert(SAMPLE_CYCLES < (F_CPU / Fs) - 1, "VOICE_COUNT voices do not fit in the sample period at this Fs");
+static_assert(!SAMPLE_STREAMING || ((RENDER_BLOCK_SIZE * SAMPLE_STEP_MAX) >> 16) + 1 <= SAMPLE_RING_SIZE - SAMPLE_CHUNK, "a block at SAMPLE_STEP_MAX reads more than a primed ring holds");
+static_assert(!SAMPLE_STREAMING || ISR_CYCLES + SAMPLE_CHUNK_CYCLES < (F_CPU / Fs) - 1, "a SAMPLE_CHUNK flash read doesn't fit in the sample interrupt at this Fs");
+static_assert(!SAMPLE_STREAMING || SAMPLE_CYCLES + LOOP_PASS_CYCLES + SAMPLE_FETCH_CYCLES < (F_CPU / Fs) - 1,
+              "the sample period has no room for the flash reads that keep every voice streaming at SAMPLE_STEP_MAX, lower it or VOICE_COUNT");
+static_assert((CONTROL_SAMPLES & (CONTROL_SAMPLES - 1)) == 0 && RENDER_BLOCK_SIZE % CONTROL_SAMPLES == 0, "CONTROL_SAMPLES must be a power of two that divides RENDER_BLOCK_SIZE");
 
 typedef struct voice                                        // this struct represents a synthesizer voice
 {
-  volatile uint16_t table_position = 0;                     // table_position determines where in the waveform table the voice is currently (volatile as will be written to timer 1 interrupt)
+  uint32_t phase = 0;                                       // fixed point position in the waveform table, integer part is the table index
+  uint32_t phase_increment = 0;                             // amount added to phase every sample, worked out from pitch and the modulation every control tick
+  uint32_t pitch = 0;                                       // Q16 semitones (Q8 pitch << GLIDE_SHIFT, MODULATION.h) before bend and vibrato, glides towards target_pitch
+  uint32_t target_pitch = 0;                                // note << (PITCH_SHIFT + GLIDE_SHIFT)
+  uint32_t glide_step = 0;                                  // pitch moved per control tick while gliding
+  const uint8_t* wave_a = waveTables[WAVE_SINE][0];         // waveMorphTable at this note's mip level
+  const uint8_t* wave_b = waveTables[WAVE_SINE][0];         // the next waveform along at the same mip level
+  uint8_t mip_level = 0;                                    // band limited level for the note, from waveMipLevel
   uint8_t note = 0;                                         // note records the current midi note value
-  uint8_t amplitude_val = 0;                                // amplitude_val determines the amplitude value to apply to the note (should be 0 to 16)
-  uint8_t increment_table[INCREMENT_TABLE_SIZE];            // the increment table values are used to increment through the table at a given frequency without requiring floating point numbers
-  volatile uint8_t increment_table_pos = 0;                 // a value used to increment through the increment_table (volatile as will be written to timer 1 interrupt)
-  uint8_t previous_notes[10];                               // these are the previous note values in case of a key being released while other keys are still pressed, the Voice will play a previous note value until all keys are released
-  uint8_t notes_pressed = 0;                                // the number of previous notes still being held
-  uint8_t increment_table_proc = 0;                         // 1 if the increment_table needs to be reprocessed, 0 if it doesn't
+  uint8_t amplitude_val = 0;                                // amplitude_val is the note's velocity level (0 to 15), the envelope scales it down from there
+  uint8_t gain = 0;                                         // amplitude_val * envelope level, worked out every control tick and applied to every sample (0 to 239)
+  Envelope envelope;
+#if SAMPLE_STREAMING
+  SampleStream stream;                                      // the sample the voice plays instead of the wave tables, if stream.state isn't STREAM_OFF
+#endif
+  uint8_t active = 0;                                       // 1 while the voice is playing a held key, 0 once it is released (it keeps sounding until its envelope has finished the release)
+  uint16_t started = 0;                                     // value of voiceClock when the note started, used to find the oldest voice
 } Voice;
 
-Voice osc;                                                  // the voice that will act as a digital oscillator
+typedef struct keyboard                                     // keys currently held down, independent of which of them have a voice
+{
+  uint8_t previous_notes[NOTE_STACK_SIZE];                  // held notes in the order they were pressed, most recent last. If a key is released while others are still held, the most recent held key without a voice gets it back
+  uint8_t notes_pressed = 0;                                // the number of notes still being held
+} Keyboard;
+
+ENGINE_STATE Voice voices[VOICE_COUNT];                     // the voices that act as digital oscillators, mixed together by the timer 1 interrupt
+ENGINE_STATE Keyboard keys;
+ENGINE_STATE uint16_t voiceClock = 0;                       // counts note ons, so the voice with the smallest started value relative to it is the oldest
+
+ENGINE_STATE volatile uint16_t sampleBlocks[2][RENDER_BLOCK_SIZE]; // ping-pong buffer: loop() renders into one block while timer 1 interrupt plays the other
+ENGINE_STATE volatile uint8_t blockReady[2] = {0, 0};       // 1 once loop() has filled a block, set back to 0 by timer 1 interrupt once it has played it
+ENGINE_STATE volatile uint8_t playingBlock = 0;             // block timer 1 interrupt is playing
+ENGINE_STATE volatile uint8_t playingIndex = 0;             // next sample of playingBlock to send to the DAC
+ENGINE_STATE uint8_t renderingBlock = 0;                    // block loop() fills next
+ENGINE_STATE volatile uint16_t bufferUnderruns = 0;         // samples where timer 1 interrupt found no rendered block, the DAC holds its last value instead
 
+// Telemetry report, sent as SysEx when F0 MIDI_SYSEX_ID TELEMETRY_REPORT F7 is received:
+//   F0 7D 01 <TELEMETRY_VERSION> <PROFILING> <first field> <field>... F7
+// in pieces of up to TELEMETRY_PIECE_FIELDS fields, each a SysEx of its own, so MIDI THRU's channel voice messages go out in
+// between instead of waiting for the whole report. Every field is a 32 bit value sent as 5 data bytes, 7 bits at a time,
+// least significant first. The fields are midiDroppedEvents, midiParseErrors, usartTxHighWater, usartTxOverflows,
+// bufferUnderruns, free SRAM, sampleUnderruns (SAMPLE_STREAM.h) and midiThruDropped, then for each profiler probe
+// (PROFILER.h) its count, total, min, max and PROFILE_BUCKETS histogram buckets (all 0 unless PROFILING)
+#define TELEMETRY_REPORT 0x01                               // request the telemetry report
+#define TELEMETRY_RESET 0x02                                // clear the profiler statistics
+#define TELEMETRY_VERSION 4
+#define TELEMETRY_COUNTERS 8
+#define TELEMETRY_PROBE_FIELDS (4 + PROFILE_BUCKETS)
+#define TELEMETRY_FIELDS (TELEMETRY_COUNTERS + PROFILE_PROBES * TELEMETRY_PROBE_FIELDS)
+#define TELEMETRY_HEADER_BYTES 6                            // F0 to the first field number
+#define TELEMETRY_FIELD_BYTES 5
+#define TELEMETRY_PIECE_FIELDS 4
+#define TELEMETRY_PIECE_BYTES (TELEMETRY_HEADER_BYTES + TELEMETRY_PIECE_FIELDS * TELEMETRY_FIELD_BYTES + 1)
+#define TELEMETRY_THRU_ROOM 16                              // transmit queue bytes a piece leaves free for MIDI THRU while it goes out
+#define TELEMETRY_IDLE 255
+static_assert(TELEMETRY_FIELDS < 128, "the first field of a piece is sent as one data byte");
+static_assert(TELEMETRY_PIECE_BYTES + TELEMETRY_THRU_ROOM <= USART_TX_BUFFER_SIZE, "a telemetry piece doesn't fit in the transmit queue");
+ENGINE_STATE uint8_t telemetryNextField = TELEMETRY_IDLE;   // next field of the report to send, TELEMETRY_IDLE when no report is being sent
+ENGINE_STATE uint8_t telemetryPieceEnd = 0;                 // field the open piece ends before
 
-void processMidiEvent (const MidiEvent* const midiEvent);   // takes in a MidiEvent and uses its data to correctly update the Voice data structure
-void process_increment_table();                             // processes the increment_table values for the Voice
 
-uint8_t currentWaveIsSelected = 0;                          // Boolean value used so when button pressed, synth doesnt change through all waveforms
-uint8_t currentWaveLocation = 0;                            // determines which wave is selected sine=0, tri=1, square=2, saw=3
+void processMidiEvent (const MidiEvent* const midiEvent);   // takes in a MidiEvent and uses its data to correctly update the voices and held keys
+void startVoice (Voice* voice, uint8_t note, uint8_t amplitude, uint16_t glide_from);   // points a voice at a new note, gliding from glide_from (a pitch, or NO_PITCH) with portamento on
+Voice* allocateVoice ();                                    // finds a free voice, or steals one according to VOICE_STEAL_MODE
+Voice* findVoice (uint8_t note);                            // the active voice playing a note, or 0
+void pushHeldNote (uint8_t note);                           // records a key press on top of the held key stack
+void removeHeldNote (uint8_t note);                         // removes a released key from the held key stack
+void processControlChange (uint8_t controller, uint8_t value);   // envelope, modulation, filter and waveform controllers
+void setVoiceWaves (Voice* voice);                          // points a voice at its mip level of the current morph waveforms
+void setWaveMorph ();                                       // re-points every voice after waveMorphTable changes
+void controlTick ();                                        // steps the LFO, every voice's envelope and glide and updates its gain and phase increment, once per CONTROL_SAMPLES samples
+void sendTelemetry ();                                      // handles telemetry requests and sends the report a few bytes per pass of loop()
+void renderBlock (volatile uint16_t* block);                // mixes RENDER_BLOCK_SIZE samples of every voice into block
+void fillSampleStreams ();                                  // with timer 1 stopped, fills every streaming voice's ring from flash
+uint8_t voicesSilent ();                                    // 1 once every voice's envelope has finished
+
+ENGINE_STATE volatile uint8_t currentWaveIsSelected = 0;    // Boolean value used so when button pressed, synth doesnt change through all waveforms
+ENGINE_STATE volatile uint8_t waveButtonPresses = 0;        // free running count of presses, advanced by the pin change interrupt
+ENGINE_STATE uint8_t waveButtonHandled = 0;                 // presses loop() has acted on
+ENGINE_STATE uint8_t currentWaveLocation = 0;               // determines which wave is selected sine=0, tri=1, square=2, saw=3
 
 //------------------------------------------------------------------------------------------------------------------------------------------------------------------
 //------------------------------------------------------------------------------SETUP-------------------------------------------------------------------------------
@@ -34,21 +173,24 @@ void setup ()
 {
   cli();  // disable interrupts
 
-  DDRB |= (1 << GATE_OUT_PIN);            // FOR envelope generator gate output and LED
-  PORTB &= ~(1 << GATE_OUT_PIN);          // FOR envelope generator gate output/LED pin low 
+  GATE_OUT_DDR |= (1 << GATE_OUT_PIN);    // FOR envelope generator gate output and LED
+  GATE_OUT_PORT &= ~(1 << GATE_OUT_PIN);  // FOR envelope generator gate output/LED pin low 
   DDRB &= ~(1 << SELECT_WAVE_PIN);        // wave selection pin is input for button press
+  PCMSK0 |= (1 << SELECT_WAVE_PIN);       // SELECT_WAVE_PIN is PCINT1, any change on it fires PCINT0_vect...
+  PCICR |= (1 << PCIE0);                  // ...so the button wakes the CPU instead of being polled
 
   // peripheral setup
   TIMER1_INIT();
   USART_INIT();
   SPIDAC_INIT();
+  powerInit();
+#if SAMPLE_STREAMING
+  sampleStreamInit();                     // the sample interrupt can't be using the bus yet, interrupts are still off
+#endif
+
+  // waveforms are already in flash (SAMPLES_WAVEFORM_GEN.h), nothing to generate at boot
+  envelopeSetTimes(ENVELOPE_DEFAULT_ATTACK_MS, ENVELOPE_DEFAULT_DECAY_MS, ENVELOPE_DEFAULT_SUSTAIN, ENVELOPE_DEFAULT_RELEASE_MS);
 
-  // setup waveform buffers
-  generateSine();             //Call sine function
-  generateTriangle();         //Call Triangle function
-  generateSquare();           //Call square function
-  generateSawtooth();         //Call saw function
-  
   sei();  // enable interrupts
 }
 
@@ -58,61 +200,129 @@ void setup ()
 
 void loop () 
 {
-  while (midiReadIndex != midiWriteIndex) // while there are MidiEvents in the MIDI event buffer, process them
+  uint8_t readIndex = midiReadIndex;
+  const uint8_t woken = readIndex != midiWriteIndex;        // MIDI to act on, the button only changes the waveform of notes still to come
+  if (readIndex != midiWriteIndex)
   {
-    processMidiEvent(&midiEventBuffer[midiReadIndex]);
-    midiReadIndex = (midiReadIndex + 1) % MIDI_EVENT_BUFFER_SIZE;
+    PROFILE_START(midi);
+    while (readIndex != midiWriteIndex) // while there are MidiEvents in the MIDI event buffer, process them
+    {
+      processMidiEvent(&midiEventBuffer[readIndex & MIDI_EVENT_BUFFER_MASK]);
+      midiReadIndex = ++readIndex;      // hand the slot back to the usart interrupt only once the event has been used
+    }
+    PROFILE_END(PROFILE_LOOP_MIDI, midi);
   }
 
-  if (osc.increment_table_proc)     // if increment_table needs processing (this is done after the processMidiEvent loop so that if a bunch of notes are pressed at once, we don't waste processing on all of them since their increment_tables won't be used)
+  while (waveButtonHandled != waveButtonPresses)                  // one step through the waveforms for every press since the last loop
   {
-    process_increment_table();
+    currentWaveLocation = (currentWaveLocation + 1) % 4;            // Update current wave location % to wrap around the 4 waveforms
+    waveMorphTable = currentWaveLocation;                           // straight to the waveform (sine, tri, square, saw), no morphing
+    waveMorphWeight = 0;
+    setWaveMorph();
+    waveButtonHandled++;
   }
-  
-  if (PINB & (1 << SELECT_WAVE_PIN) && !currentWaveIsSelected)   // if wave selection button pressed and hasn't stayed high since previous loop
+
+  if (powerIdle && woken)                   // timer 1 is stopped, so the blocks are loop()'s alone: drop the silence buffered in them and play the next block first
   {
-    currentWaveLocation = (currentWaveLocation + 1) % 4;            // Update current wave location % to wrap around the 4 waveforms
-    switch (currentWaveLocation)                                    // Sets current wave pointer to the right waveform
-    {
-      case 0  :                                                     // If in position 0 sine
-        wave_pointer = sineWave;
-        break;
-      case 1  :                                                     // If in position 1 triangle
-        wave_pointer = triangleWave;                                 
-        break;
-      case 2  :                                                     // If in position 2 square
-        wave_pointer = squareWave;                                   
-        break;
-      case 3  :                                                     // If in position 3 saw
-        wave_pointer = sawtoothWave;                                 
-        break;
-      default :                                                     // Default to sine
-        wave_pointer = sineWave;
-    }
-    currentWaveIsSelected = 1;                                                // As a wave has been selected set to 1
+    blockReady[0] = blockReady[1] = 0;
+    playingIndex = 0;
+    playingBlock = renderingBlock;
+#if SAMPLE_STREAMING
+    fillSampleStreams();                    // and no interrupt to read the flash: a sample that has woken the engine has to be ready for the first block
+#endif
   }
-  else if ( !(PINB & (1 << SELECT_WAVE_PIN)) && currentWaveIsSelected )       // if the wave selection button was released
+
+  if (!blockReady[renderingBlock])          // timer 1 interrupt has finished with this block, render the next one into it
   {
-    currentWaveIsSelected = 0;                                                // A new waveform hasnt been selected
+    PROFILE_START(render);
+    renderBlock(sampleBlocks[renderingBlock]);
+    PROFILE_END(PROFILE_LOOP_RENDER, render);
+    powerBlockRendered(sampleBlocks[renderingBlock], RENDER_BLOCK_SIZE, voicesSilent());
+    blockReady[renderingBlock] = 1;
+    renderingBlock ^= 1;
   }
+
+  if (powerIdle && woken)                   // the first block is ready, start playing it
+  {
+    powerStartSamples();
+  } else if (POWER_IDLE && !powerIdle && powerSettledBlocks == POWER_SETTLE_BLOCKS)
+  {
+    powerStopSamples();
+  }
+
+  if (telemetryCommand || telemetryNextField != TELEMETRY_IDLE)
+  {
+    sendTelemetry();
+  }
+
+  cli();
+  if (midiReadIndex == midiWriteIndex && waveButtonHandled == waveButtonPresses && !telemetryCommand && blockReady[renderingBlock] &&
+      (telemetryNextField == TELEMETRY_IDLE || USART_TxFree() < (midiTxSysExOpen ? TELEMETRY_FIELD_BYTES : TELEMETRY_PIECE_BYTES + TELEMETRY_THRU_ROOM)))   // nothing to do until an interrupt: a sample played, a byte received or sent, the button
+  {
+    powerSleep();
+  }
+  sei();
 }
 
 void processMidiEvent (const MidiEvent* const midiEvent)                      //Deals with MIDI ON Events and MIDI OFF events
 {
+  const uint8_t type = midiEvent->statusByte >> 4;
+  const uint8_t note = midiEvent->dataByte[0];
+
+  if (type == MIDI_CONTROL_CHANGE)
+  {
+    processControlChange(midiEvent->dataByte[0], midiEvent->dataByte[1]);
+    return;
+  }
+  if (type == MIDI_PITCH_BEND)                                                          // every voice follows it from the next control tick
+  {
+    modulationSetBend(midiEvent->dataByte[0], midiEvent->dataByte[1]);
+    return;
+  }
+#if SAMPLE_STREAMING
+  if (type == MIDI_PROGRAM_CHANGE)                                                      // notes from now on play a sample from flash, or the wave tables again
+  {
+    sampleSelect(midiEvent->dataByte[0]);
+    return;
+  }
+#endif
+  if (type != MIDI_NOTE_ON && type != MIDI_NOTE_OFF)                          // other channel voice messages don't do anything yet
+  {
+    return;
+  }
+
  //-----------------------------------------------------------------------------------------------------------------------------------------------------------------------------
  //-----------------------------------------------------------------------------In the case of MIDI OFF message-----------------------------------------------------------------
  //-----------------------------------------------------------------------------------------------------------------------------------------------------------------------------
-  if ( (midiEvent->statusByte >> 4) == MIDI_NOTE_OFF || midiEvent->dataByte[1] == 0)      // Note OFF could have note off status byte or a MIDI ON event with velocity of 0
+  if ( type == MIDI_NOTE_OFF || midiEvent->dataByte[1] == 0)                              // Note OFF could have note off status byte or a MIDI ON event with velocity of 0
   {
-    osc.notes_pressed -= 1;                                                               // Decrement the number of notes pressed. A key is released so number of notes pressed at same time is -= 1
-    
-    if (osc.notes_pressed == 0)                                                           // If no notes pressed
+    removeHeldNote(note);                                                                 // A key is released so it no longer needs a voice
+
+    if (keys.notes_pressed == 0)                                                          // If no notes pressed
     {
-      PORTB &= ~(1 << GATE_OUT_PIN);                                                      // FOR envelope generaton in analogue section. If no notes pressed gate output low 
-    } else                                                                                // If notes are still being pressed so previous note still plays
+      GATE_OUT_PORT &= ~(1 << GATE_OUT_PIN);                                              // FOR envelope generaton in analogue section. If no notes pressed gate output low 
+    }
+
+    Voice* voice = findVoice(note);
+    if (voice)                                                                            // the released key was sounding, its voice is now free once its release has finished
     {
-      osc.note = osc.previous_notes[osc.notes_pressed];                                   // Set current note to the previous note in the buffer
-      osc.increment_table_proc = 1;                                                       // As using a previous note increment table needs reprocessing
+      uint8_t waiting = NO_NOTE;                                                          // most recent key still held without a voice (stolen, or pressed while all voices were busy)
+      for (uint8_t i = keys.notes_pressed; i > 0 && waiting == NO_NOTE; i--)
+      {
+        if (!findVoice(keys.previous_notes[i - 1]))
+        {
+          waiting = keys.previous_notes[i - 1];
+        }
+      }
+
+      if (waiting != NO_NOTE)
+      {
+        startVoice(voice, waiting, voice->amplitude_val, voice->pitch >> GLIDE_SHIFT);                   // previous note plays again at the released note's amplitude, gliding back to it from the released one
+      } else
+      {
+        voice->active = 0;
+        envelopeNoteOff(&voice->envelope);
+      }
     }
   }
  //-----------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -120,364 +330,477 @@ void processMidiEvent (const MidiEvent* const midiEvent)                      //
  //----------------------------------------------------------------------------------------------------------------------------------------------------------------------------- 
   else  // else not a note on message 
   {
-    osc.note = midiEvent->dataByte[0];                                                      // set the midi note value of the Voice struct to the current midi note being processed
-    osc.amplitude_val = round (midiEvent->dataByte[1] / 8);                                 // Gets amplitude value from the velocity data byte then /8 which as max of databyte is 128 max amplitude will be 16 so 12 bit data wont be overflowed which will be sent to DAC 
-                                                                                            // which keeps within clipping range (ex. 255 * 16 = 4080 < 4095)
-    osc.notes_pressed += 1;                                                                 // increase number of notes pressed by 1 so the number of notes pressed simultaneously is += 1
-    osc.previous_notes[osc.notes_pressed] = midiEvent->dataByte[0];                         // Add MIDI note databyte to the previous notes array. Put this value into the previous note buffer to be processed if a key after this is released but this key is still pressed
-    osc.increment_table_proc = 1;                                                           // Processing new note, increment_table needs reprocessing
+    removeHeldNote(note);                                                                   // a repeated note on for a held key moves it to the top of the stack instead of adding it twice
+    const uint16_t glideFrom = keys.notes_pressed ? (uint16_t)keys.previous_notes[keys.notes_pressed - 1] << PITCH_SHIFT : NO_PITCH;   // portamento glides up or down from the last key still held
+    pushHeldNote(note);
 
-    PORTB |= (1 << GATE_OUT_PIN);                                                           // FOR envelope generaton in analogue section. Sets gate output high as note is pressed. gate is low when a note is released
+    Voice* voice = findVoice(note);                                                         // retrigger the voice already playing this note
+    if (!voice)
+    {
+      voice = allocateVoice();
+    }
+    startVoice(voice, note, midiEvent->dataByte[1] >> 3, glideFrom);                                   // Gets amplitude value from the velocity data byte then /8 which as max of databyte is 127 max amplitude will be 15 so 12 bit data wont be overflowed which will be sent to DAC 
+                                                                                            // which keeps within clipping range (ex. 255 * 15 = 3825 < 4095)
+
+    GATE_OUT_PORT |= (1 << GATE_OUT_PIN);                                                 // FOR envelope generaton in analogue section. Sets gate output high as note is pressed. gate is low when a note is released
   }
 }
 
-void process_increment_table()                  //Integer value corresponds to a MIDI note e.g Note C0 = 0. MIDI.h contains all defines for each note
+void startVoice (Voice* voice, uint8_t note, uint8_t amplitude, uint16_t glide_from)   // Integer value corresponds to a MIDI note e.g Note C0 = 0. USARTISR_MIDI.h contains all defines for each note
 {
-  float runningIncr = 0.0;                      // the running total for incrementing, to be rounded off and placed 
-  float incr = 0.0;                             // the floating point value to increment by to achieve desired frequency
-  
-  switch (osc.note)                             // Takes current MIDI note and compares with every MIDI define to match the incr variable to the music note define
+  uint8_t highest = note;                                                             // the highest note the voice will play before the next note on
+
+  voice->note = note;
+  voice->active = 1;
+  voice->started = voiceClock++;
+
+  voice->target_pitch = (uint32_t)note << (PITCH_SHIFT + GLIDE_SHIFT);
+  if (modulation.portamento && glide_from != NO_PITCH)
   {
-    case MIDI_C0  :
-      incr = MUSIC_C0;
-      break;
-    case MIDI_Db0  :
-      incr = MUSIC_Db0;
-      break;
-    case MIDI_D0  :
-      incr = MUSIC_D0;
-      break;
-    case MIDI_Eb0  :
-      incr = MUSIC_Eb0;
-      break;
-    case MIDI_E0  :
-      incr = MUSIC_E0;
-      break;
-    case MIDI_F0  :
-      incr = MUSIC_F0;
-      break;
-    case MIDI_Gb0  :
-      incr = MUSIC_Gb0;
-      break;
-    case MIDI_G0  :
-      incr = MUSIC_G0;
-      break;
-    case MIDI_Ab0  :
-      incr = MUSIC_Ab0;
-      break;
-    case MIDI_A0  :
-      incr = MUSIC_A0;
-      break;
-    case MIDI_Bb0  :
-      incr = MUSIC_Bb0;
-      break;
-    case MIDI_B0  :
-      incr = MUSIC_B0;
-      break;
-    case MIDI_C1  :
-      incr = MUSIC_C1;
-      break;
-    case MIDI_Db1  :
-      incr = MUSIC_Db1;
-      break;
-    case MIDI_D1  :
-      incr = MUSIC_D1;
-      break;
-    case MIDI_Eb1  :
-      incr = MUSIC_Eb1;
-      break;
-    case MIDI_E1  :
-      incr = MUSIC_E1;
-      break;
-    case MIDI_F1  :
-      incr = MUSIC_F1;
-      break;
-    case MIDI_Gb1  :
-      incr = MUSIC_Gb1;
-      break;
-    case MIDI_G1  :
-      incr = MUSIC_G1;
-      break;
-    case MIDI_Ab1  :
-      incr = MUSIC_Ab1;
-      break;
-    case MIDI_A1  :
-      incr = MUSIC_A1;
-      break;
-    case MIDI_Bb1  :
-      incr = MUSIC_Bb1;
-      break;
-    case MIDI_B1  :
-      incr = MUSIC_B1;
-      break;
-    case MIDI_C2  :
-      incr = MUSIC_C2;
-      break;
-    case MIDI_Db2  :
-      incr = MUSIC_Db2;
-      break;
-    case MIDI_D2  :
-      incr = MUSIC_D2;
-      break;
-    case MIDI_Eb2  :
-      incr = MUSIC_Eb2;
-      break;
-    case MIDI_E2  :
-      incr = MUSIC_E2;
-      break;
-    case MIDI_F2  :
-      incr = MUSIC_F2;
-      break;
-    case MIDI_Gb2  :
-      incr = MUSIC_Gb2;
-      break;
-    case MIDI_G2  :
-      incr = MUSIC_G2;
-      break;
-    case MIDI_Ab2  :
-      incr = MUSIC_Ab2;
-      break;
-    case MIDI_A2  :
-      incr = MUSIC_A2;
-      break;
-    case MIDI_Bb2  :
-      incr = MUSIC_Bb2;
-      break;
-    case MIDI_B2  :
-      incr = MUSIC_B2;
-      break;
-    case MIDI_C3  :
-      incr = MUSIC_C3;
-      break;
-    case MIDI_Db3  :
-      incr = MUSIC_Db3;
-      break;
-    case MIDI_D3  :
-      incr = MUSIC_D3;
-      break;
-    case MIDI_Eb3  :
-      incr = MUSIC_Eb3;
-      break;
-    case MIDI_E3  :
-      incr = MUSIC_E3;
-      break;
-    case MIDI_F3  :
-      incr = MUSIC_F3;
-      break;
-    case MIDI_Gb3  :
-      incr = MUSIC_Gb3;
-      break;
-    case MIDI_G3  :
-      incr = MUSIC_G3;
-      break;
-    case MIDI_Ab3  :
-      incr = MUSIC_Ab3;
-      break;
-    case MIDI_A3  :
-      incr = MUSIC_A3;
-      break;
-    case MIDI_Bb3  :
-      incr = MUSIC_Bb3;
-      break;
-    case MIDI_B3  :
-      incr = MUSIC_B3;
-      break;
-    case MIDI_C4  :
-      incr = MUSIC_C4;
-      break;
-    case MIDI_Db4  :
-      incr = MUSIC_Db4;
-      break;
-    case MIDI_D4  :
-      incr = MUSIC_D4;
-      break;
-    case MIDI_Eb4  :
-      incr = MUSIC_Eb4;
-      break;
-    case MIDI_E4  :
-      incr = MUSIC_E4;
-      break;
-    case MIDI_F4  :
-      incr = MUSIC_F4;
-      break;
-    case MIDI_Gb4  :
-      incr = MUSIC_Gb4;
-      break;
-    case MIDI_G4  :
-      incr = MUSIC_G4;
-      break;
-    case MIDI_Ab4  :
-      incr = MUSIC_Ab4;
-      break;
-    case MIDI_A4  :
-      incr = MUSIC_A4;
-      break;
-    case MIDI_Bb4  :
-      incr = MUSIC_Bb4;
-      break;
-    case MIDI_B4  :
-      incr = MUSIC_B4;
-      break;
-    case MIDI_C5  :
-      incr = MUSIC_C5;
-      break;
-    case MIDI_Db5  :
-      incr = MUSIC_Db5;
-      break;
-    case MIDI_D5  :
-      incr = MUSIC_D5;
-      break;
-    case MIDI_Eb5  :
-      incr = MUSIC_Eb5;
-      break;
-    case MIDI_E5  :
-      incr = MUSIC_E5;
-      break;
-    case MIDI_F5  :
-      incr = MUSIC_F5;
-      break;
-    case MIDI_Gb5  :
-      incr = MUSIC_Gb5;
-      break;
-    case MIDI_G5  :
-      incr = MUSIC_G5;
-      break;
-    case MIDI_Ab5  :
-      incr = MUSIC_Ab5;
-      break;
-    case MIDI_A5  :
-      incr = MUSIC_A5;
-      break;
-    case MIDI_Bb5  :
-      incr = MUSIC_Bb5;
-      break;
-    case MIDI_B5  :
-      incr = MUSIC_B5;
-      break;
-    case MIDI_C6  :
-      incr = MUSIC_C6;
-      break;
-    case MIDI_Db6  :
-      incr = MUSIC_Db6;
-      break;
-    case MIDI_D6  :
-      incr = MUSIC_D6;
-      break;
-    case MIDI_Eb6  :
-      incr = MUSIC_Eb6;
-      break;
-    case MIDI_E6  :
-      incr = MUSIC_E6;
-      break;
-    case MIDI_F6  :
-      incr = MUSIC_F6;
-      break;
-    case MIDI_Gb6  :
-      incr = MUSIC_Gb6;
-      break;
-    case MIDI_G6  :
-      incr = MUSIC_G6;
-      break;
-    case MIDI_Ab6  :
-      incr = MUSIC_Ab6;
-      break;
-    case MIDI_A6  :
-      incr = MUSIC_A6;
-      break;
-    case MIDI_Bb6  :
-      incr = MUSIC_Bb6;
-      break;
-    case MIDI_B6  :
-      incr = MUSIC_B6;
-      break;
-    case MIDI_C7  :
-      incr = MUSIC_C7;
-      break;
-    case MIDI_Db7  :
-      incr = MUSIC_Db7;
-      break;
-    case MIDI_D7  :
-      incr = MUSIC_D7;
-      break;
-    case MIDI_Eb7  :
-      incr = MUSIC_Eb7;
-      break;
-    case MIDI_E7  :
-      incr = MUSIC_E7;
-      break;
-    case MIDI_F7  :
-      incr = MUSIC_F7;
-      break;
-    case MIDI_Gb7  :
-      incr = MUSIC_Gb7;
-      break;
-    case MIDI_G7  :
-      incr = MUSIC_G7;
-      break;
-    case MIDI_Ab7  :
-      incr = MUSIC_Ab7;
+    voice->pitch = (uint32_t)glide_from << GLIDE_SHIFT;
+    voice->glide_step = modulationGlideStep(voice->pitch, voice->target_pitch);
+    if ((glide_from >> PITCH_SHIFT) > highest)
+    {
+      highest = glide_from >> PITCH_SHIFT;
+    }
+  } else
+  {
+    voice->pitch = voice->target_pitch;
+  }
+
+  voice->phase_increment = modulationIncrement((int32_t)(voice->pitch >> GLIDE_SHIFT) + modulation.pitch_offset);   // voices are only touched by loop(), so no need to hold off interrupts
+#if SAMPLE_STREAMING
+  if (sampleProgram)
+  {
+    sampleStreamStart(&voice->stream, sampleProgram - 1);
+    voice->stream.step = sampleStreamStep(voice->phase_increment);
+  } else
+  {
+    voice->stream.state = STREAM_OFF;
+  }
+#endif
+  voice->mip_level = pgm_read_byte(&waveMipLevel[highest]);                            // band limiting is chosen once here, not per sample, for the top of any glide
+  setVoiceWaves(voice);
+  voice->amplitude_val = amplitude;
+  envelopeNoteOn(&voice->envelope);
+}
+
+void processControlChange (uint8_t controller, uint8_t value)
+{
+  switch (controller)
+  {
+    case MIDI_CC_ATTACK_TIME :
+      envelopeParams.attack_step = envelopeStep(envelopeControllerTime(value));
       break;
-    case MIDI_A7  :
-      incr = MUSIC_A7;
+    case MIDI_CC_DECAY_TIME :
+      envelopeParams.decay_step = envelopeStep(envelopeControllerTime(value));
       break;
-    case MIDI_Bb7  :
-      incr = MUSIC_Bb7;
+    case MIDI_CC_SUSTAIN_LEVEL :
+      envelopeParams.sustain_level = ((uint16_t)value << 9) | ((uint16_t)value << 2) | (value >> 5);   // 0-127 stretched over the whole 16 bits, 127 is ENVELOPE_MAX
       break;
-    case MIDI_B7  :
-      incr = MUSIC_B7;
+    case MIDI_CC_RELEASE_TIME :
+      envelopeParams.release_step = envelopeStep(envelopeControllerTime(value));
       break;
-    case MIDI_C8  :
-      incr = MUSIC_C8;
+    case MIDI_CC_MOD_WHEEL :
+      modulation.mod_wheel = value;
       break;
-    case MIDI_Db8  :
-      incr = MUSIC_Db8;
+    case MIDI_CC_PORTAMENTO_TIME :
+      modulation.glide_ms = ((uint32_t)value * value * MODULATION_GLIDE_MAX_MS) / (127 * 127);
       break;
-    case MIDI_D8  :
-      incr = MUSIC_D8;
+    case MIDI_CC_PORTAMENTO :
+      modulation.portamento = value >= 64;
       break;
-    case MIDI_Eb8  :
-      incr = MUSIC_Eb8;
+    case MIDI_CC_VIBRATO_RATE :
+      modulation.lfo_step = modulationLfoStep(value);
       break;
-    case MIDI_E8  :
-      incr = MUSIC_E8;
+    case MIDI_CC_VIBRATO_DEPTH :
+      modulation.vibrato_depth = value;
       break;
-    case MIDI_F8  :
-      incr = MUSIC_F8;
+    case MIDI_CC_TREMOLO_DEPTH :
+      modulation.tremolo_depth = value;
       break;
-    case MIDI_Gb8  :
-      incr = MUSIC_Gb8;
+    case MIDI_CC_WAVE_MORPH :
+      waveSetMorph(value);
+      setWaveMorph();
       break;
-    case MIDI_G8  :
-      incr = MUSIC_G8;
+#if FILTER_ENABLED
+    case MIDI_CC_FILTER_MODE :
+      filterSetMode(value >> 5);                                                      // four equal ranges, off, low, band, high
       break;
-    case MIDI_Ab8  :
-      incr = MUSIC_Ab8;
+    case MIDI_CC_FILTER_RESONANCE :
+      filterSetResonance(value);
       break;
-    case MIDI_A8  :
-      incr = MUSIC_A8;
+    case MIDI_CC_FILTER_CUTOFF :
+      filterSetCutoff(value);
       break;
-    case MIDI_Bb8  :
-      incr = MUSIC_Bb8;
+#endif
+    default :                                                                         // controllers this synth doesn't use
       break;
-    case MIDI_B8  :
-      incr = MUSIC_B8;
+  }
+}
+
+Voice* allocateVoice ()
+{
+  Voice* chosen = &voices[0];
+
+  for (uint8_t i = 0; i < VOICE_COUNT; i++)
+  {
+    Voice* voice = &voices[i];
+    if (voice->envelope.stage == ENVELOPE_IDLE)                                       // a silent voice is always taken first
+    {
+      return voice;
+    }
+    if (voice->active > chosen->active)                                               // then voices in their release, before any held key's voice
+    {
+      continue;
+    }
+
+#if VOICE_STEAL_MODE == STEAL_QUIETEST
+    if (voice->active < chosen->active || voice->gain < chosen->gain ||
+        (voice->gain == chosen->gain && (uint16_t)(voiceClock - voice->started) > (uint16_t)(voiceClock - chosen->started)))
+#else
+    if (voice->active < chosen->active || (uint16_t)(voiceClock - voice->started) > (uint16_t)(voiceClock - chosen->started))
+#endif
+    {
+      chosen = voice;
+    }
+  }
+
+  return chosen;                                                                      // its key stays in the held key stack so it can get a voice back later
+}
+
+Voice* findVoice (uint8_t note)
+{
+  for (uint8_t i = 0; i < VOICE_COUNT; i++)
+  {
+    if (voices[i].active && voices[i].note == note)
+    {
+      return &voices[i];
+    }
+  }
+  return 0;
+}
+
+void pushHeldNote (uint8_t note)
+{
+  if (keys.notes_pressed == NOTE_STACK_SIZE)                                          // stack full, forget the oldest held key
+  {
+    for (uint8_t i = 1; i < NOTE_STACK_SIZE; i++)
+    {
+      keys.previous_notes[i - 1] = keys.previous_notes[i];
+    }
+    keys.notes_pressed--;
+  }
+  keys.previous_notes[keys.notes_pressed++] = note;
+}
+
+void removeHeldNote (uint8_t note)
+{
+  uint8_t kept = 0;
+  for (uint8_t i = 0; i < keys.notes_pressed; i++)                                    // stray note offs for keys that aren't held leave the stack unchanged
+  {
+    if (keys.previous_notes[i] != note)
+    {
+      keys.previous_notes[kept++] = keys.previous_notes[i];
+    }
+  }
+  keys.notes_pressed = kept;
+}
+
+uint8_t voicesSilent ()
+{
+  for (uint8_t i = 0; i < VOICE_COUNT; i++)
+  {
+    if (voices[i].envelope.stage != ENVELOPE_IDLE)
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+void setVoiceWaves (Voice* voice)
+{
+  const uint8_t next = waveMorphTable < WAVE_COUNT - 1 ? waveMorphTable + 1 : waveMorphTable;
+  voice->wave_a = waveTables[waveMorphTable][voice->mip_level];
+  voice->wave_b = waveTables[next][voice->mip_level];
+}
+
+void setWaveMorph ()
+{
+  for (uint8_t i = 0; i < VOICE_COUNT; i++)
+  {
+    setVoiceWaves(&voices[i]);
+  }
+}
+
+void controlTick ()
+{
+  modulationTick();
+  const int16_t offset = modulation.pitch_offset;
+  const uint8_t tremolo = modulation.tremolo_dip;
+
+  for (uint8_t i = 0; i < VOICE_COUNT; i++)
+  {
+    Voice* voice = &voices[i];
+#if SAMPLE_STREAMING
+    if (voice->stream.state == STREAM_DONE)                                           // the sample has run out, same as letting go of the key
+    {
+      envelopeNoteOff(&voice->envelope);
+    }
+    if (voice->stream.state != STREAM_PRIMING)                                        // the attack waits for the sample to start
+#endif
+    envelopeTick(&voice->envelope);
+#if SAMPLE_STREAMING
+    if (voice->envelope.stage == ENVELOPE_IDLE && voice->stream.state == STREAM_PLAYING)   // released before the sample ended, no more reads for it
+    {
+      voice->stream.state = STREAM_DONE;
+    }
+#endif
+    const uint8_t gain = (voice->amplitude_val * (uint8_t)(voice->envelope.level >> 8)) >> 4;   // an 8x8 multiply, 15 * 255 >> 4 = 239
+    voice->gain = gain - ((gain * tremolo) >> 8);
+
+    if (voice->pitch != voice->target_pitch)
+    {
+      voice->pitch = modulationGlide(voice->pitch, voice->target_pitch, voice->glide_step);
+    }
+    voice->phase_increment = modulationIncrement((int32_t)(voice->pitch >> GLIDE_SHIFT) + offset);   // the sample loop only ever sees the new increment
+#if SAMPLE_STREAMING
+    voice->stream.step = sampleStreamStep(voice->phase_increment);                    // a sample follows bend, vibrato and glide the same way
+#endif
+  }
+}
+
+void renderBlock (volatile uint16_t* block)
+{
+#if FILTER_ENABLED
+  uint16_t mixed[RENDER_BLOCK_SIZE];                                                  // the mix before the filter
+#endif
+
+  const uint8_t morph = waveMorphWeight;
+
+  for (uint8_t n = 0; n < RENDER_BLOCK_SIZE; n++)
+  {
+    if ((n & (CONTROL_SAMPLES - 1)) == 0)                                             // control rate, the gains and increments hold for the next CONTROL_SAMPLES samples
+    {
+      PROFILE_START(control);
+      controlTick();
+      PROFILE_END(PROFILE_CONTROL_TICK, control);
+    }
+
+    uint16_t mix = 0;
+
+    for (uint8_t i = 0; i < VOICE_COUNT; i++)                                         // every voice is computed every sample (free voices have 0 gain) so a block always takes the same time
+    {
+      Voice* voice = &voices[i];
+      uint8_t sample;
+#if SAMPLE_STREAMING
+      if (voice->stream.state != STREAM_OFF)                                          // playing a sample from its ring (SAMPLE_STREAM.h)
+      {
+        sample = sampleStreamNext(&voice->stream);
+      } else
+#endif
+      {
+        const uint32_t phase = voice->phase;
+        const uint16_t index = phase >> PHASE_FRACTION_BITS;                          // table position (top bits of the phase)
+        const uint16_t next = (index + 1) & WAVE_TABLE_MASK;                          // the sample after it, wrapping round to the start of the table
+        const uint8_t fraction = phase >> (PHASE_FRACTION_BITS - 8);                  // how far between the two, the next 8 bits of the phase
+
+        int16_t a = pgm_read_byte(voice->wave_a + index);                             // linear interpolation in both waveforms, then the crossfade between them
+        a += ((pgm_read_byte(voice->wave_a + next) - a) * fraction) >> 8;
+        int16_t b = pgm_read_byte(voice->wave_b + index);
+        b += ((pgm_read_byte(voice->wave_b + next) - b) * fraction) >> 8;
+        sample = a + (((b - a) * morph) >> 8);
+        voice->phase = phase + voice->phase_increment;                                // advance by the note's phase increment, overflowing the 32 bits wraps around the wave table
+      }
+
+      mix += (sample * voice->gain) >> ENVELOPE_GAIN_SHIFT;                           // multiplied by the voice's gain
+    }
+
+    mix >>= MIX_SHIFT;
+#if FILTER_ENABLED
+    mixed[n] = mix;
+#else
+    block[n] = mix > DAC_MAX ? DAC_MAX : mix;                                         // saturate into the 12 bit DAC range rather than wrapping around
+#endif
+  }
+
+#if FILTER_ENABLED
+  filterBlock(mixed, block, RENDER_BLOCK_SIZE);                                       // filters the whole block in one go and saturates it into the DAC range
+#endif
+}
+
+#if SAMPLE_STREAMING
+void fillSampleStreams ()
+{
+  PRR &= ~(1 << PRSPI);
+  SPIDAC_INIT();                                                                      // powerStartSamples() does it again once the block is rendered
+  for (uint8_t i = 0; i < VOICE_COUNT; i++)
+  {
+    while (sampleStreamWants(&voices[i].stream))
+    {
+      sampleStreamFetch(&voices[i].stream);
+    }
+  }
+}
+
+static inline void refillSampleStreams ()                                             // sample interrupt, just after the latch: reads a chunk into the ring with the least left in it
+{
+  SampleStream* neediest = 0;
+  uint8_t least = 0;
+  for (uint8_t i = 0; i < VOICE_COUNT; i++)
+  {
+    SampleStream* stream = &voices[i].stream;
+    const uint8_t buffered = stream->fetched - stream->played;
+    if (sampleStreamWants(stream) && (!neediest || buffered < least))
+    {
+      neediest = stream;
+      least = buffered;
+    }
+  }
+  if (neediest)
+  {
+    sampleStreamFetch(neediest);
+  }
+}
+#endif
+
+uint32_t telemetryFieldValue (uint8_t field)
+{
+  uint32_t value = 0;
+  uint8_t sreg = SREG;                                                                // most of these are written by interrupts and more than a byte long
+  cli();
+
+  switch (field)
+  {
+    case 0 : value = midiDroppedEvents; break;
+    case 1 : value = midiParseErrors; break;
+    case 2 : value = usartTxHighWater; break;
+    case 3 : value = usartTxOverflows; break;
+    case 4 : value = bufferUnderruns; break;
+    case 5 : value = FREE_RAM(); break;
+    case 6 : value = sampleUnderruns; break;
+    case 7 : value = midiThruDropped; break;
+    default :                                                                         // profiler probes
+    {
+#if PROFILING
+      const ProfileStats* stats = &profileStats[(field - TELEMETRY_COUNTERS) / TELEMETRY_PROBE_FIELDS];
+      const uint8_t item = (field - TELEMETRY_COUNTERS) % TELEMETRY_PROBE_FIELDS;
+      value = item == 0 ? stats->count : item == 1 ? stats->total : item == 2 ? stats->min : item == 3 ? stats->max : stats->buckets[item - 4];
+#endif
       break;
-    default :
-      incr = MUSIC_C0;
+    }
+  }
+
+  SREG = sreg;
+  return value;
+}
+
+void sendTelemetry ()
+{
+  uint8_t sreg;
+
+  if (telemetryCommand == TELEMETRY_RESET)
+  {
+#if PROFILING
+    profileReset();
+#endif
+    telemetryCommand = 0;
+  } else if (telemetryCommand == TELEMETRY_REPORT && telemetryNextField == TELEMETRY_IDLE)
+  {
+    telemetryNextField = 0;
+    telemetryCommand = 0;
+  } else if (telemetryCommand != TELEMETRY_REPORT)
+  {
+    telemetryCommand = 0;                                                             // not a command this synth knows
+  }
+
+  if (telemetryNextField < TELEMETRY_FIELDS && !midiTxSysExOpen)                      // between pieces
+  {
+    sreg = SREG;
+    cli();
+    if (!midiThruPassing && USART_TxFree() >= TELEMETRY_PIECE_BYTES + TELEMETRY_THRU_ROOM)   // wait for any sysex being passed through to finish, then hold MIDI THRU off until the piece is out
+    {
+      midiTxSysExOpen = 1;
+      midiTxRunningStatus = 0;
+      USART_QueueByte(MIDI_SYSEX_START);
+      USART_QueueByte(MIDI_SYSEX_ID);
+      USART_QueueByte(TELEMETRY_REPORT);
+      USART_QueueByte(TELEMETRY_VERSION);
+      USART_QueueByte(PROFILING);
+      USART_QueueByte(telemetryNextField);
+      telemetryPieceEnd = telemetryNextField + TELEMETRY_PIECE_FIELDS < TELEMETRY_FIELDS ? telemetryNextField + TELEMETRY_PIECE_FIELDS : TELEMETRY_FIELDS;
+    }
+    SREG = sreg;
+  }
+
+  while (midiTxSysExOpen && telemetryNextField < telemetryPieceEnd && USART_TxFree() >= TELEMETRY_FIELD_BYTES)   // only short of room if realtime bytes passed through took it
+  {
+    uint32_t value = telemetryFieldValue(telemetryNextField++);
+    sreg = SREG;
+    cli();
+    for (uint8_t i = 0; i < TELEMETRY_FIELD_BYTES; i++, value >>= 7)
+    {
+      USART_QueueByte(value & 0x7F);
+    }
+    SREG = sreg;
   }
 
-  for (int i = 0; i < INCREMENT_TABLE_SIZE; i++)
+  if (midiTxSysExOpen && telemetryNextField == telemetryPieceEnd && USART_TxFree() >= 1)
+  {
+    sreg = SREG;
+    cli();
+    USART_QueueByte(MIDI_SYSEX_END);
+    midiTxSysExOpen = 0;
+    midiThruRelease();
+    SREG = sreg;
+    if (telemetryNextField == TELEMETRY_FIELDS)
+    {
+      telemetryNextField = TELEMETRY_IDLE;
+    }
+  }
+}
+
+ISR (TIMER1_COMPA_vect)                                                               // only plays back what loop() rendered, so its length no longer depends on the voices or any DSP
+{
+  PROFILE_SAMPLE_PERIOD();
+  PROFILE_START(sample);
+  SPI_dacLatch();                                                                     // DAC takes the word sent last sample, exactly on the timer edge
+#if SAMPLE_STREAMING
+  refillSampleStreams();                                                              // the one time the MCP4921 is off the bus (SAMPLE_STREAM.h)
+#endif
+  const uint8_t block = playingBlock;
+
+  if (blockReady[block])
   {
-    runningIncr += incr;                                                          // tracks the real floating point value of the incr
-    osc.increment_table[i] = round (runningIncr) - round (runningIncr - incr);    // Get integer difference of rounded running total and last
+    const uint8_t index = playingIndex;
+    const uint16_t sample = sampleBlocks[block][index];
+    SPI_dacStart(sample);                                                             // first byte shifts out while the block bookkeeping below runs
+
+    if (index == RENDER_BLOCK_SIZE - 1)                                               // end of block, hand it back to loop() and move on to the other one
+    {
+      playingIndex = 0;
+      blockReady[block] = 0;
+      playingBlock = block ^ 1;
+    } else
+    {
+      playingIndex = index + 1;
+    }
+    SPI_dacFinish(sample);
+  } else                                                                              // loop() fell behind, the DAC holds its last value
+  {
+    bufferUnderruns++;
   }
 
-  osc.increment_table_proc = 0;                                                   //Set needs processing flag to 0 as it was just used
+  PROFILE_END(PROFILE_SAMPLE_ISR, sample);
 }
 
-ISR (TIMER1_COMPA_vect)
+ISR (PCINT0_vect)                                                                     // the wave selection button changed, only a press counts
 {
-  SPI_transmit ( wave_pointer[osc.table_position] * osc.amplitude_val );                                                     // output current wave at table position multiplied by amplitude value
-  osc.table_position = ( osc.table_position + osc.increment_table[osc.increment_table_pos] ) % INITIAL_WAVE_TABLE_SIZE;      // update table position by adding value from the increment table % so it wraps around wave table
-  osc.increment_table_pos = (osc.increment_table_pos + 1) % INCREMENT_TABLE_SIZE;                                            // add 1 to update the position of increment table % so it wraps around increment table
-}
+  const uint8_t pressed = (PINB & (1 << SELECT_WAVE_PIN)) ? 1 : 0;
+  if (pressed && !currentWaveIsSelected)
+  {
+    waveButtonPresses++;
+  }
+  currentWaveIsSelected = pressed;
+}
@@ -0,0 +1,122 @@
+// Digital ADSR envelope, one per voice. Envelopes run at the control rate, CONTROL_RATE (PERIPHERALS.h): every control tick
+// renderBlock() steps each envelope once and folds its level and the note's velocity into the voice's 8 bit gain, so the
+// per sample cost stays one multiply. Segments are linear with fixed point steps worked out by envelopeSetTimes() when a
+// parameter changes, never per tick. The GATE_OUT_PIN gate is still driven for an external analogue envelope (set attack
+// and release to 0 and sustain to full and the digital envelope gets out of its way).
+
+#define ENVELOPE_MAX 0xFFFF                                 // full scale level
+#define ENVELOPE_MAX_TIME_MS 5000                           // longest attack, decay or release a controller can set
+#define ENVELOPE_GAIN_SHIFT 4                               // wave sample (0-255) * gain (0-239) >> 4 keeps a voice under 255 * 15, the range the mix was sized for
+
+#define ENVELOPE_IDLE 0                                     // silent, the voice is free
+#define ENVELOPE_ATTACK 1
+#define ENVELOPE_DECAY 2
+#define ENVELOPE_SUSTAIN 3
+#define ENVELOPE_RELEASE 4
+
+#define ENVELOPE_DEFAULT_ATTACK_MS 5                        // short enough to sound immediate, long enough not to click
+#define ENVELOPE_DEFAULT_DECAY_MS 400
+#define ENVELOPE_DEFAULT_SUSTAIN 0xC000                     // 75%
+#define ENVELOPE_DEFAULT_RELEASE_MS 150
+
+// MIDI controllers for the envelope (sound controllers from the MIDI 1.0 spec, 79 is otherwise undefined)
+#define MIDI_CC_RELEASE_TIME 72
+#define MIDI_CC_ATTACK_TIME 73
+#define MIDI_CC_DECAY_TIME 75
+#define MIDI_CC_SUSTAIN_LEVEL 79
+
+typedef struct envelope
+{
+  uint16_t level = 0;                                       // 0 to ENVELOPE_MAX
+  uint8_t stage = ENVELOPE_IDLE;
+} Envelope;
+
+typedef struct envelopeParams                               // shared by every voice
+{
+  uint16_t attack_step;                                     // level added per control tick during the attack
+  uint16_t decay_step;                                      // level taken off per control tick during the decay
+  uint16_t sustain_level;
+  uint16_t release_step;                                    // level taken off per control tick during the release
+} EnvelopeParams;
+
+ENGINE_STATE EnvelopeParams envelopeParams;
+
+uint16_t envelopeStep (uint16_t ms)                         // step that crosses full scale in ms milliseconds (decay and release are rates, so their time is from full scale whatever the sustain level)
+{
+  const uint32_t ticks = ((uint32_t)ms * CONTROL_RATE) / 1000;
+  if (ticks <= 1)
+  {
+    return ENVELOPE_MAX;                                    // immediate
+  }
+  return ENVELOPE_MAX / ticks;                              // at least 1 while ms <= ENVELOPE_MAX_TIME_MS at any Fs up to 200kHz
+}
+
+uint16_t envelopeControllerTime (uint8_t value)             // MIDI controller value 0-127 to milliseconds, squared so the short times get most of the knob's travel
+{
+  return ((uint32_t)value * value * ENVELOPE_MAX_TIME_MS) / (127 * 127);
+}
+
+void envelopeSetTimes (uint16_t attack_ms, uint16_t decay_ms, uint16_t sustain_level, uint16_t release_ms)
+{
+  envelopeParams.attack_step = envelopeStep(attack_ms);
+  envelopeParams.decay_step = envelopeStep(decay_ms);
+  envelopeParams.sustain_level = sustain_level;
+  envelopeParams.release_step = envelopeStep(release_ms);
+}
+
+static inline void envelopeNoteOn (Envelope* envelope)     // attack starts from wherever the level is, so a retriggered or stolen voice doesn't jump to 0
+{
+  envelope->stage = ENVELOPE_ATTACK;
+}
+
+static inline void envelopeNoteOff (Envelope* envelope)
+{
+  if (envelope->stage != ENVELOPE_IDLE)
+  {
+    envelope->stage = ENVELOPE_RELEASE;
+  }
+}
+
+static inline void envelopeTick (Envelope* envelope)       // one control tick
+{
+  const uint16_t level = envelope->level;
+
+  switch (envelope->stage)
+  {
+    case ENVELOPE_ATTACK :
+      if (level >= ENVELOPE_MAX - envelopeParams.attack_step)
+      {
+        envelope->level = ENVELOPE_MAX;
+        envelope->stage = ENVELOPE_DECAY;
+      } else
+      {
+        envelope->level = level + envelopeParams.attack_step;
+      }
+      break;
+    case ENVELOPE_DECAY :
+      if (level <= envelopeParams.sustain_level || level - envelopeParams.sustain_level <= envelopeParams.decay_step)
+      {
+        envelope->level = envelopeParams.sustain_level;
+        envelope->stage = ENVELOPE_SUSTAIN;
+      } else
+      {
+        envelope->level = level - envelopeParams.decay_step;
+      }
+      break;
+    case ENVELOPE_SUSTAIN :
+      envelope->level = envelopeParams.sustain_level;       // follows the sustain controller while the key is held
+      break;
+    case ENVELOPE_RELEASE :
+      if (level <= envelopeParams.release_step)
+      {
+        envelope->level = 0;
+        envelope->stage = ENVELOPE_IDLE;
+      } else
+      {
+        envelope->level = level - envelopeParams.release_step;
+      }
+      break;
+    default :
+      break;
+  }
+}
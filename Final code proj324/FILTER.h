@@ -0,0 +1,134 @@
+// Digital 2 pole state variable filter (Chamberlin) on the voice mix, low pass, band pass or high pass. Everything is Q15
+// fixed point: the mix is centred on 0 and scaled up, the two integrator states are 16 bit, and the cutoff coefficient
+// f = 2 sin(pi fc / Fs) comes from filterCutoffTable, generated by the compiler for the build's Fs. A cutoff sweep over MIDI
+// is a table lookup per controller message and nothing else, there is no trig (or division) on the AVR. Q15 only holds f
+// up to 1, a cutoff of Fs / 6, so controller values 0-126 spread C2 up to there evenly in pitch (about half a semitone a
+// step at 16kHz) and 127 opens the low pass the rest of the way, straight through to the DAC.
+//
+// Per sample: 3 16x16 multiplies, 5 adds and 3 saturations, about FILTER_CYCLES (110) cycles, 11% of the 999 cycle sample
+// period at 16kHz or 22% of 499 at 32kHz. It runs once on the mix rather than per voice, where it would cost VOICE_COUNT
+// times as much. filterBlock() runs a whole rendered block with the state and coefficients held in registers, it is the
+// same code in the host build so offline renders match the chip sample for sample.
+
+#ifndef FILTER_ENABLED
+#define FILTER_ENABLED 1                                    // 0 leaves the filter out of the build altogether
+#endif
+
+#define FILTER_OFF 0                                        // mix goes to the DAC unfiltered (the default, the analogue filter does the work)
+#define FILTER_LOW_PASS 1
+#define FILTER_BAND_PASS 2
+#define FILTER_HIGH_PASS 3
+
+#define FILTER_CYCLES 110                                   // estimated AVR cycles per sample, counted into the budget in 3SYNTH_ENGINE2.ino
+#define FILTER_DAC_MIDDLE 2048                              // the mix is unipolar, the filter works on it centred on 0
+#define FILTER_INPUT_SHIFT 2                                // +-2048 becomes +-8192, leaving 4x headroom for the resonant peak before the states saturate
+#define FILTER_CUTOFF_NOTE_OFFSET 24                        // controller value 0 is C2 (65Hz)
+#define FILTER_MAX_CUTOFF (Fs / 6.0)                        // f = 2 sin(pi / 6) = 1, the most Q15 holds; with the damping at most 1 the filter is stable all the way up
+#define FILTER_CUTOFF_STEPS 126                             // controller values from C2 up to FILTER_MAX_CUTOFF, the one after opens the filter
+#define FILTER_DAMPING_MAX 16384                            // damping (1 / Q) in Q14 as it needs the range up to 1: controller 0 is Q = 1, no peak to speak of
+#define FILTER_DAMPING_MIN 820                              // controller 127 is Q = 20, just short of self oscillation
+
+// MIDI controllers for the filter (sound controllers from the MIDI 1.0 spec)
+#define MIDI_CC_FILTER_MODE 70                              // 0-31 off, 32-63 low pass, 64-95 band pass, 96-127 high pass
+#define MIDI_CC_FILTER_RESONANCE 71
+#define MIDI_CC_FILTER_CUTOFF 74
+
+constexpr uint8_t filterCutoffSpan (uint8_t semitones)     // semitones from C2 to the last note under FILTER_MAX_CUTOFF
+{
+  return equalTemperament(FILTER_CUTOFF_NOTE_OFFSET + semitones + 1) >= FILTER_MAX_CUTOFF ? semitones : filterCutoffSpan(semitones + 1);
+}
+
+constexpr double filterCutoffFrequency (double semitones)   // C2 plus a fractional number of semitones, the fraction through the exp series
+{
+  return equalTemperament(FILTER_CUTOFF_NOTE_OFFSET + (uint8_t)semitones) * expSeries((semitones - (uint8_t)semitones) * M_LN2 / 12, 0, 1.0);
+}
+
+constexpr int16_t filterCoefficient (uint8_t value)        // Q15 f for a cutoff controller value
+{
+  return (int16_t)(32767.0 * 2.0 * compileTimeSin(M_PI * filterCutoffFrequency((value < FILTER_CUTOFF_STEPS ? value : FILTER_CUTOFF_STEPS) *
+                                                                                   (double)filterCutoffSpan(0) / FILTER_CUTOFF_STEPS) / Fs) + 0.5);
+}
+
+#define FILTER_COEFFICIENT_OCTAVE(n) \
+  filterCoefficient(n),     filterCoefficient(n + 1), filterCoefficient(n + 2), filterCoefficient(n + 3),  \
+  filterCoefficient(n + 4), filterCoefficient(n + 5), filterCoefficient(n + 6), filterCoefficient(n + 7),  \
+  filterCoefficient(n + 8), filterCoefficient(n + 9), filterCoefficient(n + 10), filterCoefficient(n + 11)
+
+const int16_t filterCutoffTable[128] PROGMEM =              // Q15 cutoff coefficient for every controller value, generated at compile time and kept in flash
+{
+  FILTER_COEFFICIENT_OCTAVE(0),  FILTER_COEFFICIENT_OCTAVE(12), FILTER_COEFFICIENT_OCTAVE(24), FILTER_COEFFICIENT_OCTAVE(36),
+  FILTER_COEFFICIENT_OCTAVE(48), FILTER_COEFFICIENT_OCTAVE(60), FILTER_COEFFICIENT_OCTAVE(72), FILTER_COEFFICIENT_OCTAVE(84),
+  FILTER_COEFFICIENT_OCTAVE(96), FILTER_COEFFICIENT_OCTAVE(108),
+  filterCoefficient(120), filterCoefficient(121), filterCoefficient(122), filterCoefficient(123),
+  filterCoefficient(124), filterCoefficient(125), filterCoefficient(126), filterCoefficient(127)
+};
+
+typedef struct svfFilter
+{
+  int16_t low = 0;                                          // low pass integrator state
+  int16_t band = 0;                                         // band pass integrator state
+  int16_t cutoff = filterCoefficient(127);                  // Q15 f from filterCutoffTable
+  uint8_t open = 1;                                         // cutoff controller at 127: the low pass lets everything through
+  int16_t damping = FILTER_DAMPING_MAX;                     // Q14 1 / Q
+  uint8_t mode = FILTER_OFF;
+} SvfFilter;
+
+ENGINE_STATE SvfFilter filter;                              // only touched by loop(), like the voices
+
+static inline int16_t filterSaturate (int32_t x)
+{
+  return x > 32767 ? 32767 : x < -32768 ? -32768 : (int16_t)x;
+}
+
+void filterSetMode (uint8_t mode)
+{
+  if (mode != filter.mode)
+  {
+    filter.low = 0;                                         // start the new response from rest rather than from the old one's state
+    filter.band = 0;
+    filter.mode = mode;
+  }
+}
+
+void filterSetCutoff (uint8_t value)                        // MIDI controller value 0-127
+{
+  filter.cutoff = pgm_read_word(&filterCutoffTable[value & 0x7F]);
+  filter.open = (value & 0x7F) > FILTER_CUTOFF_STEPS;
+}
+
+void filterSetResonance (uint8_t value)                     // MIDI controller value 0-127
+{
+  filter.damping = FILTER_DAMPING_MAX - (uint16_t)(((uint32_t)(FILTER_DAMPING_MAX - FILTER_DAMPING_MIN) * (value & 0x7F)) / 127);   // 127 lands on FILTER_DAMPING_MIN exactly
+}
+
+void filterBlock (const uint16_t* in, volatile uint16_t* out, uint8_t count)   // filters count mixed samples into out, saturated into the DAC range
+{
+  const uint8_t mode = filter.mode;
+  const uint8_t open = filter.open && mode == FILTER_LOW_PASS;   // still runs, so closing it again carries on from where the states are
+  const int16_t f = filter.cutoff;
+  const int16_t q = filter.damping;
+  int16_t low = filter.low;
+  int16_t band = filter.band;
+
+  for (uint8_t n = 0; n < count; n++)
+  {
+    int16_t sample = in[n];
+    if (mode != FILTER_OFF)
+    {
+      const int16_t input = (sample - FILTER_DAC_MIDDLE) * (1 << FILTER_INPUT_SHIFT);
+      low = filterSaturate(low + (((int32_t)f * band) >> 15));
+      const int16_t high = filterSaturate((int32_t)input - low - (((int32_t)q * band) >> 14));
+      band = filterSaturate(band + (((int32_t)f * high) >> 15));
+
+      if (!open)
+      {
+        const int16_t selected = mode == FILTER_LOW_PASS ? low : mode == FILTER_BAND_PASS ? band : high;
+        sample = (selected >> FILTER_INPUT_SHIFT) + FILTER_DAC_MIDDLE;
+      }
+    }
+    out[n] = sample < 0 ? 0 : sample > DAC_MAX ? DAC_MAX : sample;      // saturate into the 12 bit DAC range rather than wrapping around
+  }
+
+  filter.low = low;
+  filter.band = band;
+}
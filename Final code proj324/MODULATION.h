@@ -0,0 +1,128 @@
+// Control rate modulation: one LFO for vibrato and tremolo, 14 bit pitch bend and portamento. All of it runs in controlTick()
+// at CONTROL_RATE and only ever changes the two things the sample loop in renderBlock() already reads, a voice's
+// phase_increment and its gain, so modulation costs nothing per sample. Pitch is worked in Q8 semitones (note << PITCH_SHIFT):
+// bend, vibrato and glide are all adds, then one lookup in phaseIncrementTable for the semitone, one in pitchFineTable for
+// the fraction and a 32x16 multiply turn it into a phase increment. There is no float maths on the AVR and only a
+// controller moving or a note starting a glide divides.
+
+#define PITCH_SHIFT 8                                       // pitches are Q8 semitones, 1/256 of a semitone is 0.4 cents
+#define PITCH_MAX 0x7FFF                                    // note 127 and 255/256, the top of phaseIncrementTable
+#define NO_PITCH 0xFFFF                                     // startVoice() glide source when there is nothing to glide from
+#define GLIDE_SHIFT 8                                       // glides run in Q16 semitones (pitch << GLIDE_SHIFT) so a slow glide's step isn't rounded away
+
+#define MODULATION_BEND_RANGE 2                             // semitones either way at full pitch bend
+#define MODULATION_BEND_CENTRE 8192                         // 14 bit pitch bend value for no bend
+#define MODULATION_LFO_MIN_CENTIHZ 10                       // LFO rate controller 0 is 0.1Hz...
+#define MODULATION_LFO_MAX_CENTIHZ 2000                     // ...and 127 is 20Hz, squared in between like the envelope times
+#define MODULATION_DEFAULT_LFO_RATE 64                      // controller value, about 5Hz
+#define MODULATION_GLIDE_MAX_MS 2000                        // longest portamento time a controller can set
+
+// MIDI controllers for modulation (MIDI 1.0 and the GM2 sound controllers)
+#define MIDI_CC_MOD_WHEEL 1                                 // adds to the vibrato depth
+#define MIDI_CC_PORTAMENTO_TIME 5
+#define MIDI_CC_PORTAMENTO 65                               // 0-63 off, 64-127 on
+#define MIDI_CC_VIBRATO_RATE 76                             // the LFO rate, shared by vibrato and tremolo
+#define MIDI_CC_VIBRATO_DEPTH 77
+#define MIDI_CC_TREMOLO_DEPTH 92
+
+constexpr double expSeries (double x, uint8_t k, double term)   // remaining terms of the exp Taylor series from term k onwards, plenty for the small x here
+{
+  return k > 8 ? 0.0 : term + expSeries(x, k + 1, term * x / (k + 1));
+}
+
+constexpr uint16_t pitchFine (uint8_t fraction)            // 2^(fraction / (12 * 256)) - 1 in Q16, what a fraction of a semitone adds to an increment
+{
+  return (uint16_t)((expSeries(fraction * M_LN2 / (12 * 256), 0, 1.0) - 1.0) * 65536.0 + 0.5);
+}
+
+#define PITCH_FINE_ENTRIES(n) \
+  pitchFine(n),      pitchFine(n + 1),  pitchFine(n + 2),  pitchFine(n + 3),  pitchFine(n + 4),  pitchFine(n + 5),  \
+  pitchFine(n + 6),  pitchFine(n + 7),  pitchFine(n + 8),  pitchFine(n + 9),  pitchFine(n + 10), pitchFine(n + 11), \
+  pitchFine(n + 12), pitchFine(n + 13), pitchFine(n + 14), pitchFine(n + 15)
+
+const uint16_t pitchFineTable[1 << PITCH_SHIFT] PROGMEM =   // Q16 fraction of a semitone for every fractional pitch, generated at compile time and kept in flash
+{
+  PITCH_FINE_ENTRIES(0),   PITCH_FINE_ENTRIES(16),  PITCH_FINE_ENTRIES(32),  PITCH_FINE_ENTRIES(48),
+  PITCH_FINE_ENTRIES(64),  PITCH_FINE_ENTRIES(80),  PITCH_FINE_ENTRIES(96),  PITCH_FINE_ENTRIES(112),
+  PITCH_FINE_ENTRIES(128), PITCH_FINE_ENTRIES(144), PITCH_FINE_ENTRIES(160), PITCH_FINE_ENTRIES(176),
+  PITCH_FINE_ENTRIES(192), PITCH_FINE_ENTRIES(208), PITCH_FINE_ENTRIES(224), PITCH_FINE_ENTRIES(240)
+};
+
+constexpr uint16_t modulationLfoStep (uint8_t value)       // LFO phase added per control tick for a rate controller value
+{
+  return ((MODULATION_LFO_MIN_CENTIHZ + (uint32_t)value * value * (MODULATION_LFO_MAX_CENTIHZ - MODULATION_LFO_MIN_CENTIHZ) / (127 * 127)) * 65536UL) /
+         (100UL * CONTROL_RATE);
+}
+
+typedef struct modulation                                   // shared by every voice
+{
+  uint16_t lfo_phase = 0;                                   // one LFO cycle is the whole 16 bits
+  uint16_t lfo_step = modulationLfoStep(MODULATION_DEFAULT_LFO_RATE);
+  uint8_t vibrato_depth = 0;                                // controller values 0-127
+  uint8_t mod_wheel = 0;
+  uint8_t tremolo_depth = 0;
+  uint8_t portamento = 0;                                   // 1 while portamento is switched on
+  uint16_t glide_ms = 0;                                    // portamento time for any interval
+  int16_t bend = 0;                                         // Q8 semitones, +-MODULATION_BEND_RANGE << PITCH_SHIFT
+  int16_t pitch_offset = 0;                                 // bend plus vibrato this tick, added to every voice's pitch
+  uint8_t tremolo_dip = 0;                                  // every voice's gain is turned down by this / 256 this tick
+} Modulation;
+
+ENGINE_STATE Modulation modulation;                         // only touched by loop(), like the voices
+
+void modulationSetBend (uint8_t lsb, uint8_t msb)           // the two data bytes of a pitch bend message
+{
+  const int16_t value = (((uint16_t)msb << 7) | lsb) - MODULATION_BEND_CENTRE;
+  modulation.bend = ((int32_t)value * (MODULATION_BEND_RANGE << PITCH_SHIFT)) / MODULATION_BEND_CENTRE;
+}
+
+uint32_t modulationGlideStep (uint32_t from, uint32_t to)   // Q16 pitch moved per control tick to glide from one pitch to the other in glide_ms
+{
+  const uint32_t distance = from > to ? from - to : to - from;
+  const uint32_t ticks = ((uint32_t)modulation.glide_ms * CONTROL_RATE) / 1000;
+  if (ticks <= 1)
+  {
+    return distance;                                        // immediate
+  }
+  const uint32_t step = distance / ticks;
+  return step ? step : 1;
+}
+
+static inline uint32_t modulationGlide (uint32_t pitch, uint32_t target, uint32_t step)   // one control tick of a Q16 glide, stops exactly on the target
+{
+  if (pitch < target)
+  {
+    return target - pitch <= step ? target : pitch + step;
+  }
+  return pitch - target <= step ? target : pitch - step;
+}
+
+static inline void modulationTick ()                        // one control tick of the LFO, works out this tick's pitch offset and tremolo for all the voices
+{
+  modulation.lfo_phase += modulation.lfo_step;
+  const uint8_t position = modulation.lfo_phase >> 8;
+  const int8_t lfo = position < 128 ? (int8_t)(position * 2 - 128) : (int8_t)(383 - position * 2);   // triangle, -128 to 127
+
+  uint8_t depth = modulation.vibrato_depth + modulation.mod_wheel;
+  if (depth > 127)
+  {
+    depth = 127;
+  }
+  modulation.pitch_offset = modulation.bend + ((lfo * depth) >> 6);                 // full depth is about a semitone either way
+  modulation.tremolo_dip = ((uint8_t)(lfo + 128) * modulation.tremolo_depth) >> 8;  // full depth dips to half volume
+}
+
+static inline uint32_t modulationIncrement (int32_t pitch)   // phase increment for a Q8 semitone pitch
+{
+  if (pitch < 0)
+  {
+    pitch = 0;
+  } else if (pitch > PITCH_MAX)
+  {
+    pitch = PITCH_MAX;
+  }
+
+  const uint32_t increment = pgm_read_dword(&phaseIncrementTable[pitch >> PITCH_SHIFT]);
+  const uint16_t fine = pgm_read_word(&pitchFineTable[pitch & ((1 << PITCH_SHIFT) - 1)]);
+  return increment + (increment >> 16) * fine + (((increment & 0xFFFF) * fine) >> 16);   // increment * (1 + fine / 65536) without overflowing 32 bits
+}
@@ -1,9 +1,36 @@
-#define Fs 16000              //low sample rate for audio but is max Fs of ATMega328p
+// Storage for everything the engine changes as it runs (voices, buffers, MIDI parser state...), as opposed to the constant
+// tables in flash. Nothing on the chip, the host build makes it thread_local so each thread runs an engine of its own
+#ifndef ENGINE_STATE
+#define ENGINE_STATE
+#endif
+
+// Sample rate. 16kHz is the original rate, HIGH_SAMPLE_RATE doubles it to push aliasing of the upper notes above the audio
+// band. The sample path is cheap enough for either (blocks rendered in loop(), power of two tables, SPI overlapped with the
+// interrupt's bookkeeping), the static_assert in 3SYNTH_ENGINE2.ino checks VOICE_COUNT still fits. Fs can also be set directly
+#ifndef HIGH_SAMPLE_RATE
+#define HIGH_SAMPLE_RATE 0
+#endif
+#ifndef Fs
+#if HIGH_SAMPLE_RATE
+#define Fs 32000
+#else
+#define Fs 16000
+#endif
+#endif
+static_assert(F_CPU / Fs - 1 <= 0xFFFF && F_CPU / Fs >= 200, "Fs out of range for timer 1 at F_CPU");
+
+// Control rate. Envelopes and modulation don't need to move every sample, so they run once every CONTROL_SAMPLES samples
+// of the timer 1 sample clock (renderBlock() counts them off as it renders), 1kHz at 16kHz or 2kHz at 32kHz
+#ifndef CONTROL_SAMPLES
+#define CONTROL_SAMPLES 16                                    // samples per control tick
+#endif
+#define CONTROL_RATE (Fs / CONTROL_SAMPLES)                   // control ticks per second
 
 #define MIDI_BAUD_RATE 31250  //31.25 (+/- 1%) Kbaud (as stated in The MIDI 1.0 spec pg33)
+#define DAC_MAX 4095          //MCP4921 is 12 bit
 
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
-//-----------------------------------------------------------------------  16 bit timer used to generate interrupt 16000 times per sec  -------------------------------------------------------------------------
+//-------------------------------------------------------------------------  16 bit timer used to generate interrupt Fs times per sec  --------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
 void TIMER1_INIT() 
@@ -21,7 +48,7 @@ void TIMER1_INIT()
   TIMSK1 |= (1 << OCIE1A);                                    //TIMSK1 enables interrupts to trigger when TIMER1_INIT count reaches OCR1A 
 
   //OCR1A set to ensure correct sample rate
-  OCR1A |= (F_CPU / Fs) - 1;                                  //F_CPU is clock rate of ucontroller (16MHz) over sample rate = 1000 and minus 1 (999) as begining at 0
+  OCR1A |= (F_CPU / Fs) - 1;                                  //F_CPU is clock rate of ucontroller (16MHz) over sample rate = 1000 and minus 1 (999) as begining at 0 (499 at 32kHz)
 }                                                             //Basically TIMER1_INIT counts from 0 to OCR1A and then resets to 0
 
 
@@ -48,10 +75,61 @@ void USART_INIT ()
 //---------------------------------------------------------------------------------------  Writes data to USART data reg  ---------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
-void USART_Transmit (uint8_t data)
+// Bytes to send are queued in a ring buffer and the USART data register empty interrupt sends them one at a time as the
+// line frees up, so nothing ever waits on UDRE0. The interrupt is only enabled while there is something queued
+#define USART_TX_BUFFER_SIZE 64                         // must be a power of two, 64 bytes is 20ms of MIDI at 31.25 kbaud
+#define USART_TX_BUFFER_MASK (USART_TX_BUFFER_SIZE - 1)
+static_assert((USART_TX_BUFFER_SIZE & USART_TX_BUFFER_MASK) == 0 && USART_TX_BUFFER_SIZE <= 128, "USART_TX_BUFFER_SIZE must be a power of two no bigger than 128");
+
+ENGINE_STATE uint8_t usartTxBuffer[USART_TX_BUFFER_SIZE];
+ENGINE_STATE volatile uint8_t usartTxHead = 0;          // free running count of bytes queued, only changed with interrupts disabled
+ENGINE_STATE volatile uint8_t usartTxTail = 0;          // free running count of bytes sent, only changed by USART_UDRE_vect
+ENGINE_STATE volatile uint8_t usartTxHighWater = 0;     // most bytes ever waiting in the queue at once
+ENGINE_STATE volatile uint16_t usartTxOverflows = 0;    // bytes thrown away because the queue was full
+
+static inline uint8_t USART_TxFree ()                   // bytes that can still be queued
+{
+  return USART_TX_BUFFER_SIZE - (uint8_t)(usartTxHead - usartTxTail);
+}
+
+static inline void USART_QueueByte (uint8_t data)       // interrupts must be disabled, i.e. call from an interrupt or between cli() and restoring SREG
+{
+  const uint8_t head = usartTxHead;
+  const uint8_t queued = head - usartTxTail;
+
+  if (queued == USART_TX_BUFFER_SIZE)
+  {
+    usartTxOverflows++;
+    return;
+  }
+
+  usartTxBuffer[head & USART_TX_BUFFER_MASK] = data;
+  usartTxHead = head + 1;
+  if (queued + 1 > usartTxHighWater)
+  {
+    usartTxHighWater = queued + 1;
+  }
+  UCSR0B |= (1 << UDRIE0);                              // data register empty interrupt fires as soon as the line is free
+}
+
+void USART_Transmit (uint8_t data)                      // queues a byte without waiting, safe to call from anywhere
+{
+  uint8_t sreg = SREG;
+  cli();
+  USART_QueueByte(data);
+  SREG = sreg;
+}
+
+ISR (USART_UDRE_vect)                                   // USART data register is empty, send the next queued byte
 {
-  while ( !( UCSR0A & (1<<UDRE0)) );        // wait until transfer ready checks to see if USARTY data register has an empty flag written to it
-  UDR0 = data;                              // put data in USART data register
+  uint8_t tail = usartTxTail;
+  UDR0 = usartTxBuffer[tail & USART_TX_BUFFER_MASK];
+  usartTxTail = ++tail;
+
+  if (tail == usartTxHead)                              // queue empty, stop the interrupt until something else is queued
+  {
+    UCSR0B &= ~(1 << UDRIE0);
+  }
 }
 
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -66,6 +144,7 @@ void SPIDAC_INIT()
   PORTB |= (1 << PINB2);                                      //(CS Chip select pin) Sets PINB2 HIGH as not writing to DAC straight away
   
   SPCR = (1 << SPE) | (1 << MSTR);                            //Flag SPE as 1 so that SPI is enabled and flag MSTR as 1 so Master SPI mode is set
+  SPSR |= (1 << SPI2X);                                       //SPI2X doubles SCK to fosc/2 (8MHz, the MCP4921 takes up to 20MHz) so a byte takes 16 cycles instead of 32
 }
 
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
@@ -88,4 +167,80 @@ void SPI_transmit(uint16_t data)                              //16 bit data
   while (!(SPSR & (1 << SPIF)) );                             //Waits for SPSR and SPIF interrupt flag is high indicating transfer is complete
   
   PORTB |= (1 << PINB2);                                      //Finally CS needs to be pulled HIGH
-}
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+////--------------------------------------------------------------------------------  Overlapped SPI transfer for the sample interrupt  ---------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// SPI_transmit waits out both bytes. The sample interrupt splits the same transfer up so the CPU works while the bytes shift out:
+// SPI_dacStart sends the first byte and returns, the caller does its bookkeeping, SPI_dacFinish waits for the first byte and
+// starts the second without waiting for it. CS is only pulled high (which latches the word into the MCP4921, LDAC is tied low)
+// by SPI_dacLatch at the start of the next sample, long after the second byte is out. The DAC output is one sample later but
+// still on the timer 1 edge, so there is no added jitter
+
+ENGINE_STATE volatile uint8_t dacSelected = 0;                //1 from SPI_dacStart to SPI_dacLatch, a word is being sent or waiting to latch
+
+static inline void SPI_dacLatch ()                            //ends the previous sample's transfer
+{
+  PORTB |= (1 << PINB2);                                      //CS HIGH latches the word sent last sample
+  dacSelected = 0;
+  (void)SPSR;                                                 //reading SPSR with SPIF set (from the unwaited 2nd byte) then writing SPDR clears SPIF, so SPI_dacFinish waits for the right byte
+}
+
+static inline void SPI_dacStart (uint16_t data)
+{
+  PORTB &= ~(1 << PINB2);                                     //CS LOW
+  dacSelected = 1;
+  SPDR = 0b00110000 | (data >> 8);                            //same config bits and data bits 11-8 as SPI_transmit
+}
+
+static inline void SPI_dacFinish (uint16_t data)
+{
+  while ( !(SPSR & (1 << SPIF)) );                            //normally already done, the bookkeeping between start and finish takes about as long as the 16 cycle byte
+  SPDR = (uint8_t)data;                                       //data bits 7-0, shifts out while the interrupt returns
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+////----------------------------------------------------------------------------------------  SPI flash reads  ------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Sample flash (SAMPLE_STREAM.h), a 25 series serial flash (W25Q and the like, mode 0 up to well past 8MHz) sharing SCK, MOSI
+// and MISO with the MCP4921 and selected by its own pin. The MCP4921 is selected from SPI_dacStart to the next SPI_dacLatch,
+// so SPI_flashRead must only be called between SPI_dacLatch and SPI_dacStart in the sample interrupt, or while timer 1
+// is stopped (POWER.h) or not started yet
+#define FLASH_CS_PIN PINB0                                    //Arduino pin 8
+#define FLASH_READ_DATA 0x03                                  //read command, then a 24 bit address, then data for as long as CS stays low
+
+#ifndef FLASH_DESELECT
+#define FLASH_DESELECT() (PORTB |= (1 << FLASH_CS_PIN))       //CS HIGH ends the read
+#endif
+
+void SPIFLASH_INIT()
+{
+  DDRB |= (1 << FLASH_CS_PIN);
+  FLASH_DESELECT();
+}
+
+static inline uint8_t SPI_exchange (uint8_t data)            //one byte out and one in, waiting for both
+{
+  SPDR = data;
+  while ( !(SPSR & (1 << SPIF)) );
+  return SPDR;
+}
+
+void SPI_flashRead (uint32_t address, uint8_t* buffer, uint8_t count)
+{
+  (void)SPSR;                                                 //SPIF is still set from the last byte anything sent, reading SPSR then SPDR clears it so the first wait below is for our own byte
+  (void)SPDR;
+  PORTB &= ~(1 << FLASH_CS_PIN);                              //CS LOW
+  SPI_exchange(FLASH_READ_DATA);
+  SPI_exchange(address >> 16);
+  SPI_exchange(address >> 8);
+  SPI_exchange(address);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    buffer[i] = SPI_exchange(0);                              //the flash shifts a data byte out on MISO for every byte sent
+  }
+  FLASH_DESELECT();
+}
@@ -0,0 +1,89 @@
+// Low power. loop() sleeps the CPU in idle mode whenever it has nothing to do, so between sample interrupts while notes
+// are sounding and all the way from one MIDI message to the next when they aren't. Once every voice has finished its release
+// and POWER_SETTLE_BLOCKS rendered blocks in a row have held the same word, loop() also stops timer 1 (powerStopSamples), so
+// there is no sample interrupt and no DAC traffic at all until something happens; the MCP4921 keeps holding the settled word.
+// Idle is the only sleep mode that keeps the USART clocked, so the first byte of a MIDI message is received as normal by
+// USART_RX_vect and wakes the CPU (power down would need the start bit to wake it and lose the byte). The wave select
+// button is on a pin change interrupt rather than polled, so it wakes the CPU too. Everything the sketch never uses (ADC,
+// TWI, timer 2) is switched off for good in powerInit.
+//
+// Waking is handled by loop(): it throws away the silent blocks still buffered, renders a block for whatever woke it and
+// only then restarts timer 1 (powerStartSamples), so the first sample is out POWER_WAKE_CYCLES after the message, sooner
+// than the two buffered blocks it would otherwise have waited behind.
+
+#ifndef POWER_IDLE
+#define POWER_IDLE 1                                        // 0 keeps the sample interrupt running even when nothing is sounding (PROFILER.h times with timer 1, so it needs 0 to time interrupts taken while idle)
+#endif
+#define POWER_SETTLE_BLOCKS 2                               // both buffered blocks hold the settled word, so the DAC is left on it
+
+#ifndef POWER_SLEEP
+#define POWER_SLEEP() __asm__ __volatile__ ("sleep")        // sleep until the next interrupt in the mode set in SMCR
+#endif
+
+ENGINE_STATE uint8_t powerIdle = 0;                         // 1 while timer 1 is stopped
+ENGINE_STATE uint8_t powerSettledBlocks = 0;                // blocks in a row rendered with every voice silent, each holding the same word throughout
+ENGINE_STATE uint16_t powerSettledWord = 0;                 // the last word of the last block rendered
+
+void powerInit ()
+{
+  ADCSRA &= ~(1 << ADEN);                                   // the Arduino core turns the ADC on, it has to be off before PRADC stops its clock
+  PRR |= (1 << PRADC) | (1 << PRTWI) | (1 << PRTIM2);
+  SMCR = 0;                                                 // SM2-0 = 0 is idle mode, SE is only set just before sleeping
+}
+
+static inline void powerBlockRendered (const volatile uint16_t* block, uint8_t count, uint8_t silent)   // silent when every voice's envelope is idle
+{
+  uint8_t settled = silent;
+  for (uint8_t n = 0; n < count && settled; n++)           // the filter can still be ringing down after the voices stop
+  {
+    settled = block[n] == powerSettledWord;
+  }
+  powerSettledWord = block[count - 1];
+
+  if (!settled)
+  {
+    powerSettledBlocks = 0;
+  } else if (powerSettledBlocks < POWER_SETTLE_BLOCKS)
+  {
+    powerSettledBlocks++;
+  }
+}
+
+void powerStopSamples ()
+{
+  cli();
+  TIMSK1 &= ~(1 << OCIE1A);
+  if (dacSelected)                                          // the last sample interrupt sent a word, which may still be shifting out. One that had nothing to send
+  {                                                         // left SPIF however its flash read did, waiting for it then would never end
+    while (!(SPSR & (1 << SPIF)));
+    SPI_dacLatch();                                         // CS HIGH, which the next sample interrupt would have done
+  }
+  sei();
+
+  TIMSK0 &= ~(1 << TOIE0);                                  // the Arduino core's millis() interrupt would wake the CPU every 1.024ms
+  PRR |= (1 << PRTIM1) | (1 << PRSPI);
+  powerIdle = 1;
+}
+
+void powerStartSamples ()                                   // call with a block ready to play
+{
+  PRR &= ~((1 << PRTIM1) | (1 << PRSPI));
+  SPIDAC_INIT();                                            // the SPI has to be set up again after PRSPI
+  TIMSK0 |= (1 << TOIE0);
+  powerIdle = 0;
+  powerSettledBlocks = 0;
+
+  cli();
+  TCNT1 = 0;                                                // a whole sample period before the first interrupt
+  TIFR1 = (1 << OCF1A);                                     // writing 1 clears a compare match left over from stopping
+  TIMSK1 |= (1 << OCIE1A);
+  sei();
+}
+
+static inline void powerSleep ()                            // call with interrupts disabled, once it is certain there is nothing to do until the next interrupt
+{
+  SMCR = (1 << SE);
+  sei();                                                    // the instruction after sei() always runs before any interrupt, so one arriving now still ends the sleep
+  POWER_SLEEP();
+  SMCR = 0;
+}
@@ -0,0 +1,113 @@
+// Opt-in cycle profiler. Build with PROFILING set to 1 and each probe records how long a piece of code took: a count,
+// the total (for the average), min, max and a histogram with power of two buckets. The results are read out over MIDI
+// as a SysEx telemetry report (see sendTelemetry in 3SYNTH_ENGINE2.ino), so they can be checked on stage without a debugger.
+//
+// Times come from Timer1, which already counts CPU cycles from 0 to OCR1A every sample: a timestamp is the number of sample
+// periods so far times the period, plus TCNT1. The host build supplies its own PROFILE_TIMESTAMP (std::chrono, in
+// nanoseconds) so the same probes work there. While POWER.h has timer 1 stopped the clock stands still, so the MIDI RX ISR
+// and loop MIDI probes taken then (the note that wakes the synth, say) record 0 cycles and pull the min and average down;
+// build with POWER_IDLE 0 to time those too.
+
+#ifndef PROFILING
+#define PROFILING 0
+#endif
+
+#define PROFILE_SAMPLE_ISR 0                                // TIMER1_COMPA_vect
+#define PROFILE_MIDI_RX_ISR 1                               // USART_RX_vect
+#define PROFILE_LOOP_MIDI 2                                 // loop() processing MIDI events
+#define PROFILE_LOOP_RENDER 3                               // loop() rendering a block
+#define PROFILE_CONTROL_TICK 4                              // one controlTick() (envelopes and modulation), inside PROFILE_LOOP_RENDER
+#define PROFILE_PROBES 5
+
+#ifndef FREE_RAM
+extern int __heap_start, *__brkval;                         // set up by avr-libc, the heap grows up from __heap_start towards the stack
+
+static inline uint16_t freeRam ()                           // bytes between the top of the heap and the bottom of the stack
+{
+  uint8_t top;
+  return (uint16_t)((int)&top - (__brkval == 0 ? (int)&__heap_start : (int)__brkval));
+}
+#define FREE_RAM() freeRam()
+#endif
+
+#define PROFILE_BUCKETS 8                                   // bucket 0 is under 128 cycles, each bucket after doubles, the last is 8192 and up
+#define PROFILE_FIRST_BUCKET_BITS 7
+
+typedef struct profileStats
+{
+  uint32_t count;                                           // number of times the probe ran
+  uint32_t total;                                           // sum of all durations, total / count is the average
+  uint16_t min;
+  uint16_t max;
+  uint16_t buckets[PROFILE_BUCKETS];                        // histogram of durations (saturates at 65535)
+} ProfileStats;
+
+#if PROFILING
+
+ENGINE_STATE ProfileStats profileStats[PROFILE_PROBES];
+ENGINE_STATE volatile uint32_t profileSamplePeriods = 0;    // sample periods since boot, counted at the start of timer 1 interrupt
+
+#ifndef PROFILE_TIMESTAMP
+static inline uint32_t profileTimestamp ()                  // CPU cycles since boot (wraps every 4.5 minutes, durations are still right across the wrap)
+{
+  uint8_t sreg = SREG;
+  cli();
+  uint32_t periods = profileSamplePeriods;
+  uint16_t count = TCNT1;
+  if (TIFR1 & (1 << OCF1A))                                 // TCNT1 has wrapped but timer 1 interrupt hasn't run yet to count it
+  {
+    periods++;
+    count = TCNT1;
+  }
+  SREG = sreg;
+  return periods * (F_CPU / Fs) + count;
+}
+#define PROFILE_TIMESTAMP() profileTimestamp()
+#endif
+
+static inline void profileRecord (uint8_t probe, uint32_t duration)   // each probe is only ever recorded from one context, interrupt or loop()
+{
+  ProfileStats* stats = &profileStats[probe];
+  const uint16_t ticks = duration > 0xFFFF ? 0xFFFF : duration;
+
+  if (stats->count == 0 || ticks < stats->min)
+  {
+    stats->min = ticks;
+  }
+  if (ticks > stats->max)
+  {
+    stats->max = ticks;
+  }
+  stats->count++;
+  stats->total += ticks;
+
+  uint8_t bucket = 0;
+  for (uint16_t limit = ticks >> PROFILE_FIRST_BUCKET_BITS; limit && bucket < PROFILE_BUCKETS - 1; limit >>= 1)
+  {
+    bucket++;
+  }
+  if (stats->buckets[bucket] != 0xFFFF)
+  {
+    stats->buckets[bucket]++;
+  }
+}
+
+void profileReset ()
+{
+  uint8_t sreg = SREG;
+  cli();
+  memset(profileStats, 0, sizeof(profileStats));
+  SREG = sreg;
+}
+
+#define PROFILE_SAMPLE_PERIOD() profileSamplePeriods++      // first thing in timer 1 interrupt, keeps profileTimestamp counting
+#define PROFILE_START(name) const uint32_t name##ProfileStart = PROFILE_TIMESTAMP()
+#define PROFILE_END(probe, name) profileRecord(probe, PROFILE_TIMESTAMP() - name##ProfileStart)
+
+#else
+
+#define PROFILE_SAMPLE_PERIOD()
+#define PROFILE_START(name)
+#define PROFILE_END(probe, name)
+
+#endif
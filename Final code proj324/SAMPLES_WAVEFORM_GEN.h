@@ -1,128 +1,126 @@
 #include <math.h>
 
-#define INITIAL_WAVE_FREQ 100                              // Frequency waveforms will be sampled at. One cycle of each waveform will be stored in the buffers at this frequency in Hz
-#define INITIAL_WAVE_TABLE_SIZE (Fs / INITIAL_WAVE_FREQ)   // The size of one waveform in the wave buffer.(16000/100) = 160 bytes in length
-
-// correct floating point increment for each musical frequency (freq / sample rate gives us cycles per sample
-// but then we have to multiply by the initial wave table size since 1 cycle is now (sample rate / initial wave frequency) samples
-#define MUSIC_C0 INITIAL_WAVE_TABLE_SIZE * (16.35 / Fs)
-#define MUSIC_Db0 INITIAL_WAVE_TABLE_SIZE * (17.32 / Fs)
-#define MUSIC_D0 INITIAL_WAVE_TABLE_SIZE * (18.35 / Fs)
-#define MUSIC_Eb0 INITIAL_WAVE_TABLE_SIZE * (19.45 / Fs)
-#define MUSIC_E0 INITIAL_WAVE_TABLE_SIZE * (20.60 / Fs)
-#define MUSIC_F0 INITIAL_WAVE_TABLE_SIZE * (21.83 / Fs)
-#define MUSIC_Gb0 INITIAL_WAVE_TABLE_SIZE * (23.12 / Fs)
-#define MUSIC_G0 INITIAL_WAVE_TABLE_SIZE * (24.50 / Fs)
-#define MUSIC_Ab0 INITIAL_WAVE_TABLE_SIZE * (25.96 / Fs)
-#define MUSIC_A0 INITIAL_WAVE_TABLE_SIZE * (27.50 / Fs)
-#define MUSIC_Bb0 INITIAL_WAVE_TABLE_SIZE * (29.14 / Fs)
-#define MUSIC_B0 INITIAL_WAVE_TABLE_SIZE * (30.87 / Fs)
-#define MUSIC_C1 INITIAL_WAVE_TABLE_SIZE * (32.70 / Fs)
-#define MUSIC_Db1 INITIAL_WAVE_TABLE_SIZE * (34.65 / Fs)
-#define MUSIC_D1 INITIAL_WAVE_TABLE_SIZE * (36.71 / Fs)
-#define MUSIC_Eb1 INITIAL_WAVE_TABLE_SIZE * (38.89 / Fs)
-#define MUSIC_E1 INITIAL_WAVE_TABLE_SIZE * (41.20 / Fs)
-#define MUSIC_F1 INITIAL_WAVE_TABLE_SIZE * (43.65 / Fs)
-#define MUSIC_Gb1 INITIAL_WAVE_TABLE_SIZE * (46.25 / Fs)
-#define MUSIC_G1 INITIAL_WAVE_TABLE_SIZE * (49.00 / Fs)
-#define MUSIC_Ab1 INITIAL_WAVE_TABLE_SIZE * (51.91 / Fs)
-#define MUSIC_A1 INITIAL_WAVE_TABLE_SIZE * (55.00 / Fs)
-#define MUSIC_Bb1 INITIAL_WAVE_TABLE_SIZE * (58.27 / Fs)
-#define MUSIC_B1 INITIAL_WAVE_TABLE_SIZE * (61.74 / Fs)
-#define MUSIC_C2 INITIAL_WAVE_TABLE_SIZE * (65.41 / Fs)
-#define MUSIC_Db2 INITIAL_WAVE_TABLE_SIZE * (69.30 / Fs)
-#define MUSIC_D2 INITIAL_WAVE_TABLE_SIZE * (73.42 / Fs)
-#define MUSIC_Eb2 INITIAL_WAVE_TABLE_SIZE * (77.78 / Fs)
-#define MUSIC_E2 INITIAL_WAVE_TABLE_SIZE * (82.41 / Fs)
-#define MUSIC_F2 INITIAL_WAVE_TABLE_SIZE * (87.31 / Fs)
-#define MUSIC_Gb2 INITIAL_WAVE_TABLE_SIZE * (92.50 / Fs)
-#define MUSIC_G2 INITIAL_WAVE_TABLE_SIZE * (98.00 / Fs)
-#define MUSIC_Ab2 INITIAL_WAVE_TABLE_SIZE * (103.83 / Fs)
-#define MUSIC_A2 INITIAL_WAVE_TABLE_SIZE * (110.00 / Fs)
-#define MUSIC_Bb2 INITIAL_WAVE_TABLE_SIZE * (116.54 / Fs)
-#define MUSIC_B2 INITIAL_WAVE_TABLE_SIZE * (123.47 / Fs)
-#define MUSIC_C3 INITIAL_WAVE_TABLE_SIZE * (130.81 / Fs)
-#define MUSIC_Db3 INITIAL_WAVE_TABLE_SIZE * (138.59 / Fs)
-#define MUSIC_D3 INITIAL_WAVE_TABLE_SIZE * (146.83 / Fs)
-#define MUSIC_Eb3 INITIAL_WAVE_TABLE_SIZE * (155.56 / Fs)
-#define MUSIC_E3 INITIAL_WAVE_TABLE_SIZE * (164.81 / Fs)
-#define MUSIC_F3 INITIAL_WAVE_TABLE_SIZE * (174.61 / Fs)
-#define MUSIC_Gb3 INITIAL_WAVE_TABLE_SIZE * (185.00 / Fs)
-#define MUSIC_G3 INITIAL_WAVE_TABLE_SIZE * (196.00 / Fs)
-#define MUSIC_Ab3 INITIAL_WAVE_TABLE_SIZE * (207.65 / Fs)
-#define MUSIC_A3 INITIAL_WAVE_TABLE_SIZE * (220.00 / Fs)
-#define MUSIC_Bb3 INITIAL_WAVE_TABLE_SIZE * (233.08 / Fs)
-#define MUSIC_B3 INITIAL_WAVE_TABLE_SIZE * (246.94 / Fs)
-#define MUSIC_C4 INITIAL_WAVE_TABLE_SIZE * (261.63 / Fs)
-#define MUSIC_Db4 INITIAL_WAVE_TABLE_SIZE * (277.18 / Fs)
-#define MUSIC_D4 INITIAL_WAVE_TABLE_SIZE * (293.66 / Fs)
-#define MUSIC_Eb4 INITIAL_WAVE_TABLE_SIZE * (311.13 / Fs)
-#define MUSIC_E4 INITIAL_WAVE_TABLE_SIZE * (329.63 / Fs)
-#define MUSIC_F4 INITIAL_WAVE_TABLE_SIZE * (349.23 / Fs)
-#define MUSIC_Gb4 INITIAL_WAVE_TABLE_SIZE * (369.99 / Fs)
-#define MUSIC_G4 INITIAL_WAVE_TABLE_SIZE * (392.00 / Fs)
-#define MUSIC_Ab4 INITIAL_WAVE_TABLE_SIZE * (415.30 / Fs)
-#define MUSIC_A4 INITIAL_WAVE_TABLE_SIZE * (440.00 / Fs)
-#define MUSIC_Bb4 INITIAL_WAVE_TABLE_SIZE * (466.16 / Fs)
-#define MUSIC_B4 INITIAL_WAVE_TABLE_SIZE * (493.88 / Fs)
-#define MUSIC_C5 INITIAL_WAVE_TABLE_SIZE * (523.25 / Fs)
-#define MUSIC_Db5 INITIAL_WAVE_TABLE_SIZE * (554.37 / Fs)
-#define MUSIC_D5 INITIAL_WAVE_TABLE_SIZE * (587.33 / Fs)
-#define MUSIC_Eb5 INITIAL_WAVE_TABLE_SIZE * (622.25 / Fs)
-#define MUSIC_E5 INITIAL_WAVE_TABLE_SIZE * (659.25 / Fs)
-#define MUSIC_F5 INITIAL_WAVE_TABLE_SIZE * (698.46 / Fs)
-#define MUSIC_Gb5 INITIAL_WAVE_TABLE_SIZE * (739.99 / Fs)
-#define MUSIC_G5 INITIAL_WAVE_TABLE_SIZE * (783.99 / Fs)
-#define MUSIC_Ab5 INITIAL_WAVE_TABLE_SIZE * (830.61 / Fs)
-#define MUSIC_A5 INITIAL_WAVE_TABLE_SIZE * (880.00 / Fs)
-#define MUSIC_Bb5 INITIAL_WAVE_TABLE_SIZE * (932.33 / Fs)
-#define MUSIC_B5 INITIAL_WAVE_TABLE_SIZE * (987.77 / Fs)
-#define MUSIC_C6 INITIAL_WAVE_TABLE_SIZE * (1046.50 / Fs)
-#define MUSIC_Db6 INITIAL_WAVE_TABLE_SIZE * (1108.73 / Fs)
-#define MUSIC_D6 INITIAL_WAVE_TABLE_SIZE * (1174.66 / Fs)
-#define MUSIC_Eb6 INITIAL_WAVE_TABLE_SIZE * (1244.51 / Fs)
-#define MUSIC_E6 INITIAL_WAVE_TABLE_SIZE * (1318.51 / Fs)
-#define MUSIC_F6 INITIAL_WAVE_TABLE_SIZE * (1396.91 / Fs)
-#define MUSIC_Gb6 INITIAL_WAVE_TABLE_SIZE * (1479.98 / Fs)
-#define MUSIC_G6 INITIAL_WAVE_TABLE_SIZE * (1567.98 / Fs)
-#define MUSIC_Ab6 INITIAL_WAVE_TABLE_SIZE * (1661.22 / Fs)
-#define MUSIC_A6 INITIAL_WAVE_TABLE_SIZE * (1760.00 / Fs)
-#define MUSIC_Bb6 INITIAL_WAVE_TABLE_SIZE * (1864.66 / Fs)
-#define MUSIC_B6 INITIAL_WAVE_TABLE_SIZE * (1975.53 / Fs)
-#define MUSIC_C7 INITIAL_WAVE_TABLE_SIZE * (2093.00 / Fs)
-#define MUSIC_Db7 INITIAL_WAVE_TABLE_SIZE * (2217.46 / Fs)
-#define MUSIC_D7 INITIAL_WAVE_TABLE_SIZE * (2349.32 / Fs)
-#define MUSIC_Eb7 INITIAL_WAVE_TABLE_SIZE * (2489.02 / Fs)
-#define MUSIC_E7 INITIAL_WAVE_TABLE_SIZE * (2637.02 / Fs)
-#define MUSIC_F7 INITIAL_WAVE_TABLE_SIZE * (2793.83 / Fs)
-#define MUSIC_Gb7 INITIAL_WAVE_TABLE_SIZE * (2959.96 / Fs)
-#define MUSIC_G7 INITIAL_WAVE_TABLE_SIZE * (3135.96 / Fs)
-#define MUSIC_Ab7 INITIAL_WAVE_TABLE_SIZE * (3322.44 / Fs)
-#define MUSIC_A7 INITIAL_WAVE_TABLE_SIZE * (3520.00 / Fs)
-#define MUSIC_Bb7 INITIAL_WAVE_TABLE_SIZE * (3729.31 / Fs)
-#define MUSIC_B7 INITIAL_WAVE_TABLE_SIZE * (3951.07 / Fs)
-#define MUSIC_C8 INITIAL_WAVE_TABLE_SIZE * (4186.01 / Fs)
-#define MUSIC_Db8 INITIAL_WAVE_TABLE_SIZE * (4434.92 / Fs)
-#define MUSIC_D8 INITIAL_WAVE_TABLE_SIZE * (4698.63 / Fs)
-#define MUSIC_Eb8 INITIAL_WAVE_TABLE_SIZE * (4978.03 / Fs)
-#define MUSIC_E8 INITIAL_WAVE_TABLE_SIZE * (5274.04 / Fs)
-#define MUSIC_F8 INITIAL_WAVE_TABLE_SIZE * (5587.65 / Fs)
-#define MUSIC_Gb8 INITIAL_WAVE_TABLE_SIZE * (5919.91 / Fs)
-#define MUSIC_G8 INITIAL_WAVE_TABLE_SIZE * (6271.93 / Fs)
-#define MUSIC_Ab8 INITIAL_WAVE_TABLE_SIZE * (6644.88 / Fs)
-#define MUSIC_A8 INITIAL_WAVE_TABLE_SIZE * (7040.00 / Fs)
-#define MUSIC_Bb8 INITIAL_WAVE_TABLE_SIZE * (7458.62 / Fs)
-#define MUSIC_B8 INITIAL_WAVE_TABLE_SIZE * (7902.13 / Fs)
-
-uint8_t waveBuffer[INITIAL_WAVE_TABLE_SIZE * 4];                            // The waveBuffer holds all 4 waveforms of INITIAL_WAVE_FREQ
-
-//Pointers to each waveform in the buffer
-uint8_t* sineWave = &waveBuffer[0];                                         // Pointer to beginning of sine waveform
-uint8_t* triangleWave = &waveBuffer[INITIAL_WAVE_TABLE_SIZE];               // Pointer to beginning of triangle waveform
-uint8_t* squareWave = &waveBuffer[INITIAL_WAVE_TABLE_SIZE * 2];             // Pointer to beginning of square waveform
-uint8_t* sawtoothWave = &waveBuffer[INITIAL_WAVE_TABLE_SIZE * 3];           // Pointer to beginning of sawtooth waveform
-uint8_t* wave_pointer = sineWave;                                           // Current pointer, to begin with point at sine
+// Waveforms are generated by the compiler and stored in flash (PROGMEM), so setup() has no float maths to do and
+// none of the 2KB of SRAM is spent on them. Tables are a power of two long, so the top WAVE_TABLE_BITS bits of a
+// 32 bit phase accumulator index them directly and the wrap around the table is just the accumulator overflowing
+#ifndef WAVE_TABLE_BITS
+#define WAVE_TABLE_BITS 8                                  // 8 gives 256 samples per waveform
+#endif
+#define WAVE_TABLE_SIZE (1 << WAVE_TABLE_BITS)             // The size of one waveform in the wave table
+#define WAVE_TABLE_MASK (WAVE_TABLE_SIZE - 1)
+#define WAVE_COUNT 4                                       // sine, triangle, square, sawtooth
 
+// Phase accumulator tuning (DDS). Each voice keeps its position in the wave table as a 32 bit fixed point number, the top
+// WAVE_TABLE_BITS bits are the table index and the PHASE_FRACTION_BITS below them carry the exact pitch. PHASE_CYCLE is one
+// full cycle of the waveform, so adding phaseIncrementTable[note] once per sample advances (freq / Fs) cycles
+#define PHASE_FRACTION_BITS (32 - WAVE_TABLE_BITS)
+#define PHASE_CYCLE 4294967296.0                            // 2^32
+
+#define MUSIC_C0_FREQ 16.351597831287414                    // C0 in equal temperament with A4 (MIDI_A4) = 440Hz
+#define SEMITONE_RATIO 1.0594630943592953                   // 2^(1/12)
+
+constexpr double semitonePower (uint8_t semitones)          // SEMITONE_RATIO^semitones for 0-11 semitones, evaluated by the compiler
+{
+  return semitones == 0 ? 1.0 : SEMITONE_RATIO * semitonePower(semitones - 1);
+}
+
+constexpr double equalTemperament (uint8_t note)            // frequency in Hz of a MIDI note value (C0 = 0)
+{
+  return MUSIC_C0_FREQ * (1UL << (note / 12)) * semitonePower(note % 12);
+}
+
+constexpr double noteFrequency (uint8_t note)               // frequency the synth plays for a note. Notes at or above Nyquist (B8 and up at 16kHz, none at 32kHz) repeat the octave below
+{
+  return equalTemperament(note) >= Fs / 2.0 ? noteFrequency(note - 12) : equalTemperament(note);
+}
+
+#define NOTE_PHASE_INCREMENT(note) ((uint32_t)(noteFrequency(note) * PHASE_CYCLE / Fs + 0.5))
+#define NOTE_PHASE_INCREMENT_OCTAVE(n) \
+  NOTE_PHASE_INCREMENT(n),     NOTE_PHASE_INCREMENT(n + 1), NOTE_PHASE_INCREMENT(n + 2), NOTE_PHASE_INCREMENT(n + 3),  \
+  NOTE_PHASE_INCREMENT(n + 4), NOTE_PHASE_INCREMENT(n + 5), NOTE_PHASE_INCREMENT(n + 6), NOTE_PHASE_INCREMENT(n + 7),  \
+  NOTE_PHASE_INCREMENT(n + 8), NOTE_PHASE_INCREMENT(n + 9), NOTE_PHASE_INCREMENT(n + 10), NOTE_PHASE_INCREMENT(n + 11)
+
+const uint32_t phaseIncrementTable[128] PROGMEM =           // phase increment per sample for every MIDI note value, generated at compile time and kept in flash
+{
+  NOTE_PHASE_INCREMENT_OCTAVE(0),  NOTE_PHASE_INCREMENT_OCTAVE(12), NOTE_PHASE_INCREMENT_OCTAVE(24), NOTE_PHASE_INCREMENT_OCTAVE(36),
+  NOTE_PHASE_INCREMENT_OCTAVE(48), NOTE_PHASE_INCREMENT_OCTAVE(60), NOTE_PHASE_INCREMENT_OCTAVE(72), NOTE_PHASE_INCREMENT_OCTAVE(84),
+  NOTE_PHASE_INCREMENT_OCTAVE(96), NOTE_PHASE_INCREMENT_OCTAVE(108),
+  NOTE_PHASE_INCREMENT(120), NOTE_PHASE_INCREMENT(121), NOTE_PHASE_INCREMENT(122), NOTE_PHASE_INCREMENT(123),
+  NOTE_PHASE_INCREMENT(124), NOTE_PHASE_INCREMENT(125), NOTE_PHASE_INCREMENT(126), NOTE_PHASE_INCREMENT(127)
+};
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------------  Compile time maths  ---------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+constexpr double cosineSeries (double x2, uint8_t k, double term)   // remaining terms of the cos Taylor series from term k onwards
+{
+  return k > 12 ? 0.0 : term + cosineSeries(x2, k + 1, -term * x2 / ((2.0 * k + 1.0) * (2.0 * k + 2.0)));
+}
+
+constexpr double compileTimeCos (double x)                 // cos(x) for 0 <= x < 2pi, brought into -pi..pi where 12 terms of the series are plenty for 8 bit samples
+{
+  return x > M_PI ? cosineSeries((x - 2.0 * M_PI) * (x - 2.0 * M_PI), 0, 1.0) : cosineSeries(x * x, 0, 1.0);
+}
+
+constexpr double compileTimeSin (double x)                 // sin(x) for 0 <= x < 2pi
+{
+  return compileTimeCos(x < M_PI / 2 ? x + 1.5 * M_PI : x - M_PI / 2);
+}
+
+#define WAVE_ENTRIES_4(wave, level, n) waveSample(wave, level, n), waveSample(wave, level, n + 1), waveSample(wave, level, n + 2), waveSample(wave, level, n + 3)
+#define WAVE_ENTRIES_16(wave, level, n) WAVE_ENTRIES_4(wave, level, n), WAVE_ENTRIES_4(wave, level, n + 4), WAVE_ENTRIES_4(wave, level, n + 8), WAVE_ENTRIES_4(wave, level, n + 12)
+#define WAVE_ENTRIES_64(wave, level, n) WAVE_ENTRIES_16(wave, level, n), WAVE_ENTRIES_16(wave, level, n + 16), WAVE_ENTRIES_16(wave, level, n + 32), WAVE_ENTRIES_16(wave, level, n + 48)
+#define WAVE_ENTRIES_128(wave, level, n) WAVE_ENTRIES_64(wave, level, n), WAVE_ENTRIES_64(wave, level, n + 64)
+#define WAVE_ENTRIES_256(wave, level, n) WAVE_ENTRIES_128(wave, level, n), WAVE_ENTRIES_128(wave, level, n + 128)
+#define WAVE_ENTRIES_512(wave, level, n) WAVE_ENTRIES_256(wave, level, n), WAVE_ENTRIES_256(wave, level, n + 256)
+
+#define WAVE_LEVEL(wave, level) { WAVE_TABLE_ENTRIES(wave, level) }
+#define WAVE_LEVELS_5(wave) WAVE_LEVEL(wave, 0), WAVE_LEVEL(wave, 1), WAVE_LEVEL(wave, 2), WAVE_LEVEL(wave, 3), WAVE_LEVEL(wave, 4)
+#define WAVE_LEVELS_6(wave) WAVE_LEVELS_5(wave), WAVE_LEVEL(wave, 5)
+#define WAVE_LEVELS_7(wave) WAVE_LEVELS_6(wave), WAVE_LEVEL(wave, 6)
+#define WAVE_LEVELS_8(wave) WAVE_LEVELS_7(wave), WAVE_LEVEL(wave, 7)
+
+#if WAVE_TABLE_BITS == 6
+#define WAVE_TABLE_ENTRIES(wave, level) WAVE_ENTRIES_64(wave, level, 0)
+#define WAVE_MIP_ENTRIES(wave) WAVE_LEVELS_5(wave)
+#elif WAVE_TABLE_BITS == 7
+#define WAVE_TABLE_ENTRIES(wave, level) WAVE_ENTRIES_128(wave, level, 0)
+#define WAVE_MIP_ENTRIES(wave) WAVE_LEVELS_6(wave)
+#elif WAVE_TABLE_BITS == 8
+#define WAVE_TABLE_ENTRIES(wave, level) WAVE_ENTRIES_256(wave, level, 0)
+#define WAVE_MIP_ENTRIES(wave) WAVE_LEVELS_7(wave)
+#elif WAVE_TABLE_BITS == 9
+#define WAVE_TABLE_ENTRIES(wave, level) WAVE_ENTRIES_512(wave, level, 0)
+#define WAVE_MIP_ENTRIES(wave) WAVE_LEVELS_8(wave)
+#else
+#error "WAVE_TABLE_BITS must be 6 to 9"
+#endif
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//------------------------------------------------------------------------------------------------  Band limited mip levels  -------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// Each waveform is stored WAVE_MIP_LEVELS times, built by adding up its Fourier series. Level 0 has harmonics up to a quarter
+// of the table length (WAVE_TABLE_SIZE / 4; any closer to the table's own Nyquist and the images that linear interpolation leaves
+// fold back as aliases), and each level after has half as many, so each level is good for one octave higher than the one before. A note picks the lowest level whose top harmonic is still under Nyquist (waveMipLevel) when it starts, and
+// the sample path just reads a different table: aliasing is dealt with without any per sample cost
+#define WAVE_MIP_LEVELS (WAVE_TABLE_BITS - 1)              // down to 1 harmonic (a sine) at the last level, 7 levels * 4 waves * 256 bytes = 7KB of flash
+#define WAVE_BANDLIMIT_SCALE 0.8                            // square and sawtooth only: leaves room for their Gibbs overshoot, what's left over is clipped
+
+#define WAVE_SINE 0
+#define WAVE_TRIANGLE 1
+#define WAVE_SQUARE 2
+#define WAVE_SAWTOOTH 3
+
+constexpr uint16_t waveHarmonics (uint8_t level)           // highest harmonic kept at a mip level
+{
+  return (WAVE_TABLE_SIZE / 4) >> level;
+}
+
+// Each harmonic below is given sin(hx) and cos(hx) at table position x = 2pi * i / WAVE_TABLE_SIZE. harmonicSeries gets them
+// from the two harmonics before with the angle addition recurrence, so a table entry costs one sin and one cos however many
+// harmonics it adds up (calling compileTimeCos for every harmonic takes the compiler minutes)
 
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 //-----------------------------------------------------------------------------------------------------  SINE WAVE  ---------------------------------------------------------------------------------------------
@@ -130,79 +128,119 @@ uint8_t* wave_pointer = sineWave;                                           // C
 
 // sine wave formula y(t) = Asin(2piFt + p)  
 // A = amp, F = freq, t = time, p = phase
+// Phase p = 3pi/2 so the signal starts at 0 instead of 128, which would make a popping sound when a key is first pressed.
+// Asin(x + 3pi/2) = -Acos(x), a single harmonic so it is the same at every mip level
 
-void generateSine ()
+constexpr double sineHarmonic (uint16_t harmonic, double sine, double cosine)
 {
-  const float cyclesPerSample = ((float)INITIAL_WAVE_FREQ / (float)Fs);                                // Convert freq to cycles per sample as Frequency concerned with, instead of cycles per second (Hz) 
-
-  for (int i = 0; i < INITIAL_WAVE_TABLE_SIZE; i++)                                                         // Loop through all of waveform
-  {
-    sineWave[i] = round ( (255.0/2) * (1.0 + sin (2.0 * M_PI * cyclesPerSample * i + (3* M_PI) / 2)) );     // sinewave = Asin(2 * pi * freq * time + phase), with freq in cyclesPerSample
-                                                                                                            // 1.0 makes it people a 2 and low at 0 instead of 1 and -1, however it would make it start at 1 instead of 0
-                                                                                                            // To make it start at 0 phase is changed (3pi/2) added so the signal starts at 0 instead of 128, 
-                                                                                                            // which would make popping sound when key first pressed
-                                                                                                            // multiplying by 255/2 scales sinewave so it can peak at 255 instead of 2
-  }                                                                                                         // round function ensures number is integer (<0.5 round down >0.5 up)
+  return harmonic == 1 ? -cosine : 0.0;
 }
 
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------------  TRIANGLE WAVE  -------------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
-void generateTriangle ()
+constexpr double triangleHarmonic (uint16_t harmonic, double sine, double cosine)   // starts at the bottom, peaks halfway through the waveform then back down: odd harmonics falling off by 1/h^2
 {
-  const float incr = 255.0 / (INITIAL_WAVE_TABLE_SIZE / 2.0);       // the amount to increment or decrement for each sample /2 to come back down after reaching top value
-  const int decrPoint = ceil (INITIAL_WAVE_TABLE_SIZE / 2.0);       // This defines when to decrement instead of incrementing to achieve triangle waveform (/2 as its halfway through waveform at the peak of triangle wave)
-                                                                    // ceiling used as dont want to underflow the integer
-  triangleWave[0] = 0;                                              // Sets first value of tri to 0
-  
-  float tempIncr = 0;                                               // Temporary variable to keep track of the correct floating point value of triangleWave[i]
-  for (int i = 1; i < INITIAL_WAVE_TABLE_SIZE; i++)                 // Loop through whole wave
-  {
-    if (i <= decrPoint)                                             //If before halfway
-    {
-      tempIncr += incr;                                             //Increment 
-      triangleWave[i] = floor (tempIncr);                           //Set value to floating-point value representing the nearest whole number that is less than or equal to the value
-    }
-    else
-    {
-      tempIncr -= incr;                                             //decrement 
-      triangleWave[i] = floor (tempIncr);                           //Set value to floating-point value representing the nearest whole number that is less than or equal to the value
-    }
-  }
+  return harmonic % 2 ? -8.0 / (M_PI * M_PI) * cosine / ((double)harmonic * harmonic) : 0.0;
 }
 
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------------  SQUARE WAVE  ---------------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
-void generateSquare ()
+constexpr double squareHarmonic (uint16_t harmonic, double sine, double cosine)     // high for the first half of the waveform, low for the second: odd harmonics falling off by 1/h
 {
-  const int flipPoint = ceil(INITIAL_WAVE_TABLE_SIZE / 2.0);    // at this point in the samples, output low instead of high to achieve square waveform (Puts output in the centre)
-  
-  for (int i = 0; i < INITIAL_WAVE_TABLE_SIZE; i++)             //Loop from 0 to initial wavetable size
-  {
-    if (i < flipPoint)
-    {
-      squareWave[i] = 255;                                      // Before getting to flip point output 255 (highest amount for unsigned int possible)
-    }
-    else
-    {
-      squareWave[i] = 0;                                        // At flip point output low
-    }
-  }
+  return harmonic % 2 ? 4.0 / M_PI * sine / harmonic : 0.0;
 }
 
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------------  SAWTOOTH WAVE  -------------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
-void generateSawtooth ()                                  //Sawtooth is basically just a ramp
+constexpr double sawtoothHarmonic (uint16_t harmonic, double sine, double cosine)   //Sawtooth is basically just a ramp from the bottom to the top: every harmonic falling off by 1/h
+{
+  return -2.0 / M_PI * sine / harmonic;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------  Wave tables  -----------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+constexpr double harmonicTerm (uint8_t wave, uint16_t harmonic, double sine, double cosine)
 {
-  const float incr = (255.0 / INITIAL_WAVE_TABLE_SIZE);   //At end of iteration will reach 255
-  
-  for (int i = 0; i < INITIAL_WAVE_TABLE_SIZE; i++)       //Loop from 0 to initial wavetable size
+  return wave == WAVE_SINE ? sineHarmonic(harmonic, sine, cosine) : wave == WAVE_TRIANGLE ? triangleHarmonic(harmonic, sine, cosine) :
+         wave == WAVE_SQUARE ? squareHarmonic(harmonic, sine, cosine) : sawtoothHarmonic(harmonic, sine, cosine);
+}
+
+constexpr double harmonicSeries (uint8_t wave, uint16_t harmonic, uint16_t last, double twoCos,        // sum of harmonics harmonic..last of a waveform, twoCos is 2cos(x),
+                                 double sin1, double sin2, double cos1, double cos2)                 // sin1/cos1 and sin2/cos2 are harmonic - 1 and harmonic - 2
+{
+  return harmonic > last ? 0.0 :
+         harmonicTerm(wave, harmonic, twoCos * sin1 - sin2, twoCos * cos1 - cos2) +
+         harmonicSeries(wave, harmonic + 1, last, twoCos, twoCos * sin1 - sin2, sin1, twoCos * cos1 - cos2, cos1);
+}
+
+constexpr double waveSeries (uint8_t wave, uint16_t last, double sine, double cosine)   // sum of harmonics 1..last at an angle with this sin and cos
+{
+  return harmonicSeries(wave, 1, last, 2.0 * cosine, 0.0, -sine, 1.0, cosine);         // harmonic 0 is sin 0 = 0, cos 0 = 1, harmonic -1 is -sin, cos
+}
+
+constexpr uint8_t waveByte (double x)                      // -1..1 to 0..255, rounded and clipped
+{
+  return x <= -1.0 ? 0 : x >= 1.0 ? 255 : (uint8_t)(127.5 * (1.0 + x) + 0.5);
+}
+
+constexpr uint8_t waveSample (uint8_t wave, uint8_t level, uint16_t i)
+{
+  return waveByte((wave == WAVE_SQUARE || wave == WAVE_SAWTOOTH ? WAVE_BANDLIMIT_SCALE : 1.0) *
+                  waveSeries(wave, wave == WAVE_SINE ? 1 : waveHarmonics(level), compileTimeSin(2.0 * M_PI * i / WAVE_TABLE_SIZE), compileTimeCos(2.0 * M_PI * i / WAVE_TABLE_SIZE)));
+}
+
+const uint8_t waveTables[WAVE_COUNT][WAVE_MIP_LEVELS][WAVE_TABLE_SIZE] PROGMEM =   // every mip level of all 4 waveforms, read with pgm_read_byte
+{
+  { WAVE_MIP_ENTRIES(WAVE_SINE) },
+  { WAVE_MIP_ENTRIES(WAVE_TRIANGLE) },
+  { WAVE_MIP_ENTRIES(WAVE_SQUARE) },
+  { WAVE_MIP_ENTRIES(WAVE_SAWTOOTH) }
+};
+
+constexpr uint8_t mipLevel (uint8_t note, uint8_t level)   // lowest level from level on whose top harmonic stays under Nyquist for this note
+{
+  return level == WAVE_MIP_LEVELS - 1 || waveHarmonics(level) * noteFrequency(note) < Fs / 2.0 ? level : mipLevel(note, level + 1);
+}
+
+#define MIP_LEVEL_OCTAVE(n) \
+  mipLevel(n, 0),     mipLevel(n + 1, 0), mipLevel(n + 2, 0), mipLevel(n + 3, 0), mipLevel(n + 4, 0),  mipLevel(n + 5, 0),  \
+  mipLevel(n + 6, 0), mipLevel(n + 7, 0), mipLevel(n + 8, 0), mipLevel(n + 9, 0), mipLevel(n + 10, 0), mipLevel(n + 11, 0)
+
+const uint8_t waveMipLevel[128] PROGMEM =                   // mip level for every MIDI note value at this Fs, looked up when a note starts
+{
+  MIP_LEVEL_OCTAVE(0),  MIP_LEVEL_OCTAVE(12), MIP_LEVEL_OCTAVE(24), MIP_LEVEL_OCTAVE(36), MIP_LEVEL_OCTAVE(48),
+  MIP_LEVEL_OCTAVE(60), MIP_LEVEL_OCTAVE(72), MIP_LEVEL_OCTAVE(84), MIP_LEVEL_OCTAVE(96), MIP_LEVEL_OCTAVE(108),
+  mipLevel(120, 0), mipLevel(121, 0), mipLevel(122, 0), mipLevel(123, 0), mipLevel(124, 0), mipLevel(125, 0), mipLevel(126, 0), mipLevel(127, 0)
+};
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------  Morphing  --------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+// The oscillator crossfades between two neighbouring waveforms (sine -> triangle -> square -> sawtooth), waveMorphWeight of
+// the way from waveMorphTable to the next one. The SELECT_WAVE_PIN button jumps straight to each waveform, MIDI_CC_WAVE_MORPH
+// sweeps through all of them
+#define MIDI_CC_WAVE_MORPH 16                               // general purpose controller 1
+
+ENGINE_STATE uint8_t waveMorphTable = WAVE_SINE;            // first of the two waveforms being mixed
+ENGINE_STATE uint8_t waveMorphWeight = 0;                   // how far towards the next waveform, 0-255 (always 0 at WAVE_SAWTOOTH, the last)
+
+void waveSetMorph (uint8_t value)                           // MIDI controller value 0-127 over the 3 steps between the 4 waveforms
+{
+  const uint16_t morph = ((uint16_t)value * 3 * 256) / 127;
+  waveMorphTable = morph >> 8;
+  waveMorphWeight = morph;                                  // low byte
+  if (waveMorphTable >= WAVE_COUNT - 1)
   {
-    sawtoothWave[i] = incr * i;                           //Gives ramp characteristic
+    waveMorphTable = WAVE_COUNT - 1;
+    waveMorphWeight = 0;
   }
-}
+}
@@ -0,0 +1,185 @@
+// Sample playback from SPI flash. With SAMPLE_STREAMING a voice can play a recorded sample (drums, attack transients,
+// anything too long for the 32KB of program flash) instead of the wave tables: MIDI program change 1 to SAMPLE_SLOTS picks
+// a sample for the notes that follow and program 0 goes back to the oscillator, so voices already sounding keep what they
+// started with. The samples live in a serial flash on the DAC's SPI bus (PERIPHERALS.h) and each streaming voice keeps a
+// SAMPLE_RING_SIZE byte ring of what it is about to play. renderBlock() only ever reads the ring. The MCP4921 is selected
+// from one sample interrupt to the next (its word latches on the timer edge, when CS goes high), so the only time the bus
+// is free is inside the interrupt just after that latch: every sample interrupt picks the ring with the least left in it
+// and reads a SAMPLE_CHUNK into it between latching the DAC and sending it the next word (refillSampleStreams() in
+// 3SYNTH_ENGINE2.ino), renderBlock() or not, so the DAC stays on the timer edge and the rings keep filling while loop()
+// renders. A voice that runs dry holds its last value and
+// counts a sampleUnderrun instead of glitching the others, sent in the telemetry report.
+//
+// Flash image: SAMPLE_MAGIC at address 0, then the directory of SAMPLE_SLOTS {start, length} pairs (32 bit little endian,
+// length 0 is an empty slot), the sample data anywhere after it. Samples are unsigned 8 bit PCM recorded at SAMPLE_RATE_HZ
+// and play at their own pitch on SAMPLE_ROOT_NOTE; other notes, bend, vibrato and glide resample them (linear interpolation,
+// the step worked out from the voice's phase increment every control tick). Samples play once, when one ends its voice
+// goes into its release as if the key had been let go.
+//
+// Needs the flash's MISO, so GATE_OUT_PIN moves off PINB4 (3SYNTH_ENGINE2.ino). Off by default: boards without the flash don't need it.
+
+#ifndef SAMPLE_STREAMING
+#define SAMPLE_STREAMING 0
+#endif
+
+#define SAMPLE_SLOTS 8                                      // samples in the directory, program change 1 to 8
+#define SAMPLE_MAGIC 0x31504D53UL                           // "SMP1" in the first 4 bytes of the flash
+#define SAMPLE_DIRECTORY_ADDRESS 4
+#define SAMPLE_RATE_HZ 16000                                // rate the samples in the flash are recorded at, whatever Fs the build plays at
+#define SAMPLE_ROOT_NOTE MIDI_C4                            // note that plays a sample at the speed it was recorded
+#define SAMPLE_SILENCE 128                                  // unsigned 8 bit PCM midpoint
+
+#define SAMPLE_RING_SIZE 128                                // bytes read ahead per voice, must be a power of two and a multiple of SAMPLE_CHUNK
+#define SAMPLE_RING_MASK (SAMPLE_RING_SIZE - 1)
+#if F_CPU / Fs >= 800
+#define SAMPLE_CHUNK 16                                     // bytes per flash read, sized so a sample interrupt with one in it still ends well inside the sample period
+#else
+#define SAMPLE_CHUNK 8
+#endif
+static_assert((SAMPLE_RING_SIZE & SAMPLE_RING_MASK) == 0 && SAMPLE_RING_SIZE % SAMPLE_CHUNK == 0 && SAMPLE_RING_SIZE <= 256,
+              "SAMPLE_RING_SIZE must be a power of two multiple of SAMPLE_CHUNK no bigger than 256");
+
+// Flash reads. A byte at fosc/2 is 16 cycles plus the load, store and loop around it; a read is the command and address
+// then the data, all of it added to the sample interrupt it happens in
+#define SPI_EXCHANGE_CYCLES 22
+#define SAMPLE_CHUNK_CYCLES ((4 + SAMPLE_CHUNK) * SPI_EXCHANGE_CYCLES + 30)
+
+// Q16 playback step from a voice's phase increment: increment * SAMPLE_RATE_HZ / (2^16 * root frequency), as a 32x16
+// multiply by SAMPLE_STEP_SCALE and a shift. Capped so one block never reads further than a primed ring holds and the
+// flash reads keep up with VOICE_COUNT voices all playing that fast (both checked in 3SYNTH_ENGINE2.ino)
+#define SAMPLE_STEP_SHIFT 26
+#define SAMPLE_STEP_SCALE ((uint16_t)(SAMPLE_RATE_HZ * (double)(1UL << (SAMPLE_STEP_SHIFT - 16)) / equalTemperament(SAMPLE_ROOT_NOTE) + 0.5))
+#ifndef SAMPLE_STEP_MAX
+#define SAMPLE_STEP_MAX (3UL << 15)                         // one and a half times the recorded speed, 7 semitones over SAMPLE_ROOT_NOTE at 16kHz; higher notes play at that
+#endif
+static_assert(SAMPLE_RATE_HZ * (double)(1UL << (SAMPLE_STEP_SHIFT - 16)) / equalTemperament(SAMPLE_ROOT_NOTE) < 65535.5, "SAMPLE_STEP_SCALE has to fit 16 bits");
+
+#define STREAM_OFF 0                                        // the voice plays the wave tables
+#define STREAM_PRIMING 1                                    // filling the ring before the sample starts, the voice's envelope waits for it
+#define STREAM_PLAYING 2
+#define STREAM_DONE 3                                       // reached the end of the sample
+
+typedef struct sampleSlot                                   // one directory entry, as it is in the flash
+{
+  uint32_t start;                                           // flash address of the first byte
+  uint32_t length;                                          // bytes, 0 for an empty slot
+} SampleSlot;
+
+// The sample interrupt only reads a stream's state, fetched, played and complete, all 8 bits and so never half updated, and
+// only writes the ring, fetched, address, left, complete and the switch from priming to playing of one that is priming or
+// playing. sampleStreamStart() turns a stream off before it changes any of that
+typedef struct sampleStream                                 // a voice's read ahead of a sample, part of the Voice
+{
+  uint8_t ring[SAMPLE_RING_SIZE];
+  volatile uint8_t fetched = 0;                             // free running count of bytes read into the ring, fetched & SAMPLE_RING_MASK is where the next goes
+  uint8_t played = 0;                                       // free running count of bytes played past, the integer part of the play position
+  uint16_t fraction = 0;                                    // the fraction of it, 0-65535
+  uint32_t step = 0;                                        // Q16 position advanced per sample
+  uint32_t address = 0;                                     // flash address of the next byte to read
+  uint32_t left = 0;                                        // bytes of the sample still to read
+  volatile uint8_t complete = 0;                            // 1 once left is 0, the whole sample has been through the ring
+  uint8_t last = SAMPLE_SILENCE;                            // the last sample played, held while priming, after the end and through an underrun
+  volatile uint8_t state = STREAM_OFF;
+} SampleStream;
+
+ENGINE_STATE SampleSlot sampleDirectory[SAMPLE_SLOTS];      // read from the flash by sampleStreamInit(), all empty when there is no image
+ENGINE_STATE uint8_t sampleProgram = 0;                     // slot + 1 that notes from now on play, 0 for the wave tables
+ENGINE_STATE uint16_t sampleUnderruns = 0;                  // voice samples that found nothing to play in their ring
+
+void sampleStreamInit ()                                    // reads the directory, call from setup() before the sample interrupt is running
+{
+  uint32_t magic = 0;
+  SPIFLASH_INIT();
+  SPI_flashRead(0, (uint8_t*)&magic, sizeof(magic));
+  SPI_flashRead(SAMPLE_DIRECTORY_ADDRESS, (uint8_t*)sampleDirectory, sizeof(sampleDirectory));   // the AVR is little endian, so it goes straight in
+
+  for (uint8_t i = 0; i < SAMPLE_SLOTS; i++)
+  {
+    if (magic != SAMPLE_MAGIC || sampleDirectory[i].length == 0xFFFFFFFFUL)                       // no flash, or an erased one
+    {
+      sampleDirectory[i].length = 0;
+    }
+  }
+}
+
+void sampleSelect (uint8_t program)                         // program change: a slot with nothing in it is the wave tables
+{
+  sampleProgram = program >= 1 && program <= SAMPLE_SLOTS && sampleDirectory[program - 1].length ? program : 0;
+}
+
+void sampleStreamStart (SampleStream* stream, uint8_t slot)   // from the top of a sample, silent until the ring has been filled
+{
+  stream->state = STREAM_OFF;                               // the sample interrupt leaves it alone until it is priming again
+  __asm__ __volatile__ ("" ::: "memory");
+  stream->fetched = 0;
+  stream->played = 0;
+  stream->fraction = 0;
+  stream->address = sampleDirectory[slot].start;
+  stream->left = sampleDirectory[slot].length;
+  stream->complete = stream->left == 0;
+  stream->last = SAMPLE_SILENCE;
+  __asm__ __volatile__ ("" ::: "memory");                   // everything above is in place before the interrupt can see it
+  stream->state = STREAM_PRIMING;
+}
+
+static inline uint32_t sampleStreamStep (uint32_t increment)   // Q16 step for a phase increment, the same 32x16 multiply as modulationIncrement
+{
+  const uint32_t step = ((increment >> 16) * SAMPLE_STEP_SCALE + (((increment & 0xFFFF) * SAMPLE_STEP_SCALE) >> 16)) >> (SAMPLE_STEP_SHIFT - 16);
+  return step > SAMPLE_STEP_MAX ? SAMPLE_STEP_MAX : step;
+}
+
+static inline uint8_t sampleStreamWants (const SampleStream* stream)   // 1 if there is more to read and a whole chunk of room for it
+{
+  return (stream->state == STREAM_PRIMING || stream->state == STREAM_PLAYING) && !stream->complete &&
+         (uint8_t)(stream->fetched - stream->played) <= SAMPLE_RING_SIZE - SAMPLE_CHUNK;
+}
+
+void sampleStreamFetch (SampleStream* stream)              // reads the next chunk into the ring, only when the bus is free: in the sample interrupt, or with timer 1 stopped
+{
+  const uint8_t count = stream->left < SAMPLE_CHUNK ? stream->left : SAMPLE_CHUNK;   // chunks start on a multiple of SAMPLE_CHUNK, so one never wraps round the ring
+  SPI_flashRead(stream->address, &stream->ring[stream->fetched & SAMPLE_RING_MASK], count);
+  stream->fetched += count;
+  stream->address += count;
+  stream->left -= count;
+  stream->complete = stream->left == 0;
+
+  if (stream->state == STREAM_PRIMING && !sampleStreamWants(stream))   // full, or the whole sample is in: it can start
+  {
+    stream->state = STREAM_PLAYING;
+  }
+}
+
+static inline uint8_t sampleStreamNext (SampleStream* stream)   // the voice's next sample, called by renderBlock() in place of the wave table lookup
+{
+  if (stream->state == STREAM_PLAYING)
+  {
+    const uint8_t complete = stream->complete;              // before fetched: a read landing in between only makes the sample look less complete than it is
+    const uint8_t played = stream->played;
+    const uint8_t buffered = stream->fetched - played;      // never 0 while playing, played stays short of fetched
+    if (buffered >= 2)                                      // the two bytes either side of the play position
+    {
+      const int16_t a = stream->ring[played & SAMPLE_RING_MASK];
+      stream->last = a + (((stream->ring[(played + 1) & SAMPLE_RING_MASK] - a) * (stream->fraction >> 8)) >> 8);
+    } else if (buffered)                                    // the last byte of the sample, or the last one read so far
+    {
+      stream->last = stream->ring[played & SAMPLE_RING_MASK];
+    }
+
+    const uint32_t position = (uint32_t)stream->fraction + stream->step;
+    const uint8_t advance = position >> 16;                 // at most the fraction plus SAMPLE_STEP_MAX, a few bytes
+    if (advance + 1 < buffered || (complete && advance < buffered))   // lands on a byte that has been read, with the one after it unless the sample ends there
+    {
+      stream->fraction = position;
+      stream->played = played + advance;
+    } else if (complete)
+    {
+      stream->state = STREAM_DONE;
+    } else if (buffered)                                    // the reads didn't keep up, wait on the last byte there is
+    {
+      stream->fraction = 0;
+      stream->played = played + buffered - 1;
+      sampleUnderruns++;
+    }
+  }
+  return stream->last;
+}
@@ -1,6 +1,21 @@
+// channel voice message types (top 4 bits of the status byte)
 #define MIDI_NOTE_OFF 0b1000            //key unpressed 
 #define MIDI_NOTE_ON 0b1001             //key pressed 
-#define MIDI_EVENT_BUFFER_SIZE 10       //Buffersize for circular buffer
+#define MIDI_POLY_PRESSURE 0b1010       //aftertouch for one key
+#define MIDI_CONTROL_CHANGE 0b1011      //knobs, sliders, pedals (CC number, value)
+#define MIDI_PROGRAM_CHANGE 0b1100      //patch select, 1 data byte
+#define MIDI_CHANNEL_PRESSURE 0b1101    //aftertouch for the whole channel, 1 data byte
+#define MIDI_PITCH_BEND 0b1110          //14 bit bend, LSB then MSB
+
+// system messages
+#define MIDI_SYSEX_START 0xF0           //system exclusive, any number of data bytes up to MIDI_SYSEX_END
+#define MIDI_SYSEX_END 0xF7
+#define MIDI_SYSEX_ID 0x7D             //non-commercial manufacturer ID, used for this synth's telemetry requests (F0 7D <command> F7) and reports
+#define MIDI_REALTIME_FIRST 0xF8        //0xF8-0xFF are single byte realtime messages (clock, start, stop, active sensing...) which can arrive in the middle of any other message
+
+#define MIDI_EVENT_BUFFER_SIZE 16       //Buffersize for circular buffer, must be a power of two so indexes wrap with a mask instead of %
+#define MIDI_EVENT_BUFFER_MASK (MIDI_EVENT_BUFFER_SIZE - 1)
+static_assert((MIDI_EVENT_BUFFER_SIZE & MIDI_EVENT_BUFFER_MASK) == 0 && MIDI_EVENT_BUFFER_SIZE <= 128, "MIDI_EVENT_BUFFER_SIZE must be a power of two no bigger than 128");
 
 // midi note values Integer value corresponds to a MIDI note e.g Note C0 = 0 Db0 = 1 etc.
 #define MIDI_C0 0
@@ -112,45 +127,269 @@
 #define MIDI_Bb8 106
 #define MIDI_B8 107
 
-volatile typedef struct midiEvent {     // Midi Event struct used for note on and note off messages
+volatile typedef struct midiEvent {     // Midi Event struct used for channel voice messages
   uint8_t statusByte;                   // 1 byte for status
-  uint8_t dataByte[2];                  // 2 bytes for data
+  uint8_t dataByte[2];                  // 2 bytes for data (dataByte[1] is 0 for program change and channel pressure)
 } MidiEvent;
 
-MidiEvent midiEventBuffer[MIDI_EVENT_BUFFER_SIZE];      // a buffer to store MidiEvents for main loop to process
-uint8_t midiReadIndex = 0;                              // used by main loop to keep track of the current position the MIDI event is getting written to in circular buffer
-volatile uint8_t midiWriteIndex = 0;                    // used by usart interrupt to keep track of current write, when midiReadIndex = midiWriteIndex then all data in buffer has been processed
-volatile uint8_t midiWritingFlag = 255;                 // Determines if writing data bytes to MIDI event. If 255 then not currently writing data bytes, if 0 then writing dataByte 1, if 1 then writing dataByte 2
+// Single producer (USART RX interrupt) / single consumer (main loop) ring buffer. Both indexes count up forever and are
+// masked when used, so (midiWriteIndex - midiReadIndex) is the number of unread events, from 0 up to and including
+// MIDI_EVENT_BUFFER_SIZE. Only the interrupt writes midiWriteIndex and only loop() writes midiReadIndex, each after it has
+// finished with the slot, so neither side ever needs to disable interrupts
+ENGINE_STATE MidiEvent midiEventBuffer[MIDI_EVENT_BUFFER_SIZE]; // a buffer to store MidiEvents for main loop to process in place
+ENGINE_STATE volatile uint8_t midiReadIndex = 0;        // advanced by main loop once it has processed an event, when midiReadIndex = midiWriteIndex then all data in buffer has been processed
+ENGINE_STATE volatile uint8_t midiWriteIndex = 0;       // advanced by usart interrupt once an event is complete in the buffer
+
+ENGINE_STATE volatile uint16_t midiDroppedEvents = 0;   // complete events thrown away because main loop let the buffer fill up
+ENGINE_STATE volatile uint16_t midiParseErrors = 0;     // data bytes with no status to apply them to, messages cut short by a new status byte, undefined status bytes
+
+// parser state, only touched by the usart interrupt
+ENGINE_STATE uint8_t midiRunningStatus = 0;             // status byte of the channel voice message being received, kept for running status. 0 when there is none
+ENGINE_STATE uint8_t midiDataExpected = 0;              // data bytes a midiRunningStatus message has
+ENGINE_STATE uint8_t midiDataCount = 0;                 // data bytes of the current message received so far
+ENGINE_STATE uint8_t midiDataFirst = 0;                 // first data byte, held until the message is complete
+ENGINE_STATE uint8_t midiSystemBytesLeft = 0;           // data bytes of a system common message still to skip
+ENGINE_STATE uint8_t midiInSysEx = 0;                   // 1 while skipping system exclusive data
+ENGINE_STATE uint8_t midiSysExLength = 0;               // data bytes of the current sysex so far (stops counting at 255)
+ENGINE_STATE uint8_t midiSysExData[2];                  // first two sysex data bytes, enough to recognise a telemetry request
+
+ENGINE_STATE volatile uint8_t telemetryCommand = 0;     // command byte of the last F0 MIDI_SYSEX_ID <command> F7 received, cleared by loop() once handled
+
+// MIDI THRU. Channel voice messages are forwarded whole once they are complete, so loop() can merge its own messages into
+// the output without splitting one in half, and realtime bytes are forwarded straight away as they are allowed anywhere.
+// SysEx and system common bytes are forwarded as they arrive, and merging waits until they are finished
+#define MIDI_THRU_CHANNEL_VOICE 0x01
+#define MIDI_THRU_REALTIME 0x02
+#define MIDI_THRU_SYSEX 0x04
+#define MIDI_THRU_SYSTEM_COMMON 0x08
+#define MIDI_THRU_ALL 0x0F
+
+ENGINE_STATE volatile uint8_t midiThruFilter = MIDI_THRU_ALL; // which kinds of message are echoed to MIDI OUT
+ENGINE_STATE volatile uint16_t midiThruChannels = 0xFFFF; // bit n set forwards channel voice messages on channel n + 1 (change with interrupts disabled, it is 16 bits)
+ENGINE_STATE uint8_t midiThruPassing = 0;               // 1 while a sysex or system common message is part way through being forwarded
+ENGINE_STATE uint8_t midiThruForwarding = 0;            // 1 if the sysex or system common message being received is echoed, decided once at its status byte
+ENGINE_STATE uint8_t midiTxRunningStatus = 0;           // last channel voice status byte sent, so repeats can use running status
+ENGINE_STATE volatile uint8_t midiTxSysExOpen = 0;      // 1 while loop() is sending its own sysex (telemetry), nothing else may go out until it ends
+
+// Channel voice messages received while loop() has its own sysex open wait here until it ends. loop() queues a whole piece of
+// the report at a time (3SYNTH_ENGINE2.ino), so the sysex is only open for a pass of loop() and a few hold enough
+#define MIDI_THRU_HOLD_SIZE 4
+ENGINE_STATE MidiEvent midiThruHold[MIDI_THRU_HOLD_SIZE];
+ENGINE_STATE uint8_t midiThruHeld = 0;                  // messages waiting in midiThruHold, only changed with interrupts disabled
+ENGINE_STATE volatile uint16_t midiThruDropped = 0;     // channel voice messages not forwarded because midiThruHold was full
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//------------------------------------------------------------------------------------------  Sending MIDI data  -----------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+static inline uint8_t midiQueueMessage (uint8_t status, uint8_t data1, uint8_t data2)   // interrupts must be disabled. Queues a whole channel voice message or nothing
+{
+  const uint8_t length = ((status >> 4) == MIDI_PROGRAM_CHANGE || (status >> 4) == MIDI_CHANNEL_PRESSURE) ? 2 : 3;
+
+  if (midiThruPassing || midiTxSysExOpen || USART_TxFree() < length)
+  {
+    return 0;
+  }
+
+  if (status != midiTxRunningStatus)
+  {
+    USART_QueueByte(status);
+    midiTxRunningStatus = status;
+  }
+  USART_QueueByte(data1);
+  if (length == 3)
+  {
+    USART_QueueByte(data2);
+  }
+  return 1;
+}
+
+uint8_t midiSendMessage (uint8_t status, uint8_t data1, uint8_t data2)  // merges a channel voice message into MIDI OUT from loop(). Returns 0 if it couldn't be queued yet (try again later)
+{
+  uint8_t sreg = SREG;
+  cli();
+  const uint8_t queued = midiQueueMessage(status, data1, data2);
+  SREG = sreg;
+  return queued;
+}
+
+static inline void midiThruMessage (uint8_t status, uint8_t data1, uint8_t data2)   // forward a complete channel voice message, or hold it while loop()'s sysex is open
+{
+  if (midiTxSysExOpen)
+  {
+    if (midiThruHeld == MIDI_THRU_HOLD_SIZE)
+    {
+      midiThruDropped++;
+      return;
+    }
+    MidiEvent* held = &midiThruHold[midiThruHeld++];
+    held->statusByte = status;
+    held->dataByte[0] = data1;
+    held->dataByte[1] = data2;
+  } else if (!midiQueueMessage(status, data1, data2))
+  {
+    usartTxOverflows++;                                                 // no room for the whole message
+  }
+}
+
+void midiThruRelease ()                                                 // interrupts must be disabled. Sends what was held once loop()'s sysex has ended
+{
+  for (uint8_t i = 0; i < midiThruHeld; i++)
+  {
+    if (!midiQueueMessage(midiThruHold[i].statusByte, midiThruHold[i].dataByte[0], midiThruHold[i].dataByte[1]))
+    {
+      usartTxOverflows++;
+    }
+  }
+  midiThruHeld = 0;
+}
+
+static inline void midiThruStart (uint8_t kind)                        // at a sysex or system common status byte: the whole message is forwarded or none of it,
+{                                                                       // so a report starting or ending part way through can't leave half a message on MIDI OUT
+  midiThruForwarding = (midiThruFilter & kind) && !midiTxSysExOpen;
+}
+
+static inline void midiThruByte (uint8_t data)                          // forward a sysex or system common byte as it arrives
+{
+  if (midiThruForwarding)
+  {
+    midiTxRunningStatus = 0;                                            // a system message in between cancels running status on the output too
+    USART_QueueByte(data);
+  }
+}
 
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 //--------------------------------------------------------------------------------------  Receiving MIDI data Interrupt  ----------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
-// interrupt service routine fired each time USART MIDI data is recieved
-ISR (USART_RX_vect) 
+static inline void midiPushEvent (uint8_t data)                                 // running status message complete, publish it to main loop
 {
-  uint8_t data = UDR0;                                                          //Gets incoming data out of USART Data Reg 
-  uint8_t midiMessageType = (data >> 4);                                        //Tells if note on or note off by bitshifting data by 4
+  const uint8_t writeIndex = midiWriteIndex;
 
-  //Setting up logic:
-  if ( midiMessageType == MIDI_NOTE_ON || midiMessageType == MIDI_NOTE_OFF )   // if we recieve a midi note on message or a midi note off message, begin writing to the midi buffer
+  if ((uint8_t)(writeIndex - midiReadIndex) == MIDI_EVENT_BUFFER_SIZE)          // buffer full, the slot at writeIndex is still waiting to be read
   {
-    midiEventBuffer[midiWriteIndex].statusByte = data;                         // write the status byte to the current midi write index
-    midiWritingFlag = 0;                                                       // set the writing flag to 0 as data after this will be first writing data bytes
-  } else if ( midiWritingFlag < 1 )                                            // Only concerned with 2 data bytes, if accepting messages of different lengths this value would be determined dynamically in the previous block
+    midiDroppedEvents++;
+    return;
+  }
+
+  MidiEvent* event = &midiEventBuffer[writeIndex & MIDI_EVENT_BUFFER_MASK];
+  event->statusByte = midiRunningStatus;
+  event->dataByte[0] = midiDataExpected == 1 ? data : midiDataFirst;
+  event->dataByte[1] = midiDataExpected == 1 ? 0 : data;
+  midiWriteIndex = writeIndex + 1;                                              // only now can main loop see the event
+}
+
+static inline void midiReceiveByte (uint8_t data)                              // runs the parser and MIDI THRU for one received byte
+{
+  if (data >= MIDI_REALTIME_FIRST)                                              // realtime bytes are complete messages on their own and leave the message they interrupt untouched
   {
-    midiEventBuffer[midiWriteIndex].dataByte[midiWritingFlag] = data;          // write first data bytes to current midi write index
-    midiWritingFlag++;                                                         // increment the midi writing flag in order to write the next data byte
-  } else if ( midiWritingFlag < 255 )
+    if (midiThruFilter & MIDI_THRU_REALTIME)
+    {
+      USART_QueueByte(data);                                                    // echo midi data
+    }
+    return;
+  }
+
+  if (data & 0x80)                                                              // status byte
   {
-    midiEventBuffer[midiWriteIndex].dataByte[midiWritingFlag] = data;          // write second data byte to current midi write index
+    if (midiDataCount != 0 || midiSystemBytesLeft != 0)                         // the previous message was not finished
+    {
+      midiParseErrors++;
+    }
+    midiDataCount = 0;
+    midiSystemBytesLeft = 0;
+    midiThruPassing = 0;
 
-    uint8_t currentStatusByte = midiEventBuffer[midiWriteIndex].statusByte;    // get current status byte
-    midiWriteIndex = (midiWriteIndex + 1) % MIDI_EVENT_BUFFER_SIZE;            // Get next midi write index. Increment midi write index since a midi event is complete, modulo operator to wrap around for circular buffer when midiwriteindex=9 next is 0
-    
-    midiEventBuffer[midiWriteIndex].statusByte = currentStatusByte;            // write the next midi event's status byte in case of running status
-    midiWritingFlag = 0;                                                       // set the writing flag to begin writing data bytes in case of running status 
+    if (data < MIDI_SYSEX_START)                                                // channel voice message, program change and channel pressure have 1 data byte, the rest 2
+    {
+      midiRunningStatus = data;
+      midiDataExpected = ((data >> 4) == MIDI_PROGRAM_CHANGE || (data >> 4) == MIDI_CHANNEL_PRESSURE) ? 1 : 2;
+      midiInSysEx = 0;
+    } else                                                                      // system common and sysex messages cancel running status
+    {
+      midiRunningStatus = 0;
+      if (data == MIDI_SYSEX_START)
+      {
+        midiInSysEx = 1;
+        midiSysExLength = 0;
+        midiThruStart(MIDI_THRU_SYSEX);
+        midiThruPassing = midiThruForwarding;
+        midiThruByte(data);
+      } else if (data == MIDI_SYSEX_END)
+      {
+        if (!midiInSysEx)
+        {
+          midiParseErrors++;
+        } else
+        {
+          midiThruByte(data);
+          if (midiSysExLength == 2 && midiSysExData[0] == MIDI_SYSEX_ID)       // F0 7D <command> F7 is a request for this synth
+          {
+            telemetryCommand = midiSysExData[1];
+          }
+        }
+        midiInSysEx = 0;
+      } else
+      {
+        midiInSysEx = 0;
+        switch (data)
+        {
+          case 0xF1 :                                                           // MTC quarter frame
+          case 0xF3 :                                                           // song select
+            midiSystemBytesLeft = 1;
+            break;
+          case 0xF2 :                                                           // song position pointer
+            midiSystemBytesLeft = 2;
+            break;
+          case 0xF6 :                                                           // tune request
+            break;
+          default :                                                             // 0xF4 and 0xF5 are undefined
+            midiParseErrors++;
+            return;
+        }
+        midiThruStart(MIDI_THRU_SYSTEM_COMMON);
+        midiThruPassing = midiThruForwarding && midiSystemBytesLeft != 0;
+        midiThruByte(data);
+      }
+    }
+  } else if (midiInSysEx)                                                       // sysex data is skipped, apart from the start of it
+  {
+    if (midiSysExLength < 2)
+    {
+      midiSysExData[midiSysExLength] = data;
+    }
+    if (midiSysExLength != 255)
+    {
+      midiSysExLength++;
+    }
+    midiThruByte(data);
+  } else if (midiSystemBytesLeft)                                               // system common data is skipped
+  {
+    midiSystemBytesLeft--;
+    midiThruPassing = midiThruForwarding && midiSystemBytesLeft != 0;
+    midiThruByte(data);
+  } else if (!midiRunningStatus)                                                // data byte with nothing to belong to
+  {
+    midiParseErrors++;
+  } else if (++midiDataCount < midiDataExpected)                                // first of two data bytes
+  {
+    midiDataFirst = data;
+  } else                                                                        // last data byte, the next data byte starts a new message with the same status (running status)
+  {
+    midiPushEvent(data);
+    midiDataCount = 0;
+
+    if ((midiThruFilter & MIDI_THRU_CHANNEL_VOICE) && (midiThruChannels & (1U << (midiRunningStatus & 0x0F))))   // echo midi data
+    {
+      midiThruMessage(midiRunningStatus, midiDataExpected == 1 ? data : midiDataFirst, data);
+    }
   }
+}
 
-  USART_Transmit (data);  // echo midi data
-}
+// interrupt service routine fired each time USART MIDI data is recieved
+ISR (USART_RX_vect) 
+{
+  PROFILE_START(midiRx);
+  midiReceiveByte(UDR0);                                                        //Gets incoming data out of USART Data Reg 
+  PROFILE_END(PROFILE_MIDI_RX_ISR, midiRx);
+}
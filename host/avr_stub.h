@@ -0,0 +1,129 @@
+// Host-side stand-in for the bits of <avr/io.h>, <avr/interrupt.h> and the Arduino core that the
+// synth engine uses. Registers are plain globals so the engine sources compile unchanged on Linux;
+// the two data registers (UDR0 and SPDR) are small objects so the harness can feed MIDI bytes in
+// and capture the words written to the MCP4921. Registers and the engine's ENGINE_STATE globals are
+// thread_local: every thread that calls host_engine_begin() gets a chip of its own.
+
+#pragma once
+
+#include <stdint.h>
+#include <math.h>
+#include <string.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000UL                                    // ATmega328p on the Arduino Uno runs at 16MHz
+#endif
+
+#define ENGINE_STATE thread_local                           // the firmware's mutable globals, one set per thread
+
+#define ISR(vector) void vector (void)                      // interrupt handlers become plain functions the harness calls
+
+inline void cli () {}
+inline void sei () {}
+
+void host_cpu_sleep ();                                     // POWER.h sleeps the CPU, the harness skips loop() until the next interrupt
+#define POWER_SLEEP() host_cpu_sleep()
+void host_flash_deselect ();                                // the sample flash's chip select going high ends a read, which the SPI model can't see from the bytes alone
+#define FLASH_DESELECT() host_flash_deselect()
+
+uint32_t host_profile_timestamp ();                         // PROFILER.h probes use std::chrono on the host, in nanoseconds
+#define PROFILE_TIMESTAMP() host_profile_timestamp()
+#define FREE_RAM() 0                                        // there is no AVR heap and stack to measure on the host
+
+#define PROGMEM                                             // flash and SRAM share one address space on the host
+#define pgm_read_byte(address) (*(const uint8_t*)(address))
+#define pgm_read_word(address) (*(const uint16_t*)(address))
+#define pgm_read_dword(address) (*(const uint32_t*)(address))
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------  Register bit names  ----------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+#define PINB0 0
+#define PINB1 1
+#define PINB2 2
+#define PINB3 3
+#define PINB4 4
+#define PINB5 5
+#define PINB6 6
+#define PINB7 7
+#define PIND7 7
+
+#define TOIE0 0                 // TIMSK0
+
+#define CS10 0                  // TCCR1B
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define OCIE1A 1                // TIMSK1
+#define OCF1A 1                 // TIFR1
+
+#define UDRE0 5                 // UCSR0A
+#define RXC0 7
+#define RXCIE0 7                // UCSR0B
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ01 2                // UCSR0C
+#define UCSZ00 1
+
+#define SPIE 7                  // SPCR
+#define SPE 6
+#define MSTR 4
+#define SPR1 1
+#define SPR0 0
+#define SPIF 7                  // SPSR
+#define SPI2X 0
+
+#define PCIE0 0                 // PCICR
+#define PCINT1 1                // PCMSK0
+#define ADEN 7                  // ADCSRA
+#define SE 0                    // SMCR
+#define SM0 1
+#define SM1 2
+#define SM2 3
+#define PRTWI 7                 // PRR
+#define PRTIM2 6
+#define PRTIM0 5
+#define PRTIM1 3
+#define PRSPI 2
+#define PRUSART0 1
+#define PRADC 0
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------  Data register hooks  ---------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+void host_spi_write (uint8_t data);                         // implemented by the harness, called for every byte the engine shifts out over SPI
+void host_usart_write (uint8_t data);                       // implemented by the harness, called for every byte the engine transmits over USART (MIDI THRU)
+
+struct HostSpiDataRegister                                  // SPDR: writes start a transfer, reads return the last byte clocked in
+{
+  uint8_t received = 0;
+  HostSpiDataRegister& operator= (uint8_t data) { host_spi_write(data); return *this; }
+  operator uint8_t () const { return received; }
+};
+
+struct HostUsartDataRegister                                // UDR0: reads return the byte the harness is delivering, writes go out on TX
+{
+  uint8_t received = 0;
+  HostUsartDataRegister& operator= (uint8_t data) { host_usart_write(data); return *this; }
+  operator uint8_t () const { return received; }
+};
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------  Registers  -------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+extern thread_local volatile uint8_t SREG;
+extern thread_local volatile uint8_t DDRB, PORTB, PINB;
+extern thread_local volatile uint8_t DDRD, PORTD;
+extern thread_local volatile uint8_t TIMSK0;
+extern thread_local volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern thread_local volatile uint16_t TCNT1, OCR1A;
+extern thread_local volatile uint8_t UBRR0H, UBRR0L, UCSR0A, UCSR0B, UCSR0C;
+extern thread_local volatile uint8_t SPCR, SPSR;
+extern thread_local volatile uint8_t PCICR, PCMSK0, ADCSRA, SMCR, PRR;
+extern thread_local HostUsartDataRegister UDR0;
+extern thread_local HostSpiDataRegister SPDR;
@@ -0,0 +1,539 @@
+// Compiles the firmware sketch for the host. Everything the sketch and its headers define ends up
+// in this translation unit; the rest of the host tools only talk to it through host_engine.h.
+// Besides the chip, it models the parts on its SPI bus: the MCP4921 and the sample flash (SAMPLE_STREAM.h), whose contents
+// are an image file mapped by host_engine_open_flash().
+
+#include "avr_stub.h"
+#include "host_engine.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------  Registers  -------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+thread_local volatile uint8_t SREG;                             // like the firmware's globals, one set of registers per thread
+thread_local volatile uint8_t DDRB, PORTB, PINB;
+thread_local volatile uint8_t DDRD, PORTD;
+thread_local volatile uint8_t TIMSK0;
+thread_local volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+thread_local volatile uint16_t TCNT1, OCR1A;
+thread_local volatile uint8_t UBRR0H, UBRR0L, UCSR0A, UCSR0B, UCSR0C;
+thread_local volatile uint8_t SPCR, SPSR;
+thread_local volatile uint8_t PCICR, PCMSK0, ADCSRA, SMCR, PRR;
+thread_local HostUsartDataRegister UDR0;
+thread_local HostSpiDataRegister SPDR;
+
+// Firmware settings the build overrides that change what comes out, other than Fs and VOICE_COUNT (see
+// host_engine_config_tag); noted before the sketch defines its defaults
+#ifdef FILTER_ENABLED
+#define HOST_TAG_FILTER_ENABLED
+#endif
+#ifdef POWER_IDLE
+#define HOST_TAG_POWER_IDLE
+#endif
+#ifdef CONTROL_SAMPLES
+#define HOST_TAG_CONTROL_SAMPLES
+#endif
+#ifdef RENDER_BLOCK_SIZE
+#define HOST_TAG_RENDER_BLOCK_SIZE
+#endif
+#ifdef WAVE_TABLE_BITS
+#define HOST_TAG_WAVE_TABLE_BITS
+#endif
+#ifdef VOICE_STEAL_MODE
+#define HOST_TAG_VOICE_STEAL_MODE
+#endif
+#ifdef SAMPLE_STREAMING
+#define HOST_TAG_SAMPLE_STREAMING
+#endif
+
+#include "../Final code proj324/3SYNTH_ENGINE2.ino"          // after the registers, so the sketch sees them defined and reaches the thread's copy directly
+
+static thread_local HostEngineCounters counters;
+static thread_local uint16_t dac_word = 0;                      // last word latched by the DAC
+static thread_local uint8_t dac_byte_count = 0;                 // bytes received since CS went low
+static thread_local uint8_t dac_high_byte = 0;
+static thread_local std::vector<uint8_t>* midi_out_capture = nullptr;
+static thread_local double usart_tx_credit_us = 0.0;            // line time available to the USART transmitter
+static thread_local uint32_t unrendered_events = 0;             // events loop() has processed that no rendered block has yet
+static thread_local uint32_t block_events[2] = {0, 0};          // events first heard in each of the two sample blocks
+static thread_local uint8_t cpu_asleep = 0;                     // loop() put the CPU to sleep and no interrupt has woken it yet
+static thread_local const uint8_t* flash_image = nullptr;       // the mapped image file, nullptr for an erased flash
+static thread_local size_t flash_size = 0;
+static thread_local uint8_t flash_byte_count = 0;               // bytes received since the flash's CS went low, up to the end of the address
+static thread_local uint8_t flash_command = 0;
+static thread_local uint32_t flash_address = 0;
+
+#define USART_BYTE_US 320.0                                     // 10 bits at 31250 baud
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------  Peripheral models  -----------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+static void flash_spi_byte (uint8_t data)                      // a byte shifted with the sample flash selected
+{
+  if (flash_byte_count == 0)
+  {
+    flash_command = data;
+    flash_address = 0;
+    flash_byte_count = 1;
+    counters.flash_reads += data == FLASH_READ_DATA;
+  } else if (flash_byte_count < 4)                              // 24 bit address, most significant byte first
+  {
+    flash_address = (flash_address << 8) | data;
+    flash_byte_count++;
+  } else if (flash_command == FLASH_READ_DATA)                  // a data byte comes back for every byte sent, the address counting on
+  {
+    SPDR.received = flash_address < flash_size ? flash_image[flash_address] : 0xFF;
+    flash_address = (flash_address + 1) & 0xFFFFFF;
+    counters.flash_bytes++;
+  }
+}
+
+void host_flash_deselect ()
+{
+  PORTB |= (1 << FLASH_CS_PIN);
+  flash_byte_count = 0;
+}
+
+void host_spi_write (uint8_t data)
+{
+  counters.spi_bytes++;
+
+  const bool flash_selected = (DDRB & (1 << FLASH_CS_PIN)) && !(PORTB & (1 << FLASH_CS_PIN));   // only once SPIFLASH_INIT has made the pin an output
+  if (flash_selected)
+  {
+    flash_spi_byte(data);
+    if (!(PORTB & (1 << PINB2)))
+    {
+      counters.bus_conflicts++;
+    }
+  }
+
+  if (PORTB & (1 << PINB2))                                     // MCP4921 chip select is high so the DAC ignores the byte
+  {
+    dac_byte_count = 0;
+    return;
+  }
+
+  if (dac_byte_count == 0)                                      // first byte carries the config bits and data bits 11-8
+  {
+    dac_high_byte = data;
+    dac_byte_count = 1;
+  }
+  else                                                          // second byte carries data bits 7-0, the word is latched
+  {
+    dac_word = ((dac_high_byte & 0x0F) << 8) | data;
+    dac_byte_count = 0;
+    counters.dac_words++;
+  }
+}
+
+void host_usart_write (uint8_t data)
+{
+  counters.midi_bytes_out++;
+  if (midi_out_capture)
+  {
+    midi_out_capture->push_back(data);
+  }
+}
+
+void host_cpu_sleep ()
+{
+  counters.cpu_sleeps++;
+  cpu_asleep = 1;
+}
+
+static void interrupt_taken ()                                  // any interrupt ends a sleep
+{
+  cpu_asleep = 0;
+}
+
+uint32_t host_profile_timestamp ()
+{
+  return (uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------  Driver  --------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+void host_engine_begin ()
+{
+  DDRB = PORTB = PINB = 0;
+  DDRD = PORTD = 0;
+  TIMSK0 = (1 << TOIE0);                                        // the Arduino core's millis() interrupt, on before setup()
+  TCCR1A = TCCR1B = TIMSK1 = TIFR1 = 0;
+  TCNT1 = OCR1A = 0;
+  UBRR0H = UBRR0L = UCSR0B = UCSR0C = 0;
+  UCSR0A = (1 << UDRE0);                                        // transmit register is always empty, USART_Transmit never spins
+  SPCR = 0;
+  SPSR = (1 << SPIF);                                           // every SPI transfer completes immediately
+  PCICR = PCMSK0 = SMCR = PRR = 0;
+  ADCSRA = (1 << ADEN);                                         // the Arduino core's init() turns the ADC on
+  UDR0.received = 0;
+  SPDR.received = 0;
+
+  for (Voice& voice : voices)                                   // the chip starts from zeroed RAM on reset, the host has to put the sketch's globals back itself
+  {
+    voice = Voice();
+  }
+  keys = Keyboard();
+  modulation = Modulation();
+#if FILTER_ENABLED
+  filter = SvfFilter();
+#endif
+  voiceClock = 0;
+  blockReady[0] = blockReady[1] = 0;
+  playingBlock = 0;
+  playingIndex = 0;
+  renderingBlock = 0;
+  bufferUnderruns = 0;
+  midiReadIndex = 0;
+  midiWriteIndex = 0;
+  midiDroppedEvents = 0;
+  midiParseErrors = 0;
+  midiRunningStatus = 0;
+  midiDataExpected = 0;
+  midiDataCount = 0;
+  midiDataFirst = 0;
+  midiSystemBytesLeft = 0;
+  midiInSysEx = 0;
+  usartTxHead = usartTxTail = 0;
+  usartTxHighWater = 0;
+  usartTxOverflows = 0;
+  midiThruFilter = MIDI_THRU_ALL;
+  midiThruChannels = 0xFFFF;
+  midiThruPassing = 0;
+  midiThruForwarding = 0;
+  midiTxRunningStatus = 0;
+  midiTxSysExOpen = 0;
+  midiThruHeld = 0;
+  midiThruDropped = 0;
+  midiSysExLength = 0;
+  midiSysExData[0] = midiSysExData[1] = 0;
+  telemetryCommand = 0;
+  telemetryNextField = TELEMETRY_IDLE;
+  telemetryPieceEnd = 0;
+#if PROFILING
+  profileSamplePeriods = 0;
+  memset(profileStats, 0, sizeof(profileStats));
+#endif
+  currentWaveIsSelected = 0;
+  currentWaveLocation = 0;
+  waveButtonPresses = 0;
+  waveButtonHandled = 0;
+  powerIdle = 0;
+  dacSelected = 0;
+  powerSettledBlocks = 0;
+  powerSettledWord = 0;
+  waveMorphTable = WAVE_SINE;
+  waveMorphWeight = 0;
+  memset(sampleDirectory, 0, sizeof(sampleDirectory));
+  sampleProgram = 0;
+  sampleUnderruns = 0;
+
+  counters = HostEngineCounters();
+  dac_word = 0;
+  dac_byte_count = 0;
+  usart_tx_credit_us = USART_BYTE_US;
+  unrendered_events = 0;
+  block_events[0] = block_events[1] = 0;
+  cpu_asleep = 0;
+  flash_byte_count = 0;
+
+  setup();
+}
+
+static void run_loop ()                                         // one pass of loop() unless the CPU is asleep, following MIDI events through to the block they are first heard in
+{
+  if (cpu_asleep)
+  {
+    return;
+  }
+  const uint8_t read = midiReadIndex;
+  const uint8_t rendering = renderingBlock;
+  counters.loop_passes++;
+  loop();
+
+  const uint8_t processed = midiReadIndex - read;
+  counters.midi_events_processed += processed;
+  unrendered_events += processed;
+  if (renderingBlock != rendering)                              // a block was rendered after the events were processed
+  {
+    counters.blocks_rendered++;
+    block_events[rendering] += unrendered_events;
+    unrendered_events = 0;
+#if SAMPLE_STREAMING
+    for (uint8_t i = 0; i < VOICE_COUNT; i++)
+    {
+      const SampleStream& stream = voices[i].stream;
+      counters.ring_overruns += stream.state == STREAM_PLAYING && (uint8_t)(stream.fetched - stream.played) > SAMPLE_RING_SIZE;
+    }
+#endif
+  }
+}
+
+void host_engine_midi_byte (uint8_t data)
+{
+  const uint8_t written = midiWriteIndex;
+  counters.midi_bytes_in++;
+  UDR0.received = data;
+  interrupt_taken();
+  USART_RX_vect();
+  counters.midi_events_received += (uint8_t)(midiWriteIndex - written);
+}
+
+void host_engine_loop ()
+{
+  run_loop();
+}
+
+uint16_t host_engine_sample ()
+{
+  counters.samples++;
+  if (!(TIMSK1 & (1 << OCIE1A)))                                // POWER.h has stopped timer 1, the DAC holds its word
+  {
+    counters.idle_samples++;
+  } else
+  {
+    if (playingIndex == 0 && blockReady[playingBlock])          // this sample starts a block, its events are audible from here on
+    {
+      counters.midi_events_audible += block_events[playingBlock];
+      block_events[playingBlock] = 0;
+    }
+    counters.sample_interrupts++;
+    interrupt_taken();
+    TIMER1_COMPA_vect();
+  }
+
+  usart_tx_credit_us += 1000000.0 / Fs;                         // the transmitter sends a queued byte every USART_BYTE_US while UDRIE0 is set
+  while ((UCSR0B & (1 << UDRIE0)) && usart_tx_credit_us >= USART_BYTE_US)
+  {
+    usart_tx_credit_us -= USART_BYTE_US;
+    interrupt_taken();
+    USART_UDRE_vect();
+  }
+  if (!(UCSR0B & (1 << UDRIE0)) && usart_tx_credit_us > USART_BYTE_US)
+  {
+    usart_tx_credit_us = USART_BYTE_US;                         // an idle line can start the next byte straight away, but not bank time
+  }
+
+  return dac_word;
+}
+
+uint16_t host_engine_tick ()
+{
+  run_loop();
+  return host_engine_sample();
+}
+
+static void set_wave_button (uint8_t pressed)                  // drives SELECT_WAVE_PIN, firing the pin change interrupt if setup() enabled it
+{
+  PINB = pressed ? PINB | (1 << SELECT_WAVE_PIN) : PINB & ~(1 << SELECT_WAVE_PIN);
+  if ((PCICR & (1 << PCIE0)) && (PCMSK0 & (1 << SELECT_WAVE_PIN)))
+  {
+    interrupt_taken();
+    PCINT0_vect();
+  }
+}
+
+void host_engine_press_wave_button ()
+{
+  set_wave_button(1);
+  run_loop();
+  set_wave_button(0);
+  run_loop();
+}
+
+void host_engine_capture_midi_out (std::vector<uint8_t>* bytes)
+{
+  midi_out_capture = bytes;
+}
+
+bool host_engine_open_flash (const char* path)
+{
+  host_engine_close_flash();
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    return false;
+  }
+  struct stat status;
+  void* mapped = MAP_FAILED;
+  if (fstat(fd, &status) == 0 && status.st_size > 0)
+  {
+    mapped = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);     // pages are shared between threads mapping the same file
+  }
+  close(fd);
+  if (mapped == MAP_FAILED)
+  {
+    return false;
+  }
+  flash_image = (const uint8_t*)mapped;
+  flash_size = status.st_size;
+  return true;
+}
+
+void host_engine_close_flash ()
+{
+  if (flash_image)
+  {
+    munmap((void*)flash_image, flash_size);
+  }
+  flash_image = nullptr;
+  flash_size = 0;
+}
+
+uint16_t host_engine_sample_rate ()
+{
+  return Fs;
+}
+
+uint8_t host_engine_voice_count ()
+{
+  return VOICE_COUNT;
+}
+
+const char* host_engine_config_tag ()
+{
+  static const std::string tag = std::string()
+#ifdef HOST_TAG_FILTER_ENABLED
+    + "-filter" + std::to_string(FILTER_ENABLED)
+#endif
+#ifdef HOST_TAG_POWER_IDLE
+    + "-idle" + std::to_string(POWER_IDLE)
+#endif
+#ifdef HOST_TAG_CONTROL_SAMPLES
+    + "-control" + std::to_string(CONTROL_SAMPLES)
+#endif
+#ifdef HOST_TAG_RENDER_BLOCK_SIZE
+    + "-block" + std::to_string(RENDER_BLOCK_SIZE)
+#endif
+#ifdef HOST_TAG_WAVE_TABLE_BITS
+    + "-table" + std::to_string(WAVE_TABLE_BITS)
+#endif
+#ifdef HOST_TAG_VOICE_STEAL_MODE
+    + "-steal" + std::to_string(VOICE_STEAL_MODE)
+#endif
+#ifdef HOST_TAG_SAMPLE_STREAMING
+    + "-streaming" + std::to_string(SAMPLE_STREAMING)
+#endif
+    ;
+  return tag.c_str();
+}
+
+uint16_t host_engine_filter_cycle_estimate ()
+{
+  return FILTER_ENABLED * FILTER_CYCLES;
+}
+
+void host_engine_filter_block (const uint16_t* in, uint16_t* out, uint8_t count)
+{
+#if FILTER_ENABLED
+  filterBlock(in, out, count);
+#else
+  memcpy(out, in, count * sizeof(uint16_t));
+#endif
+}
+
+uint16_t host_engine_isr_cycle_estimate ()
+{
+  return ISR_CYCLES;
+}
+
+uint16_t host_engine_render_cycle_estimate ()
+{
+  return SAMPLE_CYCLES - ISR_CYCLES;
+}
+
+uint16_t host_engine_control_cycle_estimate ()
+{
+  return CONTROL_CYCLES;
+}
+
+uint32_t host_engine_wake_cycle_estimate ()
+{
+  return POWER_WAKE_CYCLES;
+}
+
+uint64_t host_engine_awake_cycle_estimate ()
+{
+  return counters.sample_interrupts * ISR_CYCLES + counters.blocks_rendered * RENDER_BLOCK_SIZE * (SAMPLE_CYCLES - ISR_CYCLES) +
+         counters.midi_events_processed * WAKE_MIDI_CYCLES + counters.loop_passes * LOOP_PASS_CYCLES + counters.flash_reads * SAMPLE_CHUNK_CYCLES;
+}
+
+uint8_t host_engine_control_samples ()
+{
+  return CONTROL_SAMPLES;
+}
+
+void host_engine_control_tick ()
+{
+  controlTick();
+}
+
+uint16_t host_engine_underruns ()
+{
+  return bufferUnderruns;
+}
+
+uint8_t host_engine_sample_streaming ()
+{
+  return SAMPLE_STREAMING;
+}
+
+uint16_t host_engine_sample_underruns ()
+{
+  return sampleUnderruns;
+}
+
+uint16_t host_engine_sample_rate_hz ()
+{
+  return SAMPLE_RATE_HZ;
+}
+
+uint8_t host_engine_sample_root_note ()
+{
+  return SAMPLE_ROOT_NOTE;
+}
+
+double host_engine_sample_step_max ()
+{
+  return SAMPLE_STEP_MAX / 65536.0;
+}
+
+double host_engine_note_frequency (uint8_t note)
+{
+  return (double)pgm_read_dword(&phaseIncrementTable[note & 0x7F]) * Fs / PHASE_CYCLE;
+}
+
+HostTelemetryLayout host_engine_telemetry_layout ()
+{
+  HostTelemetryLayout layout;
+  layout.version = TELEMETRY_VERSION;
+  layout.counters = TELEMETRY_COUNTERS;
+  layout.probes = PROFILE_PROBES;
+  layout.probe_fields = TELEMETRY_PROBE_FIELDS;
+  layout.buckets = PROFILE_BUCKETS;
+  layout.fields = TELEMETRY_FIELDS;
+  layout.header_bytes = TELEMETRY_HEADER_BYTES;
+  layout.field_bytes = TELEMETRY_FIELD_BYTES;
+  return layout;
+}
+
+const HostEngineCounters& host_engine_counters ()
+{
+  counters.midi_dropped_events = midiDroppedEvents;
+  counters.midi_parse_errors = midiParseErrors;
+  counters.usart_tx_high_water = usartTxHighWater;
+  counters.usart_tx_overflows = usartTxOverflows;
+  counters.midi_thru_dropped = midiThruDropped;
+  return counters;
+}
@@ -0,0 +1,85 @@
+// Host-side driver for the synth engine. The firmware sources are compiled unchanged into
+// host_engine.cpp against avr_stub.h; these functions play the role of the hardware around them:
+// they deliver bytes to the USART RX interrupt, call loop() the way the Arduino core does, fire
+// the Timer1 compare interrupt once per sample and collect the words written to the DAC.
+//
+// The firmware's state and the registers are thread_local (ENGINE_STATE, avr_stub.h), so every thread has an engine of
+// its own: these functions always work on the calling thread's, and any number of threads can render side by side.
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+struct HostEngineCounters
+{
+  uint64_t samples = 0;                 // Timer1 compare interrupts fired
+  uint64_t dac_words = 0;               // complete 16 bit words clocked into the MCP4921
+  uint64_t spi_bytes = 0;               // every byte shifted out on SPI, DAC or otherwise
+  uint64_t midi_bytes_in = 0;           // bytes delivered to USART_RX_vect
+  uint64_t midi_bytes_out = 0;          // bytes the engine wrote to UDR0 (MIDI THRU)
+  uint64_t midi_events_received = 0;    // complete messages the USART RX parser put in the MIDI event buffer
+  uint64_t midi_events_processed = 0;   // ... that loop() has taken out and acted on
+  uint64_t midi_events_audible = 0;     // ... whose first rendered block the sample interrupt has started playing
+  uint64_t sample_interrupts = 0;       // samples where timer 1 was running and its interrupt fired
+  uint64_t idle_samples = 0;            // samples where POWER.h had stopped timer 1
+  uint64_t blocks_rendered = 0;
+  uint64_t loop_passes = 0;             // loop() passes, one per interrupt that woke the CPU (at most one per sample)
+  uint64_t cpu_sleeps = 0;              // times loop() put the CPU to sleep
+  uint64_t flash_reads = 0;             // read commands sent to the sample flash (SAMPLE_STREAM.h)
+  uint64_t flash_bytes = 0;             // data bytes read back from it
+  uint64_t bus_conflicts = 0;           // SPI bytes shifted with the DAC and the flash both selected
+  uint64_t ring_overruns = 0;           // voices found after a block had played past the bytes read into their ring
+  uint16_t midi_dropped_events = 0;     // midiDroppedEvents: events lost to a full MIDI event buffer
+  uint16_t midi_parse_errors = 0;       // midiParseErrors
+  uint8_t usart_tx_high_water = 0;      // usartTxHighWater: deepest the MIDI OUT queue has been
+  uint16_t usart_tx_overflows = 0;      // usartTxOverflows
+  uint16_t midi_thru_dropped = 0;       // midiThruDropped: channel voice messages that didn't fit in the hold while a telemetry piece was open
+};
+
+struct HostTelemetryLayout             // how the engine lays out its SysEx telemetry report (3SYNTH_ENGINE2.ino), for decoding it
+{
+  uint8_t version = 0;                  // TELEMETRY_VERSION
+  uint8_t counters = 0;                 // TELEMETRY_COUNTERS: fields before the first probe
+  uint8_t probes = 0;                   // PROFILE_PROBES
+  uint8_t probe_fields = 0;             // TELEMETRY_PROBE_FIELDS: count, total, min, max, then the buckets
+  uint8_t buckets = 0;                  // PROFILE_BUCKETS
+  uint8_t fields = 0;                   // TELEMETRY_FIELDS: the whole report
+  uint8_t header_bytes = 0;             // TELEMETRY_HEADER_BYTES: F0 to the first field number of a piece
+  uint8_t field_bytes = 0;              // TELEMETRY_FIELD_BYTES: each field's 7 bit groups
+};
+
+void host_engine_begin ();                              // resets the stubbed registers and runs setup()
+void host_engine_midi_byte (uint8_t data);              // places data in UDR0 and fires USART_RX_vect
+void host_engine_loop ();                               // one pass of loop()
+uint16_t host_engine_sample ();                         // fires TIMER1_COMPA_vect and returns the 12 bit word left on the DAC
+uint16_t host_engine_tick ();                           // one sample period of the chip: a loop() pass, then the sample interrupt
+void host_engine_press_wave_button ();                  // presses and releases the SELECT_WAVE_PIN button across two loop() passes
+
+void host_engine_capture_midi_out (std::vector<uint8_t>* bytes);   // appends every byte sent on MIDI OUT to bytes, nullptr stops
+
+bool host_engine_open_flash (const char* path);         // maps an image file read only as the contents of this thread's sample flash, false if it can't be.
+                                                        // setup() reads the directory, so open it before host_engine_begin(); it stays across begins like the chip would
+void host_engine_close_flash ();                        // back to an erased flash, every byte 0xFF
+
+uint16_t host_engine_sample_rate ();                    // Fs the engine was compiled with
+uint8_t host_engine_voice_count ();                     // VOICE_COUNT the engine was compiled with
+const char* host_engine_config_tag ();                  // the other settings the build overrides that change the output, "-filter0" and the like, "" for none
+uint16_t host_engine_isr_cycle_estimate ();             // the firmware's own hand counted AVR cycle estimate for the sample interrupt
+uint16_t host_engine_render_cycle_estimate ();          // ... for rendering one sample of every voice in loop(), control tick and filter included
+uint16_t host_engine_control_cycle_estimate ();         // ... and for one control tick (the LFO, then every voice's envelope, glide, gain and phase increment)
+uint32_t host_engine_wake_cycle_estimate ();            // POWER_WAKE_CYCLES: from a note on ending idle to its first sample out of the DAC
+uint64_t host_engine_awake_cycle_estimate ();           // AVR cycles the CPU has been awake since host_engine_begin(), from the counters and the firmware's estimates
+uint8_t host_engine_control_samples ();                 // CONTROL_SAMPLES: samples per control tick
+void host_engine_control_tick ();                       // runs controlTick() on its own, for timing it
+uint16_t host_engine_filter_cycle_estimate ();          // FILTER_CYCLES, 0 when the build has no filter
+void host_engine_filter_block (const uint16_t* in, uint16_t* out, uint8_t count);   // runs filterBlock() on its own with the current filter settings
+uint16_t host_engine_underruns ();                      // bufferUnderruns: samples the interrupt found no rendered block
+uint8_t host_engine_sample_streaming ();                // SAMPLE_STREAMING the engine was compiled with
+uint16_t host_engine_sample_underruns ();               // sampleUnderruns: voice samples a streaming voice found its ring empty
+uint16_t host_engine_sample_rate_hz ();                 // SAMPLE_RATE_HZ, the rate samples in the flash are recorded at
+uint8_t host_engine_sample_root_note ();                // SAMPLE_ROOT_NOTE, the note that plays them at that rate
+double host_engine_sample_step_max ();                 // SAMPLE_STEP_MAX, the fastest a voice plays through a sample, in samples per sample period
+double host_engine_note_frequency (uint8_t note);       // frequency in Hz the engine's tuning table plays for a MIDI note value
+HostTelemetryLayout host_engine_telemetry_layout ();    // the report layout the engine was compiled with
+const HostEngineCounters& host_engine_counters ();
@@ -0,0 +1,76 @@
+#include "host_render.h"
+#include "host_engine.h"
+
+#include <chrono>
+
+void MidiWire::deliver_until (uint64_t now_us)
+{
+  while (next < bytes.size())
+  {
+    const uint64_t start = bytes[next].time_us > line_free_us ? bytes[next].time_us : line_free_us;
+    if (start + MIDI_BYTE_US > now_us)
+    {
+      return;
+    }
+    line_free_us = start + MIDI_BYTE_US;
+    host_engine_midi_byte(bytes[next].data);
+    next++;
+  }
+}
+
+uint64_t MidiWire::last_byte_us () const
+{
+  uint64_t free_us = line_free_us;
+  for (size_t i = next; i < bytes.size(); i++)
+  {
+    const uint64_t start = bytes[i].time_us > free_us ? bytes[i].time_us : free_us;
+    free_us = start + MIDI_BYTE_US;
+  }
+  return free_us;
+}
+
+RenderResult render_midi (const std::vector<TimedMidiByte>& bytes, const RenderOptions& options, WavWriter* wav,
+                          std::vector<uint16_t>* dac_words)
+{
+  host_engine_begin();
+  for (uint8_t i = 0; i < options.wave; i++)
+  {
+    host_engine_press_wave_button();
+  }
+
+  MidiWire wire(bytes);
+  const uint64_t fs = host_engine_sample_rate();
+  const uint64_t total = (wire.last_byte_us() * fs) / 1000000 + (uint64_t)(options.tail_seconds * fs);
+
+  RenderResult result;
+  if (dac_words)
+  {
+    dac_words->clear();
+    dac_words->reserve(total);
+  }
+  const auto start = std::chrono::steady_clock::now();
+
+  for (uint64_t n = 0; n < total; n++)
+  {
+    const uint64_t now_us = (n * 1000000) / fs;
+    wire.deliver_until(now_us);
+    bool stalled = false;
+    for (const LoopStall& stall : options.stalls)
+    {
+      stalled = stalled || (now_us >= stall.time_us && now_us < stall.time_us + stall.length_us);
+    }
+    const uint16_t word = stalled ? host_engine_sample() : host_engine_tick();
+    if (wav)
+    {
+      wav->write_dac_word(word);
+    }
+    if (dac_words)
+    {
+      dac_words->push_back(word);
+    }
+  }
+
+  result.samples = total;
+  result.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
@@ -0,0 +1,45 @@
+// Offline rendering on top of host_engine.h: MIDI bytes are delivered at the 31.25 kbaud wire rate,
+// loop() runs between samples as it would on the chip, and every DAC word is handed to a WavWriter and/or kept in memory.
+
+#pragma once
+
+#include "midi_input.h"
+#include "wav_writer.h"
+
+#include <stdint.h>
+#include <vector>
+
+#define MIDI_BYTE_US 320                        // 10 bits (start + 8 data + stop) at 31250 baud
+
+class MidiWire                                  // paces a list of timestamped bytes onto the USART RX interrupt, the list may grow between calls
+{
+public:
+  explicit MidiWire (const std::vector<TimedMidiByte>& bytes) : bytes(bytes) {}
+
+  void deliver_until (uint64_t now_us);         // fires USART_RX_vect for every byte fully received by now_us
+  bool done () const { return next == bytes.size(); }
+  size_t delivered () const { return next; }    // bytes fired so far, bytes[delivered() - 1] the latest
+  void forget (size_t count) { next -= count; }  // the owner has erased the first count delivered bytes from the list
+  uint64_t last_byte_us () const;               // time the final byte finishes arriving
+
+private:
+  const std::vector<TimedMidiByte>& bytes;
+  size_t next = 0;
+  uint64_t line_free_us = 0;                    // when the previous byte's stop bit ends
+};
+
+struct RenderOptions
+{
+  uint8_t wave = 0;                             // SELECT_WAVE_PIN presses before the first sample: 0 sine, 1 tri, 2 square, 3 saw
+  double tail_seconds = 1.0;                    // keep rendering this long after the last MIDI byte
+  std::vector<LoopStall> stalls;                // stretches with no loop() pass, only the interrupts (midi_input.h)
+};
+
+struct RenderResult
+{
+  uint64_t samples = 0;
+  double wall_seconds = 0.0;
+};
+
+RenderResult render_midi (const std::vector<TimedMidiByte>& bytes, const RenderOptions& options, WavWriter* wav,
+                          std::vector<uint16_t>* dac_words = nullptr);    // dac_words, when given, gets every 12 bit word in order
@@ -0,0 +1,355 @@
+#include "midi_input.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <sstream>
+
+static bool read_file (const std::string& path, std::vector<uint8_t>& contents)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+  {
+    return false;
+  }
+
+  uint8_t chunk[4096];
+  size_t count;
+  while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0)
+  {
+    contents.insert(contents.end(), chunk, chunk + count);
+  }
+  fclose(file);
+  return true;
+}
+
+static bool has_extension (const std::string& path, const char* extension)
+{
+  const std::string ext(extension);
+  if (path.size() < ext.size())
+  {
+    return false;
+  }
+  std::string tail = path.substr(path.size() - ext.size());
+  std::transform(tail.begin(), tail.end(), tail.begin(), ::tolower);
+  return tail == ext;
+}
+
+bool load_midi_input (const std::string& path, std::vector<TimedMidiByte>& bytes, std::string& error, MidiScriptExtras* extras)
+{
+  std::vector<uint8_t> contents;
+  if (!read_file(path, contents))
+  {
+    error = "cannot read " + path;
+    return false;
+  }
+
+  if (has_extension(path, ".mid") || has_extension(path, ".midi"))
+  {
+    return parse_standard_midi_file(contents, bytes, error);
+  }
+  if (has_extension(path, ".txt"))
+  {
+    return parse_midi_script(std::string(contents.begin(), contents.end()), bytes, error, extras);
+  }
+
+  for (uint8_t data : contents)
+  {
+    bytes.push_back({0, data});
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------------------  Scripts  ------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+bool parse_midi_script (const std::string& text, std::vector<TimedMidiByte>& bytes, std::string& error, MidiScriptExtras* extras)
+{
+  std::istringstream lines(text);
+  std::string line;
+  int line_number = 0;
+  MidiScriptExtras skipped;                                       // what the extras lines say when the caller doesn't want them
+  extras = extras ? extras : &skipped;
+
+  while (std::getline(lines, line))
+  {
+    line_number++;
+    const size_t comment = line.find('#');
+    if (comment != std::string::npos)
+    {
+      line.erase(comment);
+    }
+
+    std::istringstream fields(line);
+    std::string field;
+    if (!(fields >> field))
+    {
+      continue;                                                   // blank or comment-only line
+    }
+
+    char* end = nullptr;
+    if (field == "expect-dropped")
+    {
+      if (!(fields >> extras->expect_dropped) || extras->expect_dropped < 0)
+      {
+        error = "line " + std::to_string(line_number) + ": expect-dropped needs a count";
+        return false;
+      }
+      continue;
+    }
+    const double time_ms = strtod(field.c_str(), &end);
+    if (*end != '\0' || time_ms < 0)
+    {
+      error = "line " + std::to_string(line_number) + ": bad time '" + field + "'";
+      return false;
+    }
+
+    std::streampos rest = fields.tellg();
+    if (fields >> field && field == "stall")
+    {
+      double length_ms = 0.0;
+      if (!(fields >> length_ms) || length_ms <= 0)
+      {
+        error = "line " + std::to_string(line_number) + ": stall needs a length in ms";
+        return false;
+      }
+      extras->stalls.push_back({(uint64_t)(time_ms * 1000.0 + 0.5), (uint32_t)(length_ms * 1000.0 + 0.5)});
+      continue;
+    }
+    fields.clear();
+    fields.seekg(rest);
+
+    while (fields >> field)
+    {
+      const unsigned long value = strtoul(field.c_str(), &end, 16);
+      if (*end != '\0' || value > 0xFF)
+      {
+        error = "line " + std::to_string(line_number) + ": bad byte '" + field + "'";
+        return false;
+      }
+      bytes.push_back({(uint64_t)(time_ms * 1000.0 + 0.5), (uint8_t)value});
+    }
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------  Standard MIDI Files  ---------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+namespace
+{
+  struct SmfEvent
+  {
+    uint64_t tick;
+    uint32_t order;                         // keeps events with equal ticks in file order
+    uint32_t tempo;                         // microseconds per quarter note, 0 if this is not a tempo change
+    std::vector<uint8_t> data;
+  };
+
+  struct SmfReader
+  {
+    const std::vector<uint8_t>& file;
+    size_t pos;
+    size_t end;
+
+    bool ok (size_t count) const { return pos + count <= end; }
+    uint8_t u8 () { return file[pos++]; }
+    uint32_t u32 () { uint32_t v = 0; for (int i = 0; i < 4; i++) v = (v << 8) | file[pos++]; return v; }
+    uint16_t u16 () { uint16_t v = file[pos] << 8 | file[pos + 1]; pos += 2; return v; }
+
+    bool vlq (uint32_t& value)
+    {
+      value = 0;
+      for (int i = 0; i < 4; i++)
+      {
+        if (!ok(1))
+        {
+          return false;
+        }
+        const uint8_t b = u8();
+        value = (value << 7) | (b & 0x7F);
+        if (!(b & 0x80))
+        {
+          return true;
+        }
+      }
+      return false;
+    }
+  };
+
+  uint8_t channel_message_length (uint8_t status)               // data bytes that follow a channel voice status byte
+  {
+    const uint8_t type = status >> 4;
+    return (type == 0xC || type == 0xD) ? 1 : 2;
+  }
+}
+
+static bool parse_track (SmfReader& track, uint32_t& order, std::vector<SmfEvent>& events, std::string& error)
+{
+  uint64_t tick = 0;
+  uint8_t running_status = 0;
+
+  while (track.pos < track.end)
+  {
+    uint32_t delta;
+    if (!track.vlq(delta) || !track.ok(1))
+    {
+      error = "truncated track";
+      return false;
+    }
+    tick += delta;
+
+    uint8_t status = track.file[track.pos];
+    if (status & 0x80)
+    {
+      track.pos++;
+    }
+    else if (running_status)
+    {
+      status = running_status;
+    }
+    else
+    {
+      error = "data byte without status";
+      return false;
+    }
+
+    SmfEvent event {tick, order++, 0, {}};
+
+    if (status == 0xFF)                                                 // meta event
+    {
+      running_status = 0;                                               // meta events and sysex both cancel running status (SMF 1.0)
+      if (!track.ok(1))
+      {
+        error = "truncated meta event";
+        return false;
+      }
+      const uint8_t type = track.u8();
+      uint32_t length;
+      if (!track.vlq(length) || !track.ok(length))
+      {
+        error = "truncated meta event";
+        return false;
+      }
+      if (type == 0x51 && length == 3)
+      {
+        event.tempo = track.file[track.pos] << 16 | track.file[track.pos + 1] << 8 | track.file[track.pos + 2];
+        events.push_back(event);
+      }
+      track.pos += length;
+      if (type == 0x2F)
+      {
+        break;                                                          // end of track
+      }
+    }
+    else if (status == 0xF0 || status == 0xF7)                          // sysex, or an escaped sequence of raw bytes
+    {
+      running_status = 0;
+      uint32_t length;
+      if (!track.vlq(length) || !track.ok(length))
+      {
+        error = "truncated sysex";
+        return false;
+      }
+      if (status == 0xF0)
+      {
+        event.data.push_back(0xF0);
+      }
+      event.data.insert(event.data.end(), track.file.begin() + track.pos, track.file.begin() + track.pos + length);
+      track.pos += length;
+      events.push_back(event);
+    }
+    else
+    {
+      const uint8_t length = channel_message_length(status);
+      if (!track.ok(length))
+      {
+        error = "truncated channel message";
+        return false;
+      }
+      event.data.push_back(status);
+      for (uint8_t i = 0; i < length; i++)
+      {
+        event.data.push_back(track.u8());
+      }
+      events.push_back(event);
+      running_status = status;
+    }
+  }
+  return true;
+}
+
+bool parse_standard_midi_file (const std::vector<uint8_t>& file, std::vector<TimedMidiByte>& bytes, std::string& error)
+{
+  SmfReader reader {file, 0, file.size()};
+
+  if (!reader.ok(14) || std::string(file.begin(), file.begin() + 4) != "MThd")
+  {
+    error = "not a Standard MIDI File";
+    return false;
+  }
+  reader.pos = 4;
+  const uint32_t header_length = reader.u32();
+  reader.u16();                                                         // format, 0 and 1 are handled the same way
+  const uint16_t track_count = reader.u16();
+  const uint16_t division = reader.u16();
+  if (division & 0x8000)
+  {
+    error = "SMPTE time division is not supported";
+    return false;
+  }
+  if (division == 0)
+  {
+    error = "time division of 0 ticks per quarter note";
+    return false;
+  }
+  reader.pos = 8 + header_length;
+
+  std::vector<SmfEvent> events;
+  uint32_t order = 0;
+  for (uint16_t t = 0; t < track_count && reader.ok(8); t++)
+  {
+    const bool is_track = std::string(file.begin() + reader.pos, file.begin() + reader.pos + 4) == "MTrk";
+    reader.pos += 4;
+    const uint32_t length = reader.u32();
+    if (!reader.ok(length))
+    {
+      error = "truncated file";
+      return false;
+    }
+    if (is_track)
+    {
+      SmfReader track {file, reader.pos, reader.pos + length};
+      if (!parse_track(track, order, events, error))
+      {
+        return false;
+      }
+    }
+    reader.pos += length;
+  }
+
+  std::sort(events.begin(), events.end(), [] (const SmfEvent& a, const SmfEvent& b)
+  {
+    return a.tick != b.tick ? a.tick < b.tick : a.order < b.order;
+  });
+
+  uint32_t tempo = 500000;                                              // 120 bpm until told otherwise
+  uint64_t last_tick = 0;
+  double time_us = 0.0;
+  for (const SmfEvent& event : events)
+  {
+    time_us += (double)(event.tick - last_tick) * tempo / division;
+    last_tick = event.tick;
+    if (event.tempo)
+    {
+      tempo = event.tempo;
+    }
+    for (uint8_t data : event.data)
+    {
+      bytes.push_back({(uint64_t)(time_us + 0.5), data});
+    }
+  }
+  return true;
+}
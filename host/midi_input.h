@@ -0,0 +1,39 @@
+// Loads MIDI input for the host tools as a list of timestamped raw bytes. The bytes are exactly what
+// would arrive on the synth's MIDI IN, so they go through the firmware's own USART_RX_vect parser.
+//
+// Supported inputs, picked by file extension:
+//   .mid / .midi   Standard MIDI File, format 0 or 1 (tracks are merged, tempo changes honoured)
+//   .txt           script, one message per line: "<time in ms> <hex byte> <hex byte> ...", '#' starts a comment
+//   anything else  raw byte stream, all bytes queued at time 0
+//
+// Scripts can also hold lines for synth_test that aren't bytes on the wire (MidiScriptExtras), other tools skip them:
+//   <time in ms> stall <ms>    loop() doesn't run for that long, as if the chip were held up; the interrupts still do
+//   expect-dropped <n>         the parser has to have dropped n events by the end (midiDroppedEvents)
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+struct TimedMidiByte
+{
+  uint64_t time_us;                     // earliest time the byte may start on the wire, 64 bits so a live stream never wraps
+  uint8_t data;
+};
+
+struct LoopStall
+{
+  uint64_t time_us;
+  uint32_t length_us;
+};
+
+struct MidiScriptExtras
+{
+  std::vector<LoopStall> stalls;
+  int expect_dropped = -1;              // -1 when the script doesn't say
+};
+
+bool load_midi_input (const std::string& path, std::vector<TimedMidiByte>& bytes, std::string& error, MidiScriptExtras* extras = nullptr);
+bool parse_midi_script (const std::string& text, std::vector<TimedMidiByte>& bytes, std::string& error, MidiScriptExtras* extras = nullptr);
+bool parse_standard_midi_file (const std::vector<uint8_t>& file, std::vector<TimedMidiByte>& bytes, std::string& error);
@@ -0,0 +1,215 @@
+// Batch renderer: many renders of the synth engine in parallel, one engine per worker thread.
+//
+//   synth_batch [--threads n] [--out dir] [--wave 0-3] [--tail seconds] <input>...
+//       Renders every MIDI input (see midi_input.h for formats) to <out>/<name>.wav, creating out if need be.
+//   synth_batch --grid lo-hi [--waves 0,1,2,3] [--velocities 127] [--length seconds] [--threads n] [--out dir] [--tail seconds]
+//       Renders one note on / note off for every note from lo to hi, waveform and velocity to <out>/nNNN_wW_vVVV.wav.
+//
+// Jobs are spread over a work stealing pool (work_pool.h), 0 threads (the default) is one per core. WAVs are streamed
+// to disk as they render, so no render is ever held in memory whole. At the end the aggregate and per thread
+// throughput is reported.
+
+#include "host_engine.h"
+#include "host_render.h"
+#include "midi_input.h"
+#include "wav_writer.h"
+#include "work_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define BATCH_DEFAULT_LENGTH 1.0                // seconds a grid note is held
+#define BATCH_GRID_CHANNEL 0
+
+struct BatchJob
+{
+  std::string output;                           // WAV path
+  std::vector<TimedMidiByte> bytes;
+  uint8_t wave = 0;
+};
+
+struct alignas(64) WorkerStats                  // only ever written by its own worker, on a cache line of its own
+{
+  size_t jobs = 0;
+  uint64_t samples = 0;
+  double render_seconds = 0.0;
+};
+
+static void usage ()
+{
+  fprintf(stderr, "usage: synth_batch [--threads n] [--out dir] [--wave 0-3] [--tail seconds] <input>...\n"
+                  "       synth_batch --grid lo-hi [--waves 0,1,2,3] [--velocities 127] [--length seconds] [--threads n] [--out dir] [--tail seconds]\n");
+}
+
+static std::string input_name (const std::string& path)       // file name without directories or extension
+{
+  const size_t slash = path.find_last_of('/');
+  std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+  const size_t dot = name.find_last_of('.');
+  return dot == std::string::npos ? name : name.substr(0, dot);
+}
+
+static std::vector<int> parse_list (const char* text)          // "0,1,3"
+{
+  std::vector<int> values;
+  for (const char* p = text; *p;)
+  {
+    char* end;
+    values.push_back((int)strtol(p, &end, 10));
+    p = *end == ',' ? end + 1 : end + strlen(end);
+  }
+  return values;
+}
+
+static std::vector<TimedMidiByte> grid_note (uint8_t note, uint8_t velocity, double length)
+{
+  const uint32_t off_us = (uint32_t)(length * 1e6);
+  return {
+    {0, (uint8_t)(0x90 | BATCH_GRID_CHANNEL)}, {0, note}, {0, velocity},
+    {off_us, (uint8_t)(0x80 | BATCH_GRID_CHANNEL)}, {off_us, note}, {off_us, 0}
+  };
+}
+
+int main (int argc, char** argv)
+{
+  unsigned threads = 0;
+  std::string out = ".";
+  RenderOptions options;
+  int grid_low = -1, grid_high = -1;
+  std::vector<int> waves = {0, 1, 2, 3};
+  std::vector<int> velocities = {127};
+  double length = BATCH_DEFAULT_LENGTH;
+  std::vector<std::string> inputs;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--threads") == 0 && has_value)
+    {
+      threads = (unsigned)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--out") == 0 && has_value)
+    {
+      out = argv[++i];
+    } else if (strcmp(argv[i], "--wave") == 0 && has_value)
+    {
+      options.wave = (uint8_t)(atoi(argv[++i]) & 3);
+    } else if (strcmp(argv[i], "--tail") == 0 && has_value)
+    {
+      options.tail_seconds = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--grid") == 0 && has_value)
+    {
+      if (sscanf(argv[++i], "%d-%d", &grid_low, &grid_high) != 2 || grid_low < 0 || grid_high > 127 || grid_low > grid_high)
+      {
+        usage();
+        return 2;
+      }
+    } else if (strcmp(argv[i], "--waves") == 0 && has_value)
+    {
+      waves = parse_list(argv[++i]);
+    } else if (strcmp(argv[i], "--velocities") == 0 && has_value)
+    {
+      velocities = parse_list(argv[++i]);
+    } else if (strcmp(argv[i], "--length") == 0 && has_value)
+    {
+      length = atof(argv[++i]);
+    } else if (argv[i][0] == '-')
+    {
+      usage();
+      return 2;
+    } else
+    {
+      inputs.push_back(argv[i]);
+    }
+  }
+
+  std::vector<BatchJob> jobs;
+  for (const std::string& path : inputs)
+  {
+    BatchJob job;
+    std::string error;
+    if (!load_midi_input(path, job.bytes, error))
+    {
+      fprintf(stderr, "synth_batch: %s: %s\n", path.c_str(), error.c_str());
+      return 1;
+    }
+    job.output = out + "/" + input_name(path) + ".wav";
+    job.wave = options.wave;
+    jobs.push_back(std::move(job));
+  }
+  for (int note = grid_low; grid_low >= 0 && note <= grid_high; note++)
+  {
+    for (int wave : waves)
+    {
+      for (int velocity : velocities)
+      {
+        char name[32];
+        snprintf(name, sizeof(name), "/n%03d_w%d_v%03d.wav", note, wave & 3, velocity & 0x7F);
+        jobs.push_back({out + name, grid_note((uint8_t)note, (uint8_t)(velocity & 0x7F), length), (uint8_t)(wave & 3)});
+      }
+    }
+  }
+  if (jobs.empty())
+  {
+    usage();
+    return 2;
+  }
+  std::error_code error;
+  std::filesystem::create_directories(out, error);                    // an existing directory is fine, a real problem shows up as the first WAV failing to open
+
+  threads = work_pool_threads(threads);
+  std::vector<WorkerStats> stats(threads);
+  std::atomic<unsigned> failures(0);
+  std::mutex report_lock;
+
+  const auto start = std::chrono::steady_clock::now();
+  run_work_pool(jobs.size(), threads, [&] (size_t index, unsigned worker)
+  {
+    const BatchJob& job = jobs[index];
+    WavWriter wav;
+    RenderOptions job_options = options;
+    job_options.wave = job.wave;
+
+    if (!wav.open(job.output.c_str(), host_engine_sample_rate()))
+    {
+      std::lock_guard<std::mutex> guard(report_lock);
+      fprintf(stderr, "synth_batch: cannot write %s\n", job.output.c_str());
+      failures++;
+      return;
+    }
+    const RenderResult result = render_midi(job.bytes, job_options, &wav);
+    if (!wav.close())
+    {
+      std::lock_guard<std::mutex> guard(report_lock);
+      fprintf(stderr, "synth_batch: error writing %s\n", job.output.c_str());
+      failures++;
+    }
+
+    stats[worker].jobs++;
+    stats[worker].samples += result.samples;
+    stats[worker].render_seconds += result.wall_seconds;
+  });
+  const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  uint64_t samples = 0;
+  for (const WorkerStats& worker : stats)
+  {
+    samples += worker.samples;
+  }
+  const double fs = host_engine_sample_rate();
+  printf("%zu renders, %llu samples (%.1f s audio) in %.2f s on %u threads: %.2f Msamples/s (%.0fx real time)\n",
+         jobs.size(), (unsigned long long)samples, samples / fs, wall, threads, samples / wall / 1e6, samples / wall / fs);
+  for (unsigned w = 0; w < threads; w++)
+  {
+    const WorkerStats& worker = stats[w];
+    printf("  thread %2u  %6zu renders  %10llu samples  %6.2f Msamples/s while rendering\n", w, worker.jobs,
+           (unsigned long long)worker.samples, worker.render_seconds > 0.0 ? worker.samples / worker.render_seconds / 1e6 : 0.0);
+  }
+  return failures ? 1 : 0;
+}
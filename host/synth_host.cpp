@@ -0,0 +1,934 @@
+// Host build of the synth engine.
+//
+//   synth_host render <input> <output.wav> [--wave 0-3] [--tail seconds]
+//       Renders MIDI input (see midi_input.h for formats) through the firmware and writes the DAC
+//       output as a 16 bit WAV (12 bit words, left justified).
+//
+//   synth_host tuning
+//       Checks the engine's pitch against equal temperament (A4 = 440Hz) for every note from C0 to B8, both
+//       from the tuning table and by measuring the period of the rendered output. Fails above 1 cent.
+//
+//   synth_host spectrum
+//       Measures the oscillator's harmonic distortion on sine notes and its aliasing on sawtooth notes across the
+//       keyboard (the power where harmonics over Nyquist and interpolation images fold back to, over the quantisation
+//       floor). Fails above the limits below.
+//
+//   synth_host bench [--seconds n] [--avr-scale cycles-per-ns]
+//       Times the sample path, control tick, filter, note changes and a full render on the host, next to the firmware's
+//       own hand counted cycle estimates (the ones its static_asserts check against the (F_CPU / Fs) - 1 cycle sample
+//       period). With --avr-scale it also scales the host times to AVR cycles and flags any over the budget.
+//
+//   synth_host thru
+//       Sends an incoming SysEx across a telemetry report and checks what comes out on MIDI OUT: every SysEx whole, from
+//       its F0 to its F7, never one of the report's fields inside the other or half a message cut off. Then plays notes
+//       all through a report and checks every one of them is passed on.
+//
+//   synth_host power [--active-ma mA] [--idle-ma mA]
+//       Plays nothing, then a held chord, then its release back into silence, and reports for each the sample interrupts
+//       and SPI bytes per second, how much of the time the CPU is awake (from the firmware's cycle estimates, it sleeps
+//       whenever loop() has nothing to do) and the supply current that works out to. Then the latency from a note on to its
+//       first sample, out of idle and with the engine already playing. Fails if the silent stretches still run the sample
+//       interrupt or send anything to the DAC.
+//
+// Host nanoseconds don't turn into AVR cycles by any fixed ratio (the host has caches, branch prediction, 64 bit registers
+// and wide multiplies), so there is no default --avr-scale. Work one out on the board: time the same build's sample path
+// with the PROFILING probes (synth_profile decodes the report) and divide by the host figure here. The scaled figure adds
+// the SPI transfer time that the stubbed SPDR hides (the chip busy-waits on half of the SPI bytes, 16 cycles each at fosc/2).
+
+#include "host_engine.h"
+#include "host_render.h"
+#include "midi_input.h"
+#include "wav_writer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <complex>
+#include <string>
+#include <vector>
+
+#define AVR_SPI_BYTE_CYCLES 8                   // 8 SCK periods at fosc/2 is 16 cycles, but the sample interrupt only waits on the first of each word's two bytes
+#define AVR_ISR_OVERHEAD_CYCLES 11              // 4 to enter the vector, 3 for the jmp, 4 for reti
+
+static double avr_scale = 0.0;                  // AVR cycles per host ns from --avr-scale, 0 when there is no calibration
+
+static void usage ()
+{
+  fprintf(stderr,
+    "usage: synth_host render <input> <output.wav> [--wave 0-3] [--tail seconds]\n"
+    "       synth_host tuning\n"
+    "       synth_host spectrum\n"
+    "       synth_host bench [--seconds n] [--avr-scale cycles-per-ns]\n"
+    "       synth_host power [--active-ma mA] [--idle-ma mA]\n"
+    "       synth_host thru\n");
+}
+
+static const char* option_value (int argc, char** argv, const char* name)
+{
+  for (int i = 0; i < argc - 1; i++)
+  {
+    if (strcmp(argv[i], name) == 0)
+    {
+      return argv[i + 1];
+    }
+  }
+  return nullptr;
+}
+
+static double now_ns ()
+{
+  return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void send_message (uint8_t status, uint8_t data1, uint8_t data2)
+{
+  host_engine_midi_byte(status);
+  host_engine_midi_byte(data1);
+  host_engine_midi_byte(data2);
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------------------  Render  -------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+static int command_render (int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    usage();
+    return 2;
+  }
+
+  std::vector<TimedMidiByte> bytes;
+  std::string error;
+  if (!load_midi_input(argv[0], bytes, error))
+  {
+    fprintf(stderr, "synth_host: %s: %s\n", argv[0], error.c_str());
+    return 1;
+  }
+
+  RenderOptions options;
+  if (const char* wave = option_value(argc, argv, "--wave"))
+  {
+    options.wave = (uint8_t)(atoi(wave) & 3);
+  }
+  if (const char* tail = option_value(argc, argv, "--tail"))
+  {
+    options.tail_seconds = atof(tail);
+  }
+
+  WavWriter wav;
+  if (!wav.open(argv[1], host_engine_sample_rate()))
+  {
+    fprintf(stderr, "synth_host: cannot write %s\n", argv[1]);
+    return 1;
+  }
+
+  const RenderResult result = render_midi(bytes, options, &wav);
+  if (!wav.close())
+  {
+    fprintf(stderr, "synth_host: error writing %s\n", argv[1]);
+    return 1;
+  }
+
+  const HostEngineCounters& counters = host_engine_counters();
+  printf("%llu samples (%.2f s audio), %.1f ns/sample, %u underruns\n", (unsigned long long)result.samples,
+         (double)result.samples / host_engine_sample_rate(), result.wall_seconds * 1e9 / (double)result.samples, host_engine_underruns());
+  printf("MIDI in %llu bytes (%u dropped events, %u parse errors), thru %llu bytes (queue high water %u, %u overflows, %u dropped)\n",
+         (unsigned long long)counters.midi_bytes_in, counters.midi_dropped_events, counters.midi_parse_errors,
+         (unsigned long long)counters.midi_bytes_out, counters.usart_tx_high_water, counters.usart_tx_overflows, counters.midi_thru_dropped);
+  return 0;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//-------------------------------------------------------------------------------------------------  Tuning  -------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+#define TUNING_TOLERANCE_CENTS 1.0
+#define TUNING_MEASURE_SECONDS 20
+
+static double cents (double measured, double expected)
+{
+  return 1200.0 * log2(measured / expected);
+}
+
+static double equal_temperament (uint8_t note)                          // MIDI_A4 (57) = 440Hz
+{
+  return 440.0 * pow(2.0, (note - 57) / 12.0);
+}
+
+static double measure_frequency (uint8_t note)                          // average period between rising mid-level crossings of the rendered output
+{
+  host_engine_begin();
+  send_message(0x90, note, 127);
+  host_engine_loop();
+
+  const uint64_t fs = host_engine_sample_rate();
+  const uint64_t samples = TUNING_MEASURE_SECONDS * fs;
+  double first = -1.0, last = 0.0;
+  uint64_t crossings = 0;
+  uint16_t low = 0xFFFF, high = 0;
+
+  for (uint64_t n = 0; n < fs; n++)                                     // one second to find the output range, after the envelope's attack and decay have settled
+  {
+    const uint16_t word = host_engine_tick();
+    if (n >= fs / 2)
+    {
+      low = word < low ? word : low;
+      high = word > high ? word : high;
+    }
+  }
+  const double mid = (low + high) / 2.0;
+
+  double previous = host_engine_tick();
+  for (uint64_t n = 1; n < samples; n++)
+  {
+    const double current = host_engine_tick();
+    if (previous < mid && current >= mid)
+    {
+      const double at = n - 1 + (mid - previous) / (current - previous);
+      if (first < 0)
+      {
+        first = at;
+      }
+      last = at;
+      crossings++;
+    }
+    previous = current;
+  }
+
+  return crossings > 1 ? (crossings - 1) * (double)fs / (last - first) : 0.0;
+}
+
+static int command_tuning ()
+{
+  double worst_table = 0.0, worst_rendered = 0.0;
+  uint8_t worst_table_note = 0, worst_rendered_note = 0;
+
+  for (uint8_t note = 0; note <= 107; note++)
+  {
+    const double error = fabs(cents(host_engine_note_frequency(note), equal_temperament(note)));
+    if (error > worst_table)
+    {
+      worst_table = error;
+      worst_table_note = note;
+    }
+  }
+
+  for (uint8_t note = 0; note <= 107; note += (note == 96 ? 11 : 12))   // every C, plus B8 at the top of the range
+  {
+    const double measured = measure_frequency(note);
+    const double error = fabs(cents(measured, equal_temperament(note)));
+    printf("  note %3u  expected %9.3f Hz  measured %9.3f Hz  %+7.4f cents\n", note, equal_temperament(note), measured,
+           cents(measured, equal_temperament(note)));
+    if (error > worst_rendered)
+    {
+      worst_rendered = error;
+      worst_rendered_note = note;
+    }
+  }
+
+  printf("worst table error %.4f cents (note %u), worst rendered error %.4f cents (note %u)\n",
+         worst_table, worst_table_note, worst_rendered, worst_rendered_note);
+
+  const bool pass = worst_table <= TUNING_TOLERANCE_CENTS && worst_rendered <= TUNING_TOLERANCE_CENTS;
+  printf("%s\n", pass ? "PASS" : "FAIL");
+  return pass ? 0 : 1;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//------------------------------------------------------------------------------------------------  Spectrum  -------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+#define SPECTRUM_SIZE 32768                     // FFT length, about 2 seconds at 16kHz
+#define SPECTRUM_LOBE_BINS 6                    // Blackman-Harris main lobe is +-4 bins, a little more for the envelope's gain steps
+#define SPECTRUM_SINE_THD_LIMIT_DB -40.0
+#define SPECTRUM_ALIASING_LIMIT_DB -40.0         // over the quantisation floor in the same bins
+#define SPECTRUM_ALIAS_FOLDS 2                  // harmonics and images up to this many times Fs are followed back into the band
+
+static void fft (std::vector<std::complex<double>>& x)                 // in place radix 2
+{
+  const size_t n = x.size();
+  for (size_t i = 1, j = 0; i < n; i++)
+  {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+    {
+      j ^= bit;
+    }
+    j ^= bit;
+    if (i < j)
+    {
+      std::swap(x[i], x[j]);
+    }
+  }
+  for (size_t length = 2; length <= n; length <<= 1)
+  {
+    const std::complex<double> step = std::polar(1.0, -2.0 * M_PI / length);
+    for (size_t i = 0; i < n; i += length)
+    {
+      std::complex<double> w = 1.0;
+      for (size_t k = 0; k < length / 2; k++, w *= step)
+      {
+        const std::complex<double> even = x[i + k], odd = x[i + k + length / 2] * w;
+        x[i + k] = even + odd;
+        x[i + k + length / 2] = even - odd;
+      }
+    }
+  }
+}
+
+struct SpectrumResult
+{
+  double fundamental = 0.0;                     // power in the fundamental's bins
+  double harmonics = 0.0;                       // power in the bins of harmonics 2 and up (below Nyquist)
+  double other = 0.0;                           // everything else but DC: aliases, quantisation noise
+  double aliases = 0.0;                         // the part of other in the bins where a harmonic over Nyquist or an image of one folds back to
+  size_t other_bins = 0;
+  size_t alias_bins = 0;
+  double floor () const                         // quantisation noise in the alias bins, at the density it has in the rest of other
+  {
+    return other_bins > alias_bins ? (other - aliases) / (other_bins - alias_bins) * alias_bins : 0.0;
+  }
+};
+
+static SpectrumResult measure_spectrum (uint8_t wave, uint8_t note)
+{
+  host_engine_begin();
+  for (uint8_t i = 0; i < wave; i++)
+  {
+    host_engine_press_wave_button();
+  }
+  send_message(0x90, note, 127);
+  host_engine_loop();
+
+  const uint64_t fs = host_engine_sample_rate();
+  for (uint64_t n = 0; n < fs / 2; n++)                                 // past the envelope's attack and decay
+  {
+    host_engine_tick();
+  }
+
+  std::vector<std::complex<double>> x(SPECTRUM_SIZE);
+  double mean = 0.0;
+  for (size_t n = 0; n < SPECTRUM_SIZE; n++)
+  {
+    x[n] = host_engine_tick();
+    mean += x[n].real() / SPECTRUM_SIZE;
+  }
+  for (size_t n = 0; n < SPECTRUM_SIZE; n++)                            // 4 term Blackman-Harris, sidelobes under -92dB
+  {
+    const double t = 2.0 * M_PI * n / (SPECTRUM_SIZE - 1);
+    x[n] = (x[n].real() - mean) * (0.35875 - 0.48829 * cos(t) + 0.14128 * cos(2 * t) - 0.01168 * cos(3 * t));
+  }
+  fft(x);
+
+  const double f0 = host_engine_note_frequency(note) * SPECTRUM_SIZE / fs;   // in bins
+  std::vector<bool> alias(SPECTRUM_SIZE / 2, false);
+  for (double k = 1; k * f0 < SPECTRUM_ALIAS_FOLDS * SPECTRUM_SIZE; k++)
+  {
+    double folded = fmod(k * f0, SPECTRUM_SIZE);
+    folded = folded > SPECTRUM_SIZE / 2 ? SPECTRUM_SIZE - folded : folded;
+    for (double bin = ceil(folded - SPECTRUM_LOBE_BINS); bin <= folded + SPECTRUM_LOBE_BINS; bin++)
+    {
+      if (bin >= 0 && bin < SPECTRUM_SIZE / 2)
+      {
+        alias[(size_t)bin] = true;
+      }
+    }
+  }
+
+  SpectrumResult result;
+  for (size_t bin = SPECTRUM_LOBE_BINS + 1; bin < SPECTRUM_SIZE / 2; bin++)
+  {
+    const double power = std::norm(x[bin]);
+    const double harmonic = floor(bin / f0 + 0.5);
+    if (harmonic >= 1 && fabs(bin - harmonic * f0) <= SPECTRUM_LOBE_BINS)
+    {
+      (harmonic == 1 ? result.fundamental : result.harmonics) += power;
+    } else
+    {
+      result.other += power;
+      result.other_bins++;
+      if (alias[bin])
+      {
+        result.aliases += power;
+        result.alias_bins++;
+      }
+    }
+  }
+  return result;
+}
+
+static double decibels (double ratio)
+{
+  return ratio > 0.0 ? 10.0 * log10(ratio) : -300.0;
+}
+
+static int command_spectrum ()
+{
+  bool pass = true;
+
+  printf("sine, harmonic distortion (harmonics 2 and up against the fundamental):\n");
+  const uint8_t sine_notes[] = {33, 57, 81, 93, 100};
+  for (uint8_t note : sine_notes)
+  {
+    const SpectrumResult result = measure_spectrum(0, note);
+    const double thd = decibels(result.harmonics / result.fundamental);
+    const double noise = decibels(result.other / result.fundamental);
+    printf("  note %3u %9.2f Hz  THD %7.1f dB  other %7.1f dB%s\n", note, host_engine_note_frequency(note), thd, noise,
+           thd > SPECTRUM_SINE_THD_LIMIT_DB ? "  FAIL" : "");
+    pass = pass && thd <= SPECTRUM_SINE_THD_LIMIT_DB;
+  }
+
+  // The 8 bit tables and gains leave a quantisation floor under every bin that isn't a harmonic, only a few dB under the
+  // limit on the top notes. Aliases can only land where a harmonic or an interpolation image folds back to, so the floor
+  // measured in all the other bins is taken out of those
+  printf("sawtooth, aliasing (the bins aliases fold back to, less the quantisation floor, against the harmonics):\n");
+  const uint8_t saw_notes[] = {33, 57, 69, 81, 88, 93, 100, 105};
+  for (uint8_t note : saw_notes)
+  {
+    const SpectrumResult result = measure_spectrum(3, note);
+    const double harmonics = result.fundamental + result.harmonics;
+    const double aliasing = decibels((result.aliases - result.floor()) / harmonics);
+    printf("  note %3u %9.2f Hz  aliasing %7.1f dB  floor %7.1f dB  all but harmonics %7.1f dB%s\n", note, host_engine_note_frequency(note),
+           aliasing, decibels(result.floor() / harmonics), decibels(result.other / harmonics), aliasing > SPECTRUM_ALIASING_LIMIT_DB ? "  FAIL" : "");
+    pass = pass && aliasing <= SPECTRUM_ALIASING_LIMIT_DB;
+  }
+
+  printf("%s\n", pass ? "PASS" : "FAIL");
+  return pass ? 0 : 1;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//------------------------------------------------------------------------------------------------  Benchmark  ------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+static void scaled (double ns, double spi_bytes, double budget)        // the host time as AVR cycles, only with a calibrated --avr-scale. A budget makes it a sample period, interrupt entry and all
+{
+  if (avr_scale > 0.0)
+  {
+    const double cycles = ns * avr_scale + spi_bytes * AVR_SPI_BYTE_CYCLES + (budget > 0.0 ? AVR_ISR_OVERHEAD_CYCLES : 0);
+    printf("  scaled ~%7.0f cycles%s", cycles, budget > 0.0 && cycles > budget ? "  OVER BUDGET" : "");
+  }
+  printf("\n");
+}
+
+static void report (const char* name, double ns, double spi_bytes, unsigned estimate)   // a per sample figure, against the firmware's estimate of it
+{
+  const double budget = (double)(F_CPU / host_engine_sample_rate()) - 1;
+  printf("  %-28s %9.1f ns  firmware estimate %5u cycles (%5.1f%% of %.0f)", name, ns, estimate, 100.0 * estimate / budget, budget);
+  scaled(ns, spi_bytes, budget);
+}
+
+#define BENCH_RUNS 5                            // timings are the fastest of this many runs, to keep scheduler noise out
+
+static double time_samples (uint64_t samples, double& spi_bytes_per_sample)     // ns per sample period (loop() pass + sample interrupt) with the engine in its current state
+{
+  double best = 0.0;
+  uint32_t sink = 0;
+
+  for (int run = 0; run < BENCH_RUNS; run++)
+  {
+    const uint64_t spi_before = host_engine_counters().spi_bytes;
+    const double start = now_ns();
+    for (uint64_t n = 0; n < samples; n++)
+    {
+      sink += host_engine_tick();
+    }
+    const double ns = (now_ns() - start) / (double)samples;
+    spi_bytes_per_sample = (double)(host_engine_counters().spi_bytes - spi_before) / (double)samples;
+    best = (run == 0 || ns < best) ? ns : best;
+  }
+
+  if (sink == 0xFFFFFFFF)
+  {
+    puts("");                                                           // keeps the loops from being optimised away
+  }
+  return best;
+}
+
+static int command_bench (int argc, char** argv)
+{
+  double seconds = 10.0;
+  if (const char* value = option_value(argc, argv, "--seconds"))
+  {
+    seconds = atof(value);
+  }
+  if (const char* value = option_value(argc, argv, "--avr-scale"))
+  {
+    avr_scale = atof(value);
+  }
+
+  const uint64_t fs = host_engine_sample_rate();
+  const uint64_t samples = (uint64_t)(seconds * fs) / BENCH_RUNS;
+  const uint8_t notes[] = {60, 84, 107};
+
+  printf("Fs = %llu Hz, sample period budget = %llu cycles, ", (unsigned long long)fs, (unsigned long long)(F_CPU / fs) - 1);
+  if (avr_scale > 0.0)
+  {
+    printf("host times scaled at %.2f AVR cycles/ns\n", avr_scale);
+  } else
+  {
+    printf("host times only (no --avr-scale measured on the board to turn them into AVR cycles)\n");
+  }
+  const unsigned sample_estimate = host_engine_isr_cycle_estimate() + host_engine_render_cycle_estimate();
+
+  printf("sample path (block rendering in loop() + TIMER1_COMPA_vect), all %u voices sounding, %llu samples per chord:\n", host_engine_voice_count(),
+         (unsigned long long)samples);
+  double worst = 0.0, worst_spi = 0.0;
+  for (uint8_t note : notes)
+  {
+    host_engine_begin();
+    for (uint8_t v = 0; v < host_engine_voice_count(); v++)
+    {
+      send_message(0x90, note - 3 * v, 127);
+    }
+    host_engine_loop();
+
+    double spi = 0.0;
+    const double ns = time_samples(samples, spi);
+
+    char name[32];
+    snprintf(name, sizeof(name), "chord from note %u", note);
+    report(name, ns, spi, sample_estimate);
+    if (ns > worst)
+    {
+      worst = ns;
+      worst_spi = spi;
+    }
+  }
+  report("worst case", worst, worst_spi, sample_estimate);
+  printf("  %-28s ISR_CYCLES %u + per sample share of rendering, control ticks and filter %u\n", "firmware estimate is",
+         host_engine_isr_cycle_estimate(), host_engine_render_cycle_estimate());
+  printf("  %-28s %9u\n", "buffer underruns", host_engine_underruns());
+
+  printf("control tick (controlTick() every %u samples: LFO, then envelopes, glides, gains and increments of all %u voices with\n"
+         "vibrato, tremolo, bend and portamento all on, part of the sample path above):\n",
+         host_engine_control_samples(), host_engine_voice_count());
+  {
+    host_engine_begin();
+    const uint8_t controllers[][2] = {{77, 64}, {92, 64}, {65, 127}, {5, 127}};   // vibrato depth, tremolo depth, portamento on, longest portamento time
+    for (const auto& cc : controllers)
+    {
+      send_message(0xB0, cc[0], cc[1]);
+    }
+    send_message(0xE0, 0x00, 0x50);                                                    // pitch bend part way up
+    for (uint8_t v = 0; v < host_engine_voice_count(); v++)
+    {
+      send_message(0x90, 60 + v, 127);                                                 // every note after the first glides from the one before
+    }
+    host_engine_loop();
+
+    const int repeats = 100000;
+    double best = 0.0;
+    for (int run = 0; run < BENCH_RUNS; run++)
+    {
+      const double start = now_ns();
+      for (int r = 0; r < repeats; r++)
+      {
+        host_engine_control_tick();
+      }
+      const double ns = (now_ns() - start) / repeats;
+      best = (run == 0 || ns < best) ? ns : best;
+    }
+    printf("  %-28s %9.1f ns  firmware estimate %5u cycles", "per control tick", best, host_engine_control_cycle_estimate());
+    scaled(best, 0.0, 0.0);
+    printf("  %-28s %9.1f ns  firmware estimate %5u cycles", "per sample share", best / host_engine_control_samples(),
+           host_engine_control_cycle_estimate() / host_engine_control_samples());
+    scaled(best / host_engine_control_samples(), 0.0, 0.0);
+  }
+
+  if (host_engine_filter_cycle_estimate())
+  {
+    printf("filter (filterBlock(), part of the sample path above once a filter mode is selected):\n");
+    const uint8_t modes[] = {1, 2, 3};
+    const char* const names[] = {"low pass per sample", "band pass per sample", "high pass per sample"};
+    uint16_t in[64], out[64];
+    for (int n = 0; n < 64; n++)
+    {
+      in[n] = (uint16_t)(2048 + 1500 * sin(n * 0.3));
+    }
+    for (int m = 0; m < 3; m++)
+    {
+      host_engine_begin();
+      send_message(0xB0, 70, modes[m] << 5);                               // MIDI_CC_FILTER_MODE
+      send_message(0xB0, 71, 100);                                         // resonance
+      send_message(0xB0, 74, 60);                                          // cutoff
+      host_engine_loop();
+
+      const int repeats = 20000;
+      double best = 0.0;
+      for (int run = 0; run < BENCH_RUNS; run++)
+      {
+        const double start = now_ns();
+        for (int r = 0; r < repeats; r++)
+        {
+          host_engine_filter_block(in, out, 64);
+        }
+        const double ns = (now_ns() - start) / (repeats * 64.0);
+        best = (run == 0 || ns < best) ? ns : best;
+      }
+      printf("  %-28s %9.1f ns  firmware estimate %5u cycles", names[m], best, host_engine_filter_cycle_estimate());
+      scaled(best, 0.0, 0.0);
+    }
+  }
+
+  printf("boot (setup() through the first rendered note):\n");
+  {
+    const int repeats = 200;
+    double total = 0.0;
+    for (int r = 0; r < repeats; r++)
+    {
+      const double start = now_ns();
+      host_engine_begin();
+      send_message(0x90, 60, 100);
+      while (host_engine_tick() == 0)
+      {
+      }
+      total += now_ns() - start;
+    }
+    const double ns = total / repeats;
+    printf("  %-28s %9.1f ns", "boot to first note", ns);
+    scaled(ns, 0.0, 0.0);
+  }
+
+  printf("note change (processMidiEvent + startVoice in loop()):\n");
+  {
+    host_engine_begin();
+    const int repeats = 2000;
+    double total = 0.0;
+    for (int r = 0; r < repeats; r++)
+    {
+      for (uint8_t note = 0; note < 108; note++)
+      {
+        send_message(0x90, note, 100);
+        const double start = now_ns();
+        host_engine_loop();
+        total += now_ns() - start;
+        send_message(0x80, note, 0);
+        host_engine_loop();
+      }
+    }
+    const double ns = total / (repeats * 108.0);
+    printf("  %-28s %9.1f ns", "note on", ns);
+    scaled(ns, 0.0, 0.0);
+  }
+
+  printf("full render (MIDI + loop() + sample interrupt per sample):\n");
+  {
+    std::vector<TimedMidiByte> script;
+    const uint8_t chord[] = {48, 52, 55, 60, 64, 67, 72, 76};
+    uint32_t time_us = 0;
+    while (time_us < seconds * 1000000)
+    {
+      for (uint8_t note : chord)
+      {
+        script.push_back({time_us, 0x90});
+        script.push_back({time_us, note});
+        script.push_back({time_us, 100});
+        script.push_back({time_us + 90000, 0x80});
+        script.push_back({time_us + 90000, note});
+        script.push_back({time_us + 90000, 0});
+        time_us += 100000;
+      }
+    }
+
+    RenderOptions options;
+    options.tail_seconds = 0.0;
+    const RenderResult result = render_midi(script, options, nullptr);
+    const double ns = result.wall_seconds * 1e9 / (double)result.samples;
+    report("per sample", ns, 2.0, sample_estimate);
+    printf("  %-28s %9.2f x real time (%.0f samples/s)\n", "throughput", (double)result.samples / fs / result.wall_seconds,
+           (double)result.samples / result.wall_seconds);
+  }
+
+  return 0;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------------------  Power  --------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+#define POWER_ACTIVE_MA 9.0                     // ATmega328P alone at 16MHz and 5V, typical, read off the datasheet's supply current curves...
+#define POWER_IDLE_MA 2.5                       // ...the board's regulator, USB bridge and LEDs come on top, --active-ma and --idle-ma take measured figures
+#define POWER_SETTLE_SECONDS 0.1                // left out of each measurement, for the attack or the last blocks before idle
+#define POWER_MEASURE_SECONDS 1.0
+
+static bool power_phase (const char* name, double active_ma, double idle_ma)   // measures POWER_MEASURE_SECONDS of the engine as it is, true if the sample interrupt ran
+{
+  const uint64_t fs = host_engine_sample_rate();
+  for (uint64_t n = 0; n < (uint64_t)(POWER_SETTLE_SECONDS * fs); n++)
+  {
+    host_engine_tick();
+  }
+
+  const HostEngineCounters& counters = host_engine_counters();
+  const uint64_t interrupts = counters.sample_interrupts, spi = counters.spi_bytes, awake = host_engine_awake_cycle_estimate();
+  const uint64_t samples = (uint64_t)(POWER_MEASURE_SECONDS * fs);
+  for (uint64_t n = 0; n < samples; n++)
+  {
+    host_engine_tick();
+  }
+
+  const double awake_fraction = (double)(host_engine_awake_cycle_estimate() - awake) / ((double)samples * (F_CPU / fs));
+  printf("  %-28s %6.0f sample interrupts/s  %6.0f SPI bytes/s  CPU awake %5.1f%%  ~%5.2f mA\n", name,
+         (counters.sample_interrupts - interrupts) / POWER_MEASURE_SECONDS, (counters.spi_bytes - spi) / POWER_MEASURE_SECONDS,
+         100.0 * awake_fraction, awake_fraction * active_ma + (1.0 - awake_fraction) * idle_ma);
+  return counters.sample_interrupts != interrupts || counters.spi_bytes != spi;
+}
+
+static uint64_t samples_to_audible ()           // sample periods from now until the events already received start playing
+{
+  const HostEngineCounters& counters = host_engine_counters();
+  uint64_t samples = 0;
+  while (counters.midi_events_audible < counters.midi_events_received && samples < host_engine_sample_rate())
+  {
+    host_engine_tick();
+    samples++;
+  }
+  return samples;
+}
+
+static int command_power (int argc, char** argv)
+{
+  double active_ma = POWER_ACTIVE_MA, idle_ma = POWER_IDLE_MA;
+  if (const char* value = option_value(argc, argv, "--active-ma"))
+  {
+    active_ma = atof(value);
+  }
+  if (const char* value = option_value(argc, argv, "--idle-ma"))
+  {
+    idle_ma = atof(value);
+  }
+
+  const double fs = host_engine_sample_rate();
+  printf("Fs = %.0f Hz, %u voices, CPU current %.2f mA awake, %.2f mA asleep in idle mode:\n", fs, host_engine_voice_count(), active_ma, idle_ma);
+
+  bool pass = true;
+  host_engine_begin();
+  pass = !power_phase("silent after boot", active_ma, idle_ma) && pass;
+
+  for (uint8_t v = 0; v < host_engine_voice_count(); v++)
+  {
+    send_message(0x90, 48 + 4 * v, 100);
+  }
+  power_phase("chord held", active_ma, idle_ma);
+
+  for (uint8_t v = 0; v < host_engine_voice_count(); v++)
+  {
+    send_message(0x80, 48 + 4 * v, 0);
+  }
+  power_phase("chord released", active_ma, idle_ma);                                   // the rest of the release, then idle again
+  pass = !power_phase("silent after release", active_ma, idle_ma) && pass;
+
+  printf("note on to first sample:\n");
+  send_message(0x90, 60, 100);
+  const uint64_t from_idle = samples_to_audible();
+  const double wake_us = host_engine_wake_cycle_estimate() * 1e6 / F_CPU;
+  printf("  %-28s %6llu sample periods on the host, about %.0f us on the chip (POWER_WAKE_CYCLES %u)\n", "out of idle",
+         (unsigned long long)from_idle, wake_us, host_engine_wake_cycle_estimate());
+
+  uint64_t worst = 0;
+  for (int n = 0; n < 16; n++)                                                         // note ons landing all through a block
+  {
+    for (int wait = 0; wait < 5; wait++)
+    {
+      host_engine_tick();
+    }
+    send_message(0x90, 62 + n % 8, 100);
+    const uint64_t samples = samples_to_audible();
+    worst = samples > worst ? samples : worst;
+  }
+  printf("  %-28s %6llu sample periods at worst (%.2f ms), behind the block playing and the one rendered ahead\n", "while playing",
+         (unsigned long long)worst, worst * 1000.0 / fs);
+
+  printf("%s\n", pass ? "PASS" : "FAIL  the sample interrupt ran with nothing sounding");
+  return pass ? 0 : 1;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//-----------------------------------------------------------------------------------------------  MIDI THRU  ------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+#define THRU_BYTE_US 320.0                      // 10 bits at 31250 baud
+#define THRU_SYSEX_LENGTH 400                   // data bytes, longer than the report takes to go out
+#define THRU_TIMEOUT_SECONDS 2
+#define THRU_NOTES 100                          // note on and off pairs sent during a report...
+#define THRU_NOTE_SPACING_MS 3                  // ...this far apart, the line is mostly busy with them
+
+static const uint8_t telemetry_request[] = { 0xF0, 0x7D, 0x01, 0xF7 };
+
+static void send_wire (const std::vector<uint8_t>& bytes)                              // at the MIDI line rate, ticking the engine in between
+{
+  const double samples_per_byte = THRU_BYTE_US * host_engine_sample_rate() / 1e6;
+  double due = 0.0;
+  for (uint8_t data : bytes)
+  {
+    host_engine_midi_byte(data);
+    for (due += samples_per_byte; due >= 1.0; due -= 1.0)
+    {
+      host_engine_tick();
+    }
+  }
+}
+
+static bool report_started (const std::vector<uint8_t>& out, size_t from)             // the reply to telemetry_request, as opposed to the request passed through
+{
+  for (size_t i = from; i + 3 < out.size(); i++)
+  {
+    if (out[i] == 0xF0 && out[i + 1] == 0x7D && out[i + 2] == 0x01 && out[i + 3] != 0xF7)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+static size_t broken_sysex (const std::vector<uint8_t>& out)                          // F0s inside a SysEx and F7s outside one, realtime bytes may go anywhere
+{
+  size_t broken = 0;
+  bool open = false;
+  for (uint8_t data : out)
+  {
+    if (data == 0xF0)
+    {
+      broken += open;
+      open = true;
+    } else if (data == 0xF7)
+    {
+      broken += !open;
+      open = false;
+    } else if (data >= 0x80 && data < 0xF8)
+    {
+      broken += open;                                                                    // any other status byte cuts a SysEx short
+      open = false;
+    }
+  }
+  return broken + open;
+}
+
+static size_t channel_messages (const std::vector<uint8_t>& out)                      // complete channel voice messages, running status and all, outside any SysEx
+{
+  size_t messages = 0;
+  uint8_t status = 0, expected = 0, count = 0;
+  for (uint8_t data : out)
+  {
+    if (data >= 0xF8)
+    {
+      continue;
+    }
+    if (data & 0x80)
+    {
+      status = data < 0xF0 ? data : 0;
+      expected = (data >> 4) == 0xC || (data >> 4) == 0xD ? 1 : 2;
+      count = 0;
+    } else if (status && ++count == expected)
+    {
+      messages++;
+      count = 0;
+    }
+  }
+  return messages;
+}
+
+static int command_thru ()
+{
+  printf("Fs = %.0f Hz, MIDI THRU with a telemetry report going out:\n", (double)host_engine_sample_rate());
+  std::vector<uint8_t> out;
+  host_engine_begin();
+  host_engine_capture_midi_out(&out);
+
+  std::vector<uint8_t> incoming(telemetry_request, telemetry_request + sizeof(telemetry_request));
+  send_wire(incoming);
+  for (uint32_t n = 0; n < THRU_TIMEOUT_SECONDS * host_engine_sample_rate() && !report_started(out, 0); n++)
+  {
+    host_engine_tick();
+  }
+
+  incoming.assign(1, 0xF0);                                                              // starts while the report is going out and ends after it
+  for (int i = 0; i < THRU_SYSEX_LENGTH; i++)
+  {
+    incoming.push_back(i & 0x7F);
+  }
+  incoming.push_back(0xF7);
+  send_wire(incoming);
+  for (uint32_t n = 0; n < THRU_TIMEOUT_SECONDS * host_engine_sample_rate(); n++)
+  {
+    host_engine_tick();
+  }
+  host_engine_capture_midi_out(nullptr);
+
+  bool pass = report_started(out, 0) && broken_sysex(out) == 0;
+  printf("  %s  a SysEx arriving during the report: %zu bytes out, %zu broken SysEx\n", pass ? "PASS" : "FAIL", out.size(), broken_sysex(out));
+
+  out.clear();
+  host_engine_begin();
+  host_engine_capture_midi_out(&out);
+  incoming.assign(telemetry_request, telemetry_request + sizeof(telemetry_request));
+  send_wire(incoming);
+  for (int n = 0; n < THRU_NOTES; n++)
+  {
+    send_message(0x90, 48 + n % 24, 100);
+    for (uint32_t t = 0; t < THRU_NOTE_SPACING_MS * host_engine_sample_rate() / 2000; t++)
+    {
+      host_engine_tick();
+    }
+    send_message(0x80, 48 + n % 24, 0);
+    for (uint32_t t = 0; t < THRU_NOTE_SPACING_MS * host_engine_sample_rate() / 2000; t++)
+    {
+      host_engine_tick();
+    }
+  }
+  for (uint32_t n = 0; n < THRU_TIMEOUT_SECONDS * host_engine_sample_rate(); n++)
+  {
+    host_engine_tick();
+  }
+  host_engine_capture_midi_out(nullptr);
+
+  const HostEngineCounters& counters = host_engine_counters();
+  const bool notes = report_started(out, 0) && broken_sysex(out) == 0 && channel_messages(out) == 2 * THRU_NOTES;
+  printf("  %s  notes played through a report: %zu of %u messages passed on, %u held back and dropped, %u queue overflows\n",
+         notes ? "PASS" : "FAIL", channel_messages(out), 2 * THRU_NOTES, counters.midi_thru_dropped, counters.usart_tx_overflows);
+  pass = notes && pass;
+  printf("%s\n", pass ? "PASS" : "FAIL");
+  return pass ? 0 : 1;
+}
+
+int main (int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    usage();
+    return 2;
+  }
+
+  if (strcmp(argv[1], "render") == 0)
+  {
+    return command_render(argc - 2, argv + 2);
+  }
+  if (strcmp(argv[1], "tuning") == 0)
+  {
+    return command_tuning();
+  }
+  if (strcmp(argv[1], "spectrum") == 0)
+  {
+    return command_spectrum();
+  }
+  if (strcmp(argv[1], "bench") == 0)
+  {
+    return command_bench(argc - 2, argv + 2);
+  }
+  if (strcmp(argv[1], "power") == 0)
+  {
+    return command_power(argc - 2, argv + 2);
+  }
+  if (strcmp(argv[1], "thru") == 0)
+  {
+    return command_thru();
+  }
+
+  usage();
+  return 2;
+}
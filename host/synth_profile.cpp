@@ -0,0 +1,199 @@
+// Profiled host build of the synth engine (the sketch compiled with PROFILING=1).
+//
+//   synth_profile <input> [--wave 0-3] [--tail seconds]
+//       Renders MIDI input (see midi_input.h for formats) through the firmware, then asks for the telemetry report
+//       over MIDI exactly as a host on the wire would (F0 7D 01 F7), decodes the SysEx pieces that come back on MIDI
+//       OUT and prints them. On the host the probes time in nanoseconds rather than CPU cycles. The report layout comes from
+//       the engine (host_engine_telemetry_layout), so the two are never out of step.
+
+#include "host_engine.h"
+#include "host_render.h"
+#include "midi_input.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define TELEMETRY_REQUEST_LENGTH 4              // F0 7D 01 F7
+#define TELEMETRY_TIMEOUT_SECONDS 2
+
+static const HostTelemetryLayout telemetry = host_engine_telemetry_layout();   // the rest of the layout comes from the engine itself
+
+static const char* const counter_names[] = {
+  "MIDI dropped events", "MIDI parse errors", "thru queue high water", "thru queue overflows", "buffer underruns", "free RAM", "sample underruns",
+  "thru messages dropped" };
+static const char* const probe_names[] = { "sample ISR", "MIDI RX ISR", "loop MIDI", "loop render", "control tick" };
+
+template <size_t N> static std::string field_name (const char* const (&names)[N], uint32_t index, const char* what)   // a field added to the engine shows up numbered until it's named here
+{
+  return index < N ? names[index] : what + std::to_string(index);
+}
+
+static void usage ()
+{
+  fprintf(stderr, "usage: synth_profile <input> [--wave 0-3] [--tail seconds]\n");
+}
+
+static const char* option_value (int argc, char** argv, const char* name)
+{
+  for (int i = 0; i < argc - 1; i++)
+  {
+    if (strcmp(argv[i], name) == 0)
+    {
+      return argv[i + 1];
+    }
+  }
+  return nullptr;
+}
+
+struct TelemetryReport
+{
+  uint8_t version = 0;
+  uint8_t profiling = 0;
+  size_t pieces = 0;
+  size_t bytes = 0;                                                  // on the wire, every piece's F0 to F7
+  std::vector<uint32_t> fields = std::vector<uint32_t>(telemetry.fields);
+};
+
+static bool decode_piece (const uint8_t* piece, size_t length, TelemetryReport& report, bool& last)   // false for one that doesn't fit the layout
+{
+  const size_t fields = (length - telemetry.header_bytes - 1) / telemetry.field_bytes;
+  const uint32_t first = piece[5];
+  if ((length - telemetry.header_bytes - 1) % telemetry.field_bytes || first + fields > telemetry.fields || (report.pieces && piece[3] != report.version))
+  {
+    return false;
+  }
+
+  report.version = piece[3];
+  report.profiling = piece[4];
+  report.pieces++;
+  report.bytes += length;
+  for (size_t f = 0; f < fields; f++)
+  {
+    uint32_t value = 0;
+    const uint8_t* bytes = &piece[telemetry.header_bytes + f * telemetry.field_bytes];
+    for (int i = telemetry.field_bytes - 1; i >= 0; i--)
+    {
+      value = (value << 7) | bytes[i];
+    }
+    report.fields[first + f] = value;
+  }
+  last = first + fields == telemetry.fields;
+  return true;
+}
+
+static bool request_report (TelemetryReport& report)                // sends the request and ticks the engine until the piece with the last field has gone out
+{
+  static const uint8_t request[TELEMETRY_REQUEST_LENGTH] = { 0xF0, 0x7D, 0x01, 0xF7 };
+  std::vector<uint8_t> out;
+  host_engine_capture_midi_out(&out);
+
+  for (uint8_t data : request)
+  {
+    host_engine_midi_byte(data);
+  }
+
+  bool last = false, valid = true;
+  size_t start = 0;                                                  // where the next piece is looked for
+  for (uint32_t n = 0; n < TELEMETRY_TIMEOUT_SECONDS * (uint32_t)host_engine_sample_rate() && !last && valid; n++)
+  {
+    host_engine_tick();
+    for (; start + telemetry.header_bytes <= out.size() && !last && valid; start++)
+    {
+      if (out[start] != 0xF0 || out[start + 1] != 0x7D || out[start + 2] != 0x01)
+      {
+        continue;
+      }
+      size_t end = start + 1;
+      while (end < out.size() && out[end] != 0xF7)
+      {
+        end++;
+      }
+      if (end == out.size())                                         // the rest of it is still to come
+      {
+        break;
+      }
+      if (end >= start + telemetry.header_bytes)                    // too short is the request itself, which MIDI THRU passes on
+      {
+        valid = decode_piece(&out[start], end + 1 - start, report, last);
+      }
+      start = end;
+    }
+  }
+
+  host_engine_capture_midi_out(nullptr);
+  return last && valid;
+}
+
+int main (int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    usage();
+    return 2;
+  }
+
+  std::vector<TimedMidiByte> bytes;
+  std::string error;
+  if (!load_midi_input(argv[1], bytes, error))
+  {
+    fprintf(stderr, "synth_profile: %s: %s\n", argv[1], error.c_str());
+    return 1;
+  }
+
+  RenderOptions options;
+  if (const char* wave = option_value(argc - 2, argv + 2, "--wave"))
+  {
+    options.wave = (uint8_t)(atoi(wave) & 3);
+  }
+  if (const char* tail = option_value(argc - 2, argv + 2, "--tail"))
+  {
+    options.tail_seconds = atof(tail);
+  }
+
+  const RenderResult result = render_midi(bytes, options, nullptr);
+
+  TelemetryReport report;
+  if (!request_report(report) || report.version != telemetry.version)
+  {
+    fprintf(stderr, "synth_profile: no telemetry report on MIDI OUT, or not one this layout (version %u) decodes\n", report.version);
+    return 1;
+  }
+  if (!report.profiling)
+  {
+    fprintf(stderr, "synth_profile: engine was built without PROFILING\n");
+    return 1;
+  }
+
+  printf("%llu samples (%.2f s audio), report %zu bytes in %zu pieces\n", (unsigned long long)result.samples,
+         (double)result.samples / host_engine_sample_rate(), report.bytes, report.pieces);
+  for (uint32_t i = 0; i < telemetry.counters; i++)
+  {
+    printf("%-24s %u\n", field_name(counter_names, i, "counter ").c_str(), report.fields[i]);
+  }
+
+  printf("\n%-12s %10s %10s %8s %8s   histogram (<128ns, then doubling)\n", "probe", "count", "avg ns", "min", "max");
+  for (uint32_t p = 0; p < telemetry.probes; p++)
+  {
+    const uint32_t base = telemetry.counters + p * telemetry.probe_fields;
+    const uint32_t count = report.fields[base];
+    printf("%-12s %10u %10.1f %8u %8u  ", field_name(probe_names, p, "probe ").c_str(), count, count ? (double)report.fields[base + 1] / count : 0.0,
+           report.fields[base + 2], report.fields[base + 3]);
+    for (uint32_t b = 0; b < telemetry.buckets; b++)
+    {
+      printf(" %u", report.fields[base + 4 + b]);
+    }
+    printf("\n");
+  }
+
+  if (const uint64_t idle = host_engine_counters().idle_samples)
+  {
+    printf("\ntimer 1 was stopped for %llu samples (%.2f s, POWER_IDLE). Timed here in nanoseconds the probes still count\n"
+           "that stretch, but the chip's profiler clock is timer 1: there the MIDI RX ISR and loop MIDI probes taken while it\n"
+           "is stopped read 0 cycles and drag min and avg down. Build the firmware with POWER_IDLE 0 to time them on the chip.\n",
+           (unsigned long long)idle, (double)idle / host_engine_sample_rate());
+  }
+  return 0;
+}
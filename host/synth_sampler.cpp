@@ -0,0 +1,488 @@
+// Sample playback host for the synth engine (the sketch compiled with SAMPLE_STREAMING=1, see SAMPLE_STREAM.h).
+//
+//   synth_sampler pack <image> <sample.raw>...
+//       Writes a flash image with each raw file (unsigned 8 bit PCM at SAMPLE_RATE_HZ) in the next slot of the directory,
+//       program change 1 plays the first.
+//
+//   synth_sampler render <image> <input> <output.wav> [--program n] [--tail seconds]
+//       Renders MIDI input (see midi_input.h for formats) with the image as the contents of the SPI flash. --program sends
+//       a program change before the input (default 1, 0 sends none). Reports the flash traffic and the underruns.
+//
+//   synth_sampler check
+//       Packs a test image and plays it: a note on SAMPLE_ROOT_NOTE has to play the sample back, one an octave up has
+//       to play it at twice the speed and one with a step over 2 has to play it through to the end without running past
+//       the bytes read into its ring, every voice streaming at once has to keep up with no sample underruns and no DAC
+//       disturbed, a sample that ends has to release its voice and let the engine go idle, and program 0 or a missing
+//       flash has to leave the wave tables playing. Then reports the note on to sample latency and how far above the
+//       root note the reads stop keeping up with every voice, where the voices still mustn't play past them.
+
+#include "host_engine.h"
+#include "host_render.h"
+#include "midi_input.h"
+#include "wav_writer.h"
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#define IMAGE_MAGIC 0x31504D53UL                // "SMP1", must match SAMPLE_STREAM.h
+#define IMAGE_SLOTS 8
+#define IMAGE_DIRECTORY_ADDRESS 4
+#define IMAGE_DATA_ADDRESS (IMAGE_DIRECTORY_ADDRESS + IMAGE_SLOTS * 8)
+#define IMAGE_MAX_BYTES (1UL << 24)             // 24 bit flash addresses
+
+#define CHECK_TONE_SECONDS 4.0                  // long enough to outlast the measurement at the fastest step checked
+#define CHECK_HIT_SECONDS 0.15
+#define CHECK_SHORT_SECONDS 0.1
+#define CHECK_SHORT_LENGTHS 6                   // slots 3 up hold it a byte shorter each, so the last step lands every way on the end
+#define CHECK_OVER_SEMITONES 5                  // past the top of the range, where the step stays at SAMPLE_STEP_MAX
+#define CHECK_MEASURE_SECONDS 0.5
+#define CHECK_MAX_LAG_SECONDS 0.02              // the sample starts within this of the note on
+#define CHECK_MIN_CORRELATION 0.999             // against the sample resampled in floating point
+
+#define MIDI_CC_ATTACK_TIME 73                  // the envelope controllers, as in ENVELOPE.h
+#define MIDI_CC_SUSTAIN_LEVEL 79
+
+static void usage ()
+{
+  fprintf(stderr,
+    "usage: synth_sampler pack <image> <sample.raw>...\n"
+    "       synth_sampler render <image> <input> <output.wav> [--program n] [--tail seconds]\n"
+    "       synth_sampler check\n");
+}
+
+static const char* option_value (int argc, char** argv, const char* name)
+{
+  for (int i = 0; i < argc - 1; i++)
+  {
+    if (strcmp(argv[i], name) == 0)
+    {
+      return argv[i + 1];
+    }
+  }
+  return nullptr;
+}
+
+static void put_le32 (std::vector<uint8_t>& image, size_t at, uint32_t value)
+{
+  for (int i = 0; i < 4; i++)
+  {
+    image[at + i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+static bool build_image (const std::vector<std::vector<uint8_t>>& samples, std::vector<uint8_t>& image)   // directory, then the samples one after another
+{
+  if (samples.size() > IMAGE_SLOTS)
+  {
+    return false;
+  }
+  image.assign(IMAGE_DATA_ADDRESS, 0);
+  put_le32(image, 0, IMAGE_MAGIC);
+  for (size_t slot = 0; slot < samples.size(); slot++)
+  {
+    put_le32(image, IMAGE_DIRECTORY_ADDRESS + slot * 8, (uint32_t)image.size());
+    put_le32(image, IMAGE_DIRECTORY_ADDRESS + slot * 8 + 4, (uint32_t)samples[slot].size());
+    image.insert(image.end(), samples[slot].begin(), samples[slot].end());
+  }
+  return image.size() <= IMAGE_MAX_BYTES;
+}
+
+static bool write_file (const std::string& path, const std::vector<uint8_t>& bytes)
+{
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file)
+  {
+    return false;
+  }
+  const bool written = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size();
+  return fclose(file) == 0 && written;
+}
+
+static void send_message (uint8_t status, uint8_t data1, uint8_t data2)
+{
+  host_engine_midi_byte(status);
+  host_engine_midi_byte(data1);
+  if ((status >> 4) != 0xC)                     // program change has one data byte
+  {
+    host_engine_midi_byte(data2);
+  }
+}
+
+static void print_traffic (const char* tool)
+{
+  const HostEngineCounters& counters = host_engine_counters();
+  printf("%s: %llu flash reads, %llu bytes (%.2f per sample), %u sample underruns, %u buffer underruns, %llu bus conflicts, %llu ring overruns\n",
+         tool, (unsigned long long)counters.flash_reads, (unsigned long long)counters.flash_bytes,
+         counters.samples ? (double)counters.flash_bytes / counters.samples : 0.0, host_engine_sample_underruns(), host_engine_underruns(),
+         (unsigned long long)counters.bus_conflicts, (unsigned long long)counters.ring_overruns);
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//------------------------------------------------------------------------------------------------  Pack, render  -----------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+static int command_pack (int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    usage();
+    return 2;
+  }
+
+  std::vector<std::vector<uint8_t>> samples;
+  for (int i = 1; i < argc; i++)
+  {
+    FILE* file = fopen(argv[i], "rb");
+    if (!file)
+    {
+      fprintf(stderr, "synth_sampler: cannot read %s\n", argv[i]);
+      return 1;
+    }
+    std::vector<uint8_t> sample;
+    uint8_t chunk[4096];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0)
+    {
+      sample.insert(sample.end(), chunk, chunk + count);
+    }
+    fclose(file);
+    samples.push_back(std::move(sample));
+  }
+
+  std::vector<uint8_t> image;
+  if (!build_image(samples, image))
+  {
+    fprintf(stderr, "synth_sampler: at most %d samples and %lu bytes\n", IMAGE_SLOTS, IMAGE_MAX_BYTES);
+    return 1;
+  }
+  if (!write_file(argv[0], image))
+  {
+    fprintf(stderr, "synth_sampler: cannot write %s\n", argv[0]);
+    return 1;
+  }
+  for (size_t slot = 0; slot < samples.size(); slot++)
+  {
+    printf("program %zu: %s, %zu bytes (%.2f s)\n", slot + 1, argv[slot + 1], samples[slot].size(),
+           (double)samples[slot].size() / host_engine_sample_rate_hz());
+  }
+  return 0;
+}
+
+static int command_render (int argc, char** argv)
+{
+  if (argc < 3)
+  {
+    usage();
+    return 2;
+  }
+  if (!host_engine_open_flash(argv[0]))
+  {
+    fprintf(stderr, "synth_sampler: cannot map %s\n", argv[0]);
+    return 1;
+  }
+
+  std::vector<TimedMidiByte> input, bytes;
+  std::string error;
+  if (!load_midi_input(argv[1], input, error))
+  {
+    fprintf(stderr, "synth_sampler: %s: %s\n", argv[1], error.c_str());
+    return 1;
+  }
+  const int program = option_value(argc, argv, "--program") ? atoi(option_value(argc, argv, "--program")) : 1;
+  if (program > 0)
+  {
+    bytes.push_back({0, 0xC0});
+    bytes.push_back({0, (uint8_t)(program & 0x7F)});
+  }
+  bytes.insert(bytes.end(), input.begin(), input.end());
+
+  RenderOptions options;
+  if (const char* tail = option_value(argc, argv, "--tail"))
+  {
+    options.tail_seconds = atof(tail);
+  }
+
+  WavWriter wav;
+  if (!wav.open(argv[2], host_engine_sample_rate()))
+  {
+    fprintf(stderr, "synth_sampler: cannot write %s\n", argv[2]);
+    return 1;
+  }
+  const RenderResult result = render_midi(bytes, options, &wav);
+  if (!wav.close())
+  {
+    fprintf(stderr, "synth_sampler: error writing %s\n", argv[2]);
+    return 1;
+  }
+
+  printf("%llu samples (%.2f s audio), %.1f ns/sample\n", (unsigned long long)result.samples,
+         (double)result.samples / host_engine_sample_rate(), result.wall_seconds * 1e9 / (double)result.samples);
+  print_traffic("synth_sampler");
+  return 0;
+}
+
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+//--------------------------------------------------------------------------------------------------  Check  --------------------------------------------------------------------------------------------------
+//---------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+static std::vector<uint8_t> test_tone (double seconds)     // two partials well inside 8 bits, smooth enough to resample cleanly
+{
+  const double rate = host_engine_sample_rate_hz();
+  std::vector<uint8_t> sample((size_t)(seconds * rate));
+  for (size_t n = 0; n < sample.size(); n++)
+  {
+    sample[n] = (uint8_t)lround(128.0 + 70.0 * sin(2.0 * M_PI * 220.0 * n / rate) + 30.0 * sin(2.0 * M_PI * 587.0 * n / rate));
+  }
+  return sample;
+}
+
+static std::vector<uint8_t> test_hit (double seconds)      // a decaying noise burst, like a drum
+{
+  const double rate = host_engine_sample_rate_hz();
+  std::vector<uint8_t> sample((size_t)(seconds * rate));
+  uint32_t noise = 12345;
+  for (size_t n = 0; n < sample.size(); n++)
+  {
+    noise = noise * 1664525 + 1013904223;
+    sample[n] = (uint8_t)lround(128.0 + 120.0 * exp(-8.0 * n / (seconds * rate)) * ((double)(noise >> 8) / (1 << 24) * 2.0 - 1.0));
+  }
+  return sample;
+}
+
+static std::vector<uint16_t> run (double seconds)
+{
+  std::vector<uint16_t> words((size_t)(seconds * host_engine_sample_rate()));
+  for (uint16_t& word : words)
+  {
+    word = host_engine_tick();
+  }
+  return words;
+}
+
+static double resampled (const std::vector<uint8_t>& sample, double position)   // linear interpolation, as the engine does it
+{
+  const size_t index = (size_t)position;
+  if (index + 1 >= sample.size())
+  {
+    return sample.back();
+  }
+  return sample[index] + (sample[index + 1] - sample[index]) * (position - index);
+}
+
+static double playback_match (const std::vector<uint16_t>& words, const std::vector<uint8_t>& sample, double speed)   // best correlation of the output with the sample played at speed, over the lags it could start at
+{
+  const double fs = host_engine_sample_rate();
+  const double step = speed * host_engine_sample_rate_hz() / fs;
+  const size_t length = (size_t)(CHECK_MEASURE_SECONDS * fs);
+  double best = 0.0;
+  for (size_t lag = 0; lag < (size_t)(CHECK_MAX_LAG_SECONDS * fs) && lag + length <= words.size(); lag++)
+  {
+    double sum_w = 0.0, sum_s = 0.0, sum_ww = 0.0, sum_ss = 0.0, sum_ws = 0.0;
+    for (size_t n = 0; n < length; n++)
+    {
+      const double w = words[lag + n], s = resampled(sample, n * step);
+      sum_w += w; sum_s += s; sum_ww += w * w; sum_ss += s * s; sum_ws += w * s;
+    }
+    const double cov = sum_ws - sum_w * sum_s / length;
+    const double var = (sum_ww - sum_w * sum_w / length) * (sum_ss - sum_s * sum_s / length);
+    const double correlation = var > 0.0 ? cov / sqrt(var) : 0.0;
+    best = correlation > best ? correlation : best;
+  }
+  return best;
+}
+
+static uint64_t samples_to_audible ()           // sample periods from now until the events already received start playing
+{
+  const HostEngineCounters& counters = host_engine_counters();
+  uint64_t samples = 0;
+  while (counters.midi_events_audible < counters.midi_events_received && samples < host_engine_sample_rate())
+  {
+    host_engine_tick();
+    samples++;
+  }
+  return samples;
+}
+
+static void begin_sample_voice (uint8_t program)   // fresh engine, no attack and full sustain so the output follows the sample
+{
+  host_engine_begin();
+  send_message(0xB0, MIDI_CC_ATTACK_TIME, 0);
+  send_message(0xB0, MIDI_CC_SUSTAIN_LEVEL, 127);
+  send_message(0xC0, program, 0);
+  run(0.05);                                    // back to idle before the first note
+}
+
+static bool report (bool pass, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static bool report (bool pass, const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  printf("  %-6s", pass ? "PASS" : "FAIL");
+  vprintf(format, args);
+  va_end(args);
+  printf("\n");
+  return pass;
+}
+
+static int command_check ()
+{
+  if (!host_engine_sample_streaming())
+  {
+    fprintf(stderr, "synth_sampler: the engine was built without SAMPLE_STREAMING\n");
+    return 1;
+  }
+
+  const uint8_t voices = host_engine_voice_count();
+  const uint8_t root = host_engine_sample_root_note();
+  const std::vector<uint8_t> tone = test_tone(CHECK_TONE_SECONDS), hit = test_hit(CHECK_HIT_SECONDS), short_tone = test_tone(CHECK_SHORT_SECONDS);
+  std::vector<std::vector<uint8_t>> samples = {tone, hit};
+  for (uint8_t n = 0; n < CHECK_SHORT_LENGTHS; n++)
+  {
+    samples.emplace_back(short_tone.begin(), short_tone.end() - n);
+  }
+  std::vector<uint8_t> image;
+  build_image(samples, image);
+  char path[] = "/tmp/synth_sampler_XXXXXX";
+  const int fd = mkstemp(path);
+  if (fd < 0 || !write_file(path, image) || !host_engine_open_flash(path))
+  {
+    fprintf(stderr, "synth_sampler: cannot make a test image in /tmp\n");
+    return 1;
+  }
+  close(fd);
+  unlink(path);                                 // stays mapped until host_engine_close_flash()
+
+  printf("Fs = %u Hz, %u voices, samples recorded at %u Hz play at their own pitch on note %u:\n", host_engine_sample_rate(), voices,
+         host_engine_sample_rate_hz(), root);
+  const HostEngineCounters& counters = host_engine_counters();
+  bool pass = true;
+
+  begin_sample_voice(1);
+  send_message(0x90, root, 127);
+  double match = playback_match(run(CHECK_MEASURE_SECONDS + CHECK_MAX_LAG_SECONDS), tone, 1.0);
+  pass = report(match >= CHECK_MIN_CORRELATION, "root note plays the sample, correlation %.5f", match) && pass;
+
+  const uint8_t fast = root + (uint8_t)floor(12.0 * log2(host_engine_sample_step_max() * host_engine_sample_rate() / host_engine_sample_rate_hz()));
+  const double speed = pow(2.0, (fast - root) / 12.0);                                   // the top of the supported range
+  const double step = speed * host_engine_sample_rate_hz() / host_engine_sample_rate();
+  begin_sample_voice(1);
+  send_message(0x90, fast, 127);
+  match = playback_match(run(CHECK_MEASURE_SECONDS + CHECK_MAX_LAG_SECONDS), tone, speed);
+  pass = report(match >= CHECK_MIN_CORRELATION, "%u semitones up plays it at a step of %.3f, correlation %.5f", fast - root, step, match) && pass;
+
+  const double fastest = host_engine_sample_step_max() * host_engine_sample_rate() / host_engine_sample_rate_hz();
+  begin_sample_voice(1);
+  send_message(0x90, fast + CHECK_OVER_SEMITONES, 127);
+  match = playback_match(run(CHECK_MEASURE_SECONDS + CHECK_MAX_LAG_SECONDS), tone, fastest);
+  pass = report(match >= CHECK_MIN_CORRELATION, "%u semitones up plays it at the top step of %.3f, correlation %.5f", fast + CHECK_OVER_SEMITONES - root,
+                host_engine_sample_step_max(), match) && pass;
+
+  uint64_t overruns = 0;
+  for (uint8_t n = 0; n < CHECK_SHORT_LENGTHS; n++)
+  {
+    begin_sample_voice(3 + n);
+    send_message(0x90, fast, 127);
+    run(CHECK_SHORT_SECONDS / speed + 0.1);
+    overruns += counters.ring_overruns;
+  }
+  pass = report(overruns == 0, "and to the end of the sample %u ways without playing past the bytes read (%llu ring overruns)",
+                CHECK_SHORT_LENGTHS, (unsigned long long)overruns) && pass;
+
+  begin_sample_voice(1);
+  for (uint8_t v = 0; v < voices; v++)                                                 // staggered, so all but the first start while the others are streaming
+  {
+    send_message(0x90, root - v, 127);
+    run(0.01);
+  }
+  run(1.0);
+  pass = report(host_engine_sample_underruns() == 0 && host_engine_underruns() == 0 && counters.bus_conflicts == 0,
+                "%u voices streaming at once: %u sample underruns, %u buffer underruns, %llu bus conflicts, %.2f flash bytes per sample",
+                voices, host_engine_sample_underruns(), host_engine_underruns(), (unsigned long long)counters.bus_conflicts,
+                (double)counters.flash_bytes / counters.samples) && pass;
+  pass = report(counters.dac_words == counters.sample_interrupts, "every sample interrupt sent the DAC a whole word (%llu of %llu)",
+                (unsigned long long)counters.dac_words, (unsigned long long)counters.sample_interrupts) && pass;
+
+  begin_sample_voice(2);
+  send_message(0x90, root, 127);                                                        // held down past the end of the sample
+  run(CHECK_HIT_SECONDS + 0.3);
+  const uint64_t idle = counters.idle_samples;
+  run(0.1);
+  pass = report(counters.idle_samples - idle == (uint64_t)(0.1 * host_engine_sample_rate()), "a sample that ends releases its voice, the engine is idle again") && pass;
+
+  begin_sample_voice(0);
+  uint64_t reads = counters.flash_reads;
+  send_message(0x90, root, 127);
+  run(0.2);
+  pass = report(counters.flash_reads == reads && host_engine_counters().dac_words > 0, "program 0 plays the wave tables") && pass;
+
+  printf("note on to first sample:\n");
+  begin_sample_voice(1);
+  send_message(0x90, root, 127);
+  const uint64_t from_idle = samples_to_audible();
+  run(0.05);
+  send_message(0x90, root - 1, 127);
+  const uint64_t while_playing = samples_to_audible();
+  printf("  out of idle %llu sample periods, while playing %llu (the new ring fills while the block before it plays)\n",
+         (unsigned long long)from_idle, (unsigned long long)while_playing);
+
+  printf("every voice streaming above the root note (up to +%u the reads must keep up, past it never let a voice play past them):\n", fast - root);
+  for (uint8_t semitones = 0; semitones <= 19; semitones += semitones < 12 ? 3 : 7)
+  {
+    begin_sample_voice(1);
+    for (uint8_t v = 0; v < voices; v++)
+    {
+      send_message(0x90, root + semitones + v, 127);
+    }
+    run(1.0);
+    const bool supported = root + semitones + voices - 1 <= fast;
+    pass = report(counters.ring_overruns == 0 && (!supported || host_engine_sample_underruns() == 0),
+                  "+%-2u semitones  %6u sample underruns  %3llu ring overruns  %.2f flash bytes per sample%s", semitones, host_engine_sample_underruns(),
+                  (unsigned long long)counters.ring_overruns, (double)counters.flash_bytes / counters.samples, supported ? "" : "  (past the top note)") && pass;
+  }
+
+  host_engine_close_flash();
+  begin_sample_voice(1);
+  reads = counters.flash_reads;
+  send_message(0x90, root, 127);
+  const std::vector<uint16_t> words = run(0.2);
+  bool sounding = false;
+  for (uint16_t word : words)
+  {
+    sounding = sounding || word != words[0];
+  }
+  pass = report(counters.flash_reads == reads && sounding, "with an erased flash program 1 plays the wave tables") && pass;
+
+  printf("%s\n", pass ? "PASS" : "FAIL");
+  return pass ? 0 : 1;
+}
+
+int main (int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    usage();
+    return 2;
+  }
+
+  if (strcmp(argv[1], "pack") == 0)
+  {
+    return command_pack(argc - 2, argv + 2);
+  }
+  if (strcmp(argv[1], "render") == 0)
+  {
+    return command_render(argc - 2, argv + 2);
+  }
+  if (strcmp(argv[1], "check") == 0)
+  {
+    return command_check();
+  }
+
+  usage();
+  return 2;
+}
@@ -0,0 +1,285 @@
+// Real-time streaming host for the synth engine: the firmware's DSP as a soft instrument.
+//
+//   synth_stream [--midi path] [--out path] [--period samples] [--periods n] [--tail seconds] [--seconds n]
+//                [--max-latency-ms ms] [--fail-on-xrun]
+//       Reads raw MIDI bytes from --midi (a FIFO, device or file, default stdin "-") as they arrive and passes them to
+//       the firmware's USART_RX_vect at the wire rate. Audio is rendered in periods of --period samples (default 128)
+//       paced by the wall clock, like a sound card pulling them, and written as raw 16 bit little endian mono PCM at Fs
+//       (12 bit words left justified, as in the WAVs) to --out (default stdout "-", "null" throws it away). --periods
+//       periods (default 2) are buffered ahead of playback, which is the output latency.
+//
+//       Runs until --tail seconds (default 0.5) after the end of the input, or for --seconds. The report on stderr
+//       counts xruns (periods not ready by the time playback reached them) and gives the MIDI to audio latency of
+//       every event: from its last byte arriving on the input to the block it is first heard in starting to play.
+//       Exits 1 when --fail-on-xrun and there was one, or when an event took longer than --max-latency-ms.
+
+#include "host_engine.h"
+#include "host_render.h"
+#include "midi_input.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define STREAM_DEFAULT_PERIOD 128               // 8ms at 16kHz
+#define STREAM_DEFAULT_PERIODS 2
+#define STREAM_DEFAULT_TAIL_SECONDS 0.5
+#define STREAM_READ_CHUNK 256
+
+typedef std::chrono::steady_clock Clock;
+
+struct ArrivedByte
+{
+  Clock::time_point arrived;
+  uint8_t data;
+};
+
+struct MidiReader                               // a thread blocking on the input, timestamping every byte as it comes in
+{
+  std::mutex lock;
+  std::vector<ArrivedByte> bytes;               // arrived, not yet taken by the audio loop
+  std::atomic<bool> ended{false};
+  Clock::time_point ended_at;                   // set before ended
+  int stop[2] = {-1, -1};                       // a byte written to stop[1] ends the thread even while the input has nothing to read
+};
+
+static void usage ()
+{
+  fprintf(stderr, "usage: synth_stream [--midi path] [--out path] [--period samples] [--periods n] [--tail seconds] [--seconds n]\n"
+                  "                    [--max-latency-ms ms] [--fail-on-xrun]\n");
+}
+
+static void read_midi (int fd, MidiReader* reader)
+{
+  uint8_t chunk[STREAM_READ_CHUNK];
+  pollfd waiting[2] = {{fd, POLLIN, 0}, {reader->stop[0], POLLIN, 0}};
+  while (true)
+  {
+    if (poll(waiting, 2, -1) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      break;
+    }
+    if (waiting[1].revents)                                     // main() is done with the stream
+    {
+      break;
+    }
+    const ssize_t count = read(fd, chunk, sizeof(chunk));
+    if (count <= 0)
+    {
+      break;
+    }
+    const Clock::time_point now = Clock::now();
+    std::lock_guard<std::mutex> guard(reader->lock);
+    for (ssize_t i = 0; i < count; i++)
+    {
+      reader->bytes.push_back({now, chunk[i]});
+    }
+  }
+  reader->ended_at = Clock::now();
+  reader->ended = true;
+}
+
+static double milliseconds (Clock::duration duration)
+{
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+int main (int argc, char** argv)
+{
+  const char* midi_path = "-";
+  const char* out_path = "-";
+  uint32_t period = STREAM_DEFAULT_PERIOD;
+  uint32_t periods = STREAM_DEFAULT_PERIODS;
+  double tail = STREAM_DEFAULT_TAIL_SECONDS;
+  double seconds = 0.0;                                         // 0 runs until the input ends
+  double max_latency_ms = 0.0;                                  // 0 doesn't check
+  bool fail_on_xrun = false;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--midi") == 0 && has_value)
+    {
+      midi_path = argv[++i];
+    } else if (strcmp(argv[i], "--out") == 0 && has_value)
+    {
+      out_path = argv[++i];
+    } else if (strcmp(argv[i], "--period") == 0 && has_value)
+    {
+      period = (uint32_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--periods") == 0 && has_value)
+    {
+      periods = (uint32_t)atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--tail") == 0 && has_value)
+    {
+      tail = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--seconds") == 0 && has_value)
+    {
+      seconds = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--max-latency-ms") == 0 && has_value)
+    {
+      max_latency_ms = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--fail-on-xrun") == 0)
+    {
+      fail_on_xrun = true;
+    } else
+    {
+      usage();
+      return 2;
+    }
+  }
+  if (period == 0 || periods == 0)
+  {
+    usage();
+    return 2;
+  }
+
+  const int fd = strcmp(midi_path, "-") == 0 ? 0 : open(midi_path, O_RDONLY);
+  if (fd < 0)
+  {
+    fprintf(stderr, "synth_stream: cannot open %s\n", midi_path);
+    return 1;
+  }
+  FILE* out = nullptr;
+  if (strcmp(out_path, "-") == 0)
+  {
+    out = stdout;
+  } else if (strcmp(out_path, "null") != 0 && !(out = fopen(out_path, "wb")))
+  {
+    fprintf(stderr, "synth_stream: cannot write %s\n", out_path);
+    return 1;
+  }
+
+  host_engine_begin();
+  const double fs = host_engine_sample_rate();
+  const uint64_t sample_limit = seconds > 0.0 ? (uint64_t)(seconds * fs) : UINT64_MAX;
+  const Clock::duration period_time = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(period / fs));
+  const Clock::duration buffered_time = period_time * periods;
+
+  MidiReader reader;
+  if (pipe(reader.stop) != 0)
+  {
+    fprintf(stderr, "synth_stream: cannot make a pipe\n");
+    return 1;
+  }
+  std::thread reader_thread(read_midi, fd, &reader);           // may still be waiting on the input when the stream ends, stopped and joined below
+
+  std::vector<TimedMidiByte> wire_bytes;                        // engine timeline: every byte goes on the wire at the start of the period it was taken in
+  std::vector<Clock::time_point> wire_arrived;                  // when each of wire_bytes arrived on the input
+  MidiWire wire(wire_bytes);
+  std::deque<Clock::time_point> unheard;                        // arrival of every event the engine has but isn't playing yet
+  std::vector<uint8_t> pcm(period * 2);
+
+  const HostEngineCounters& counters = host_engine_counters();
+  uint64_t received = 0, audible = 0;
+  uint64_t sample = 0, period_count = 0, xruns = 0, heard = 0;
+  double worst_late_ms = 0.0, latency_min = 0.0, latency_max = 0.0, latency_total = 0.0;
+
+  Clock::time_point start = Clock::now();                       // period k is rendered from start + k periods and plays from start + (k + periods) periods
+  while (sample < sample_limit && !(reader.ended && Clock::now() - reader.ended_at >= std::chrono::duration<double>(tail)))
+  {
+    std::this_thread::sleep_until(start + period_time * period_count);
+    {
+      std::lock_guard<std::mutex> guard(reader.lock);
+      for (const ArrivedByte& byte : reader.bytes)
+      {
+        wire_bytes.push_back({(uint64_t)((sample * 1000000) / fs), byte.data});
+        wire_arrived.push_back(byte.arrived);
+      }
+      reader.bytes.clear();
+    }
+
+    const Clock::time_point plays_at = start + period_time * period_count + buffered_time;
+    for (uint32_t i = 0; i < period; i++, sample++)
+    {
+      wire.deliver_until((uint64_t)((sample * 1000000) / fs));
+      for (; received < counters.midi_events_received; received++)
+      {
+        unheard.push_back(wire_arrived[wire.delivered() - 1]);  // at most one byte goes on the wire per sample, so this is the event's last byte
+      }
+
+      const uint16_t word = host_engine_tick();
+      const int16_t value = (int16_t)((int32_t)(word & 0x0FFF) * 16 - 32768);
+      pcm[i * 2] = value & 0xFF;
+      pcm[i * 2 + 1] = (uint16_t)value >> 8;
+
+      for (; audible < counters.midi_events_audible && !unheard.empty(); audible++)
+      {
+        const double latency = milliseconds(plays_at + std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(i / fs)) -
+                                            unheard.front());
+        unheard.pop_front();
+        latency_min = heard == 0 || latency < latency_min ? latency : latency_min;
+        latency_max = latency > latency_max ? latency : latency_max;
+        latency_total += latency;
+        heard++;
+      }
+    }
+
+    const size_t delivered = wire.delivered();                  // only the bytes still to go on the wire are needed from here on, a long session mustn't keep them all
+    wire_bytes.erase(wire_bytes.begin(), wire_bytes.begin() + delivered);
+    wire_arrived.erase(wire_arrived.begin(), wire_arrived.begin() + delivered);
+    wire.forget(delivered);
+
+    if (out)
+    {
+      fwrite(pcm.data(), 1, pcm.size(), out);
+      fflush(out);
+    }
+
+    const Clock::time_point finished = Clock::now();
+    if (finished > plays_at)                                    // playback got here first and played silence, start again from now as a sound card would
+    {
+      xruns++;
+      worst_late_ms = milliseconds(finished - plays_at) > worst_late_ms ? milliseconds(finished - plays_at) : worst_late_ms;
+      start += finished - plays_at;
+    }
+    period_count++;
+  }
+
+  if (out && out != stdout)
+  {
+    fclose(out);
+  }
+  const uint8_t stop = 0;
+  if (write(reader.stop[1], &stop, 1) != 1)
+  {
+    fprintf(stderr, "synth_stream: cannot stop the MIDI reader\n");
+  }
+  reader_thread.join();                                         // before reader goes out of scope
+  close(reader.stop[0]);
+  close(reader.stop[1]);
+
+  fprintf(stderr, "synth_stream: %llu periods of %u samples (%.2f s at %.0f Hz), output latency %.1f ms, %llu xruns (worst %.1f ms late)\n",
+          (unsigned long long)period_count, period, sample / fs, fs, milliseconds(buffered_time), (unsigned long long)xruns, worst_late_ms);
+  fprintf(stderr, "  MIDI in %llu bytes, %llu events (%u dropped, %u parse errors), %llu heard, %zu still to be heard\n",
+          (unsigned long long)counters.midi_bytes_in, (unsigned long long)counters.midi_events_received, counters.midi_dropped_events,
+          counters.midi_parse_errors, (unsigned long long)heard, unheard.size());
+  fprintf(stderr, "  MIDI to audio latency: min %.2f ms, avg %.2f ms, max %.2f ms\n", latency_min,
+          heard ? latency_total / heard : 0.0, latency_max);
+  fprintf(stderr, "  engine buffer underruns %u\n", host_engine_underruns());
+
+  if (fail_on_xrun && xruns)
+  {
+    return 1;
+  }
+  if (max_latency_ms > 0.0 && latency_max > max_latency_ms)
+  {
+    fprintf(stderr, "synth_stream: latency over %.1f ms\n", max_latency_ms);
+    return 1;
+  }
+  return 0;
+}
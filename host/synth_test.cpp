@@ -0,0 +1,284 @@
+// Golden output regression and performance tests for the host build of the synth engine.
+//
+//   synth_test [--golden-dir dir] [--update] [--tolerance lsb] [--min-realtime x] [--runs n] [--threads n] <scenario>...
+//       Renders each MIDI scenario (see midi_input.h for formats, tests/scenarios has the scripts) through the firmware
+//       --runs times, checks every run came out the same, then compares the DAC words against the golden PCM for this
+//       build's Fs and voice count. A case fails if any word differs by more than --tolerance (default 0, bit exact) or
+//       the best run renders slower than --min-realtime times real time, or the parser dropped a different number of
+//       events than the script's expect-dropped line says. --update writes the golden files instead, from at least two runs
+//       that came out the same.
+//       --threads n renders the scenarios side by side on a work pool (work_pool.h), each thread with its own engine;
+//       the results have to be the same as rendering them one at a time.
+//
+// Golden files are the raw 12 bit DAC words, little endian 16 bit, named <scenario>.<Fs>hz-<voices>v<tag>.pcm, where the
+// tag names any other firmware setting the build overrides that changes the output (host_engine_config_tag(), e.g.
+// "-filter0"). A scenario with no golden file for this build is skipped; the exit status is 77 (ctest's SKIP_RETURN_CODE)
+// when every one is.
+
+#include "host_engine.h"
+#include "host_render.h"
+#include "midi_input.h"
+#include "work_pool.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#define TEST_TAIL_SECONDS 0.25                  // rendered after the last MIDI byte, long enough for the default release
+#define TEST_DEFAULT_RUNS 3
+#define TEST_DEFAULT_MIN_REALTIME 50.0          // far under what any build renders at, only a real slowdown trips it
+#define TEST_SKIPPED 77
+
+#define CASE_PASSED 0
+#define CASE_FAILED 1
+#define CASE_SKIPPED 2
+
+struct TestSettings
+{
+  std::string golden_dir = ".";
+  bool update = false;
+  int tolerance = 0;
+  double min_realtime = TEST_DEFAULT_MIN_REALTIME;
+  int runs = TEST_DEFAULT_RUNS;
+};
+
+struct CaseResult
+{
+  std::string report;                           // the case's line of output, printed in scenario order once every case is done
+  int outcome = CASE_PASSED;
+};
+
+static void usage ()
+{
+  fprintf(stderr, "usage: synth_test [--golden-dir dir] [--update] [--tolerance lsb] [--min-realtime x] [--runs n] [--threads n] <scenario>...\n");
+}
+
+static std::string scenario_name (const std::string& path)     // file name without directories or extension
+{
+  const size_t slash = path.find_last_of('/');
+  std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+  const size_t dot = name.find_last_of('.');
+  return dot == std::string::npos ? name : name.substr(0, dot);
+}
+
+static std::string golden_path (const std::string& dir, const std::string& name)
+{
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".%uhz-%uv", host_engine_sample_rate(), host_engine_voice_count());
+  return dir + "/" + name + suffix + host_engine_config_tag() + ".pcm";
+}
+
+static bool read_golden (const std::string& path, std::vector<uint16_t>& words)
+{
+  FILE* file = fopen(path.c_str(), "rb");
+  if (!file)
+  {
+    return false;
+  }
+  words.clear();
+  uint8_t bytes[2];
+  while (fread(bytes, 1, 2, file) == 2)
+  {
+    words.push_back(bytes[0] | (bytes[1] << 8));
+  }
+  fclose(file);
+  return true;
+}
+
+static bool write_golden (const std::string& path, const std::vector<uint16_t>& words)
+{
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file)
+  {
+    return false;
+  }
+  for (uint16_t word : words)
+  {
+    const uint8_t bytes[2] = { (uint8_t)word, (uint8_t)(word >> 8) };
+    fwrite(bytes, 1, 2, file);
+  }
+  return fclose(file) == 0;
+}
+
+static void report (CaseResult& result, const char* format, ...)
+{
+  char line[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  result.report += line;
+}
+
+static CaseResult run_case (const std::string& path, const TestSettings& settings)   // renders and checks one scenario on the calling thread's engine
+{
+  CaseResult result;
+  const std::string name = scenario_name(path);
+  std::vector<TimedMidiByte> bytes;
+  std::string error;
+  MidiScriptExtras extras;
+  if (!load_midi_input(path, bytes, error, &extras))
+  {
+    report(result, "%-20s FAIL  %s\n", name.c_str(), error.c_str());
+    result.outcome = CASE_FAILED;
+    return result;
+  }
+
+  RenderOptions options;
+  options.tail_seconds = TEST_TAIL_SECONDS;
+  options.stalls = extras.stalls;
+
+  std::vector<uint16_t> words, again;
+  double best = 0.0;
+  bool deterministic = true;
+  const int runs = settings.update && settings.runs < 2 ? 2 : settings.runs;   // a golden is only written from a render that came out the same twice
+  for (int run = 0; run < runs; run++)
+  {
+    const RenderResult render = render_midi(bytes, options, nullptr, run == 0 ? &words : &again);
+    best = (run == 0 || render.wall_seconds < best) ? render.wall_seconds : best;
+    deterministic = deterministic && (run == 0 || again == words);             // host_engine_begin() has to put every global back
+  }
+  const double fs = host_engine_sample_rate();
+  const double rate = best > 0.0 ? words.size() / best : 0.0;
+  const HostEngineCounters& counters = host_engine_counters();
+
+  report(result, "%-20s %8zu samples  %6.2f Msamples/s (%6.0fx real time)  %u dropped, %u parse errors, %u underruns  ",
+         name.c_str(), words.size(), rate / 1e6, rate / fs, counters.midi_dropped_events, counters.midi_parse_errors,
+         host_engine_underruns());
+  if (extras.expect_dropped >= 0 && counters.midi_dropped_events != (uint32_t)extras.expect_dropped)
+  {
+    report(result, "FAIL  the script expects %d dropped\n", extras.expect_dropped);
+    result.outcome = CASE_FAILED;
+    return result;
+  }
+
+  if (!deterministic)
+  {
+    report(result, "FAIL  runs rendered differently%s\n", settings.update ? ", golden not updated" : "");
+    result.outcome = CASE_FAILED;
+    return result;
+  }
+
+  const std::string golden_file = golden_path(settings.golden_dir, name);
+  if (settings.update)
+  {
+    if (!write_golden(golden_file, words))
+    {
+      report(result, "FAIL  cannot write %s\n", golden_file.c_str());
+      result.outcome = CASE_FAILED;
+    } else
+    {
+      report(result, "updated %s\n", golden_file.c_str());
+    }
+    return result;
+  }
+
+  std::vector<uint16_t> golden;
+  if (!read_golden(golden_file, golden))
+  {
+    report(result, "SKIP  no %s\n", golden_file.c_str());
+    result.outcome = CASE_SKIPPED;
+    return result;
+  }
+  if (golden.size() != words.size())
+  {
+    report(result, "FAIL  %zu samples, golden has %zu\n", words.size(), golden.size());
+    result.outcome = CASE_FAILED;
+    return result;
+  }
+
+  size_t first = words.size();
+  int worst = 0;
+  for (size_t n = 0; n < words.size(); n++)
+  {
+    const int diff = abs((int)words[n] - (int)golden[n]);
+    if (diff > settings.tolerance && first == words.size())
+    {
+      first = n;
+    }
+    worst = diff > worst ? diff : worst;
+  }
+  if (first != words.size())
+  {
+    report(result, "FAIL  differs from sample %zu (%.3f s), worst by %d LSB\n", first, first / fs, worst);
+    result.outcome = CASE_FAILED;
+  } else if (rate / fs < settings.min_realtime)
+  {
+    report(result, "FAIL  slower than %.0fx real time\n", settings.min_realtime);
+    result.outcome = CASE_FAILED;
+  } else if (worst)
+  {
+    report(result, "PASS  within %d LSB\n", worst);
+  } else
+  {
+    report(result, "PASS  bit exact\n");
+  }
+  return result;
+}
+
+int main (int argc, char** argv)
+{
+  TestSettings settings;
+  unsigned threads = 1;
+  std::vector<std::string> scenarios;
+
+  for (int i = 1; i < argc; i++)
+  {
+    const bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--golden-dir") == 0 && has_value)
+    {
+      settings.golden_dir = argv[++i];
+    } else if (strcmp(argv[i], "--update") == 0)
+    {
+      settings.update = true;
+    } else if (strcmp(argv[i], "--tolerance") == 0 && has_value)
+    {
+      settings.tolerance = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--min-realtime") == 0 && has_value)
+    {
+      settings.min_realtime = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--runs") == 0 && has_value)
+    {
+      settings.runs = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 1;
+    } else if (strcmp(argv[i], "--threads") == 0 && has_value)
+    {
+      threads = (unsigned)atoi(argv[++i]);
+    } else if (argv[i][0] == '-')
+    {
+      usage();
+      return 2;
+    } else
+    {
+      scenarios.push_back(argv[i]);
+    }
+  }
+  if (scenarios.empty())
+  {
+    usage();
+    return 2;
+  }
+
+  std::vector<CaseResult> results(scenarios.size());
+  run_work_pool(scenarios.size(), threads, [&] (size_t job, unsigned)
+  {
+    results[job] = run_case(scenarios[job], settings);
+  });
+
+  int failed = 0;
+  int skipped = 0;
+  for (const CaseResult& result : results)
+  {
+    fputs(result.report.c_str(), stdout);
+    failed += result.outcome == CASE_FAILED;
+    skipped += result.outcome == CASE_SKIPPED;
+  }
+
+  if (failed)
+  {
+    return 1;
+  }
+  return skipped == (int)scenarios.size() ? TEST_SKIPPED : 0;
+}
@@ -0,0 +1,75 @@
+#include "wav_writer.h"
+
+static void put_u16 (FILE* file, uint16_t value)
+{
+  fputc(value & 0xFF, file);
+  fputc(value >> 8, file);
+}
+
+static void put_u32 (FILE* file, uint32_t value)
+{
+  put_u16(file, value & 0xFFFF);
+  put_u16(file, value >> 16);
+}
+
+WavWriter::~WavWriter ()
+{
+  close();
+}
+
+bool WavWriter::open (const char* path, uint32_t sample_rate)
+{
+  close();
+
+  file = fopen(path, "wb");
+  if (!file)
+  {
+    return false;
+  }
+  samples = 0;
+
+  fwrite("RIFF", 1, 4, file);
+  put_u32(file, 0);                                 // RIFF size, patched in close()
+  fwrite("WAVEfmt ", 1, 8, file);
+  put_u32(file, 16);                                // PCM fmt chunk size
+  put_u16(file, 1);                                 // PCM
+  put_u16(file, 1);                                 // mono
+  put_u32(file, sample_rate);
+  put_u32(file, sample_rate * 2);                   // byte rate
+  put_u16(file, 2);                                 // block align
+  put_u16(file, 16);                                // bits per sample
+  fwrite("data", 1, 4, file);
+  put_u32(file, 0);                                 // data size, patched in close()
+
+  return !ferror(file);
+}
+
+void WavWriter::write (int16_t sample)
+{
+  put_u16(file, (uint16_t)sample);
+  samples++;
+}
+
+void WavWriter::write_dac_word (uint16_t word)
+{
+  write((int16_t)((int32_t)(word & 0x0FFF) * 16 - 32768));
+}
+
+bool WavWriter::close ()
+{
+  if (!file)
+  {
+    return true;
+  }
+
+  const uint32_t data_bytes = (uint32_t)(samples * 2);
+  fseek(file, 4, SEEK_SET);
+  put_u32(file, 36 + data_bytes);
+  fseek(file, 40, SEEK_SET);
+  put_u32(file, data_bytes);
+
+  const bool ok = !ferror(file);
+  fclose(file);
+  file = nullptr;
+  return ok;
+}
@@ -0,0 +1,28 @@
+// Streams mono 16 bit PCM to a RIFF/WAVE file. The header is written up front with empty sizes and
+// patched on close, so renders of any length never have to be held in memory.
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+class WavWriter
+{
+public:
+  WavWriter () = default;
+  ~WavWriter ();
+
+  WavWriter (const WavWriter&) = delete;
+  WavWriter& operator= (const WavWriter&) = delete;
+
+  bool open (const char* path, uint32_t sample_rate);
+  void write (int16_t sample);
+  void write_dac_word (uint16_t word);               // 12 bit unipolar DAC word, stored left justified in the 16 bit sample
+  bool close ();
+
+  uint64_t samples_written () const { return samples; }
+
+private:
+  FILE* file = nullptr;
+  uint64_t samples = 0;
+};
@@ -0,0 +1,76 @@
+#include "work_pool.h"
+
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct WorkQueue
+{
+  std::mutex lock;
+  std::deque<size_t> jobs;
+};
+
+static bool take_job (std::vector<WorkQueue>& queues, unsigned worker, size_t& job)
+{
+  {
+    WorkQueue& own = queues[worker];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.jobs.empty())
+    {
+      job = own.jobs.front();
+      own.jobs.pop_front();
+      return true;
+    }
+  }
+
+  for (size_t i = 1; i < queues.size(); i++)                   // own queue is empty, steal the job its owner would get to last
+  {
+    WorkQueue& victim = queues[(worker + i) % queues.size()];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.jobs.empty())
+    {
+      job = victim.jobs.back();
+      victim.jobs.pop_back();
+      return true;
+    }
+  }
+  return false;                                                 // no job is ever added once the pool starts, so this worker is done
+}
+
+unsigned work_pool_threads (unsigned requested)
+{
+  if (requested)
+  {
+    return requested;
+  }
+  const unsigned cores = std::thread::hardware_concurrency();
+  return cores ? cores : 1;
+}
+
+void run_work_pool (size_t count, unsigned threads, const std::function<void (size_t job, unsigned worker)>& work)
+{
+  threads = work_pool_threads(threads);
+  std::vector<WorkQueue> queues(threads);
+  for (size_t job = 0; job < count; job++)
+  {
+    queues[job % threads].jobs.push_back(job);
+  }
+
+  std::vector<std::thread> workers;
+  for (unsigned worker = 0; worker < threads; worker++)
+  {
+    workers.emplace_back([&queues, &work, worker]
+    {
+      size_t job;
+      while (take_job(queues, worker, job))
+      {
+        work(job, worker);
+      }
+    });
+  }
+  for (std::thread& thread : workers)
+  {
+    thread.join();
+  }
+}
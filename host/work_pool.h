@@ -0,0 +1,13 @@
+// Work stealing thread pool for the batch tools. Jobs are numbered 0 to count - 1 and dealt out round robin, one queue
+// per worker; a worker takes jobs from the front of its own queue and, once that is empty, steals from the back of the
+// others', so a worker that drew short renders helps out with the long ones. Every worker is its own thread and so
+// gets its own engine (avr_stub.h makes the firmware's state thread_local).
+
+#pragma once
+
+#include <stddef.h>
+#include <functional>
+
+unsigned work_pool_threads (unsigned requested);   // requested, or one per core when 0
+
+void run_work_pool (size_t count, unsigned threads, const std::function<void (size_t job, unsigned worker)>& work);